@@ -0,0 +1,159 @@
+#include <string.h>
+
+#include "audio.h"
+
+#define PATTERN_BITS (CHIP8_PATTERN_SIZE * 8)
+#define PATTERN_BASE_HZ 4000.0 // Pattern bits per second at pitch 64
+#define PITCH_STEP 1.0145453349375237 // 2^(1/48), a pitch unit
+
+void chip8_audio_init(chip8_audio_t *audio, uint32_t cpu_hz) {
+  memset(audio, 0, sizeof(chip8_audio_t));
+  audio->cpu_hz = cpu_hz;
+
+  // Multiplied out from pitch 64 so no libm is needed
+  double step = PATTERN_BASE_HZ / CHIP8_AUDIO_RATE;
+  for (int pitch = 64; pitch < 256; pitch++, step *= PITCH_STEP) {
+    audio->pattern_steps[pitch] = step;
+  }
+  step = PATTERN_BASE_HZ / CHIP8_AUDIO_RATE;
+  for (int pitch = 63; pitch >= 0; pitch--) {
+    step /= PITCH_STEP;
+    audio->pattern_steps[pitch] = step;
+  }
+
+  audio->beep = true;
+  audio->step = (double)CHIP8_AUDIO_BEEP_HZ / CHIP8_AUDIO_RATE;
+
+  atomic_init(&audio->head, 0);
+  atomic_init(&audio->tail, 0);
+  atomic_init(&audio->now, 0);
+}
+
+void chip8_audio_set_cpu_hz(chip8_audio_t *audio, uint32_t cpu_hz) {
+  // Keep the fraction of a sample that was already accumulated
+  audio->clock_frac = audio->clock_frac * cpu_hz / audio->cpu_hz;
+  audio->cpu_hz = cpu_hz;
+}
+
+// Queues the sound of chip8 at sample unless it is what was queued last
+static void push(chip8_audio_t *audio, const chip8_t *chip8, uint64_t sample) {
+  chip8_audio_event_t event = {.sample = sample,
+                               .on = chip8->sound_timer > 0,
+                               .pitch = chip8->pitch};
+  memcpy(event.pattern, chip8->pattern, CHIP8_PATTERN_SIZE);
+
+  const chip8_audio_event_t *last = &audio->pushed;
+  if (event.on == last->on && event.pitch == last->pitch &&
+      memcmp(event.pattern, last->pattern, CHIP8_PATTERN_SIZE) == 0) {
+    return;
+  }
+
+  uint64_t head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+
+  // Only reload the consumer position when the cached one says full
+  if (head - audio->cached_tail == CHIP8_AUDIO_QUEUE_SIZE) {
+    audio->cached_tail =
+        atomic_load_explicit(&audio->tail, memory_order_acquire);
+    if (head - audio->cached_tail == CHIP8_AUDIO_QUEUE_SIZE) {
+      return;
+    }
+  }
+
+  audio->events[head & (CHIP8_AUDIO_QUEUE_SIZE - 1)] = event;
+  audio->pushed = event;
+  atomic_store_explicit(&audio->head, head + 1, memory_order_release);
+}
+
+void chip8_audio_begin(chip8_audio_t *audio, uint64_t cycles) {
+  audio->run_cycles = cycles;
+}
+
+void chip8_audio_changed(chip8_audio_t *audio, const chip8_t *chip8,
+                         uint64_t left) {
+  uint64_t done = audio->run_cycles - left;
+  push(audio, chip8,
+       audio->clock +
+           (audio->clock_frac + done * CHIP8_AUDIO_RATE) / audio->cpu_hz);
+}
+
+void chip8_audio_end(chip8_audio_t *audio, const chip8_t *chip8) {
+  uint64_t scaled = audio->clock_frac + audio->run_cycles * CHIP8_AUDIO_RATE;
+  audio->clock += scaled / audio->cpu_hz;
+  audio->clock_frac = scaled % audio->cpu_hz;
+  audio->run_cycles = 0;
+
+  push(audio, chip8, audio->clock);
+  atomic_store_explicit(&audio->now, audio->clock, memory_order_release);
+}
+
+static void apply(chip8_audio_t *audio, const chip8_audio_event_t *event) {
+  bool beep = true;
+  for (int i = 0; i < CHIP8_PATTERN_SIZE; i++) {
+    beep &= event->pattern[i] == 0;
+  }
+
+  // Start each sound at the beginning of its waveform
+  if ((event->on && !audio->playing.on) || beep != audio->beep) {
+    audio->phase = 0;
+  }
+
+  audio->playing = *event;
+  audio->beep = beep;
+  audio->step = beep ? (double)CHIP8_AUDIO_BEEP_HZ / CHIP8_AUDIO_RATE
+                     : audio->pattern_steps[event->pitch];
+}
+
+// One 1-bit sample of the playing sound
+static float next_sample(chip8_audio_t *audio) {
+  if (!audio->playing.on) {
+    return 0;
+  }
+
+  bool high;
+  double period;
+  if (audio->beep) {
+    high = audio->phase < 0.5;
+    period = 1;
+  } else {
+    int bit = (int)audio->phase;
+    high = (audio->playing.pattern[bit / 8] >> (7 - bit % 8)) & 1;
+    period = PATTERN_BITS;
+  }
+
+  audio->phase += audio->step;
+  if (audio->phase >= period) {
+    audio->phase -= period;
+  }
+  return high ? CHIP8_AUDIO_VOLUME : -CHIP8_AUDIO_VOLUME;
+}
+
+void chip8_audio_render(chip8_audio_t *audio, float *out, int frames) {
+  uint64_t now = atomic_load_explicit(&audio->now, memory_order_acquire);
+  uint64_t head = atomic_load_explicit(&audio->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+
+  // Fell behind, at start up or after a hitch, catch up to the latency
+  // target instead of playing stale sound
+  if (now > audio->position + CHIP8_AUDIO_MAX_LAG) {
+    audio->position = now - CHIP8_AUDIO_LATENCY;
+  }
+
+  for (int i = 0; i < frames; i++) {
+    while (tail != head &&
+           audio->events[tail & (CHIP8_AUDIO_QUEUE_SIZE - 1)].sample <=
+               audio->position) {
+      apply(audio, &audio->events[tail & (CHIP8_AUDIO_QUEUE_SIZE - 1)]);
+      tail++;
+    }
+
+    out[i] = next_sample(audio);
+
+    // Never play past the emulator, the sound holds while it catches up
+    if (audio->position < now) {
+      audio->position++;
+    }
+  }
+
+  // Hand the applied slots back to the producer
+  atomic_store_explicit(&audio->tail, tail, memory_order_release);
+}
@@ -0,0 +1,79 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define CHIP8_AUDIO_RATE 48000     // Samples per second, mono
+#define CHIP8_AUDIO_QUEUE_SIZE 256 // Sound changes in flight, a power of two
+// Playback trails the emulator by this much so changes arrive before they
+// are due, and skips ahead when it falls further behind than the max lag
+#define CHIP8_AUDIO_LATENCY (CHIP8_AUDIO_RATE / 100) // 10 ms
+#define CHIP8_AUDIO_MAX_LAG (CHIP8_AUDIO_RATE / 40)  // 25 ms
+#define CHIP8_AUDIO_BEEP_HZ 440 // Square wave while no pattern is loaded
+#define CHIP8_AUDIO_VOLUME 0.15f
+
+// What the speaker does from sample on, in emulated time
+typedef struct {
+  uint64_t sample;
+  bool on; // Sound timer running
+  uint8_t pitch;
+  uint8_t pattern[CHIP8_PATTERN_SIZE]; // All zero plays the beep
+} chip8_audio_event_t;
+
+// Single producer, single consumer queue of sound changes. The emulating
+// thread stamps each change with the sample it happened at and the audio
+// callback applies it when playback reaches that sample, so neither side
+// ever waits for the other. A full queue holds the change back until the
+// next chip8_audio_end.
+typedef struct chip8_audio {
+  chip8_audio_event_t events[CHIP8_AUDIO_QUEUE_SIZE];
+  uint32_t cpu_hz; // Converts cycles to samples, may change between runs
+
+  // Producer side, only touched by the emulating thread
+  uint64_t clock;      // Emulated samples before the current run
+  uint64_t clock_frac; // Remainder of clock, in samples * cpu_hz
+  uint64_t run_cycles; // Length of the current run
+  chip8_audio_event_t pushed; // Last change queued
+  uint64_t cached_tail;
+
+  // Consumer side, only touched by the audio callback
+  chip8_audio_event_t playing;
+  bool beep;         // Playing the square wave rather than the pattern
+  uint64_t position; // Emulated sample being played
+  double phase;      // Into the pattern in bits, or the beep in periods
+  double step;       // Phase advance per sample
+  double pattern_steps[256]; // Bits per sample for each pitch
+
+  // Next change to queue, next change to apply and the emulated time the
+  // emulator has reached, kept apart on their own cache lines
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) _Atomic uint64_t now;
+} chip8_audio_t;
+
+// Starts silent at sample 0, attach with chip8->audio = audio
+void chip8_audio_init(chip8_audio_t *audio, uint32_t cpu_hz);
+// Between runs, e.g. to keep emulated time in step with the wall clock
+// while running faster than cpu_hz
+void chip8_audio_set_cpu_hz(chip8_audio_t *audio, uint32_t cpu_hz);
+
+// Producer, the emulating thread. Bracket each chip8_run, and the timer
+// decrement that follows it, with begin and end.
+void chip8_audio_begin(chip8_audio_t *audio, uint64_t cycles);
+// Called by chip8_run after an instruction that changed the sound, with
+// the cycles left in the run. Changes made through chip8_cycle or the JIT
+// are stamped at the end of the run instead.
+void chip8_audio_changed(chip8_audio_t *audio, const chip8_t *chip8,
+                         uint64_t left);
+// Moves past the run and queues the sound if it changed since, timer
+// decrements and state loads included
+void chip8_audio_end(chip8_audio_t *audio, const chip8_t *chip8);
+
+// Consumer, the audio callback. Fills out with frames samples.
+void chip8_audio_render(chip8_audio_t *audio, float *out, int frames);
+
+#endif
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+#define LANES CHIP8_BATCH_LANES
+
+// All ones in a lane where a comparison held, what vector compares return
+typedef int8_t mask8_t __attribute__((vector_size(LANES)));
+typedef int16_t mask16_t __attribute__((vector_size(LANES * 2)));
+typedef int32_t mask32_t __attribute__((vector_size(LANES * 4)));
+
+#define WIDEN8(m) __builtin_convertvector((m), mask16_t)
+#define NARROW16(m) __builtin_convertvector((m), mask8_t)
+
+// b where mask is set, a elsewhere
+#define BLEND(mask, a, b)                                                      \
+  (((a) & ~(__typeof__(a))(mask)) | ((b) & (__typeof__(a))(mask)))
+
+// A copy of the run loop per instruction set, picked when the program loads.
+// Compares of vectors wider than the target's registers are done a lane at
+// a time, so without AVX2 the 16 bit vectors lose most of their speed.
+#if defined(__x86_64__) && defined(__linux__)
+#define BATCH_TARGETS                                                          \
+  __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+// Vectors are passed by pointer, those wider than the target's registers
+// have no stable calling convention
+
+static bool any_lane(const mask16_t *mask) {
+  bool any = false;
+  for (int lane = 0; lane < LANES; lane++) {
+    any |= (*mask)[lane] != 0;
+  }
+  return any;
+}
+
+bool chip8_batch_init(chip8_batch_t *batch, const chip8_t *prototype,
+                      uint32_t seed) {
+  memset(batch, 0, sizeof(chip8_batch_t));
+  batch->machines = malloc(LANES * sizeof(chip8_t));
+  if (!batch->machines) {
+    perror("malloc");
+    return false;
+  }
+  batch->quirks = chip8_quirk_flags(prototype->quirks);
+
+  for (int lane = 0; lane < LANES; lane++) {
+    chip8_t *chip8 = &batch->machines[lane];
+    memcpy(chip8, prototype, sizeof(chip8_t));
+    chip8_seed(chip8, seed + lane);
+    // Observers, capture included, are not lane aware, they stay with the
+    // prototype
+    chip8->profile = NULL;
+    chip8->trace = NULL;
+    chip8->audio = NULL;
+    chip8->capture = NULL;
+
+    for (int i = 0; i < 16; i++) {
+      batch->V[i][lane] = chip8->V[i];
+    }
+    batch->I[lane] = chip8->I;
+    batch->PC[lane] = chip8->PC;
+    batch->delay_timer[lane] = chip8->delay_timer;
+    batch->sound_timer[lane] = chip8->sound_timer;
+    batch->keys[lane] = chip8_get_keys(chip8);
+    batch->rng_state[lane] = chip8->rng_state;
+  }
+
+  return true;
+}
+
+void chip8_batch_free(chip8_batch_t *batch) {
+  free(batch->machines);
+  batch->machines = NULL;
+}
+
+void chip8_batch_set_keys(chip8_batch_t *batch, int lane, uint16_t keys) {
+  batch->keys[lane] = keys;
+  chip8_set_keys(&batch->machines[lane], keys);
+}
+
+chip8_t *chip8_batch_machine(chip8_batch_t *batch, int lane) {
+  chip8_t *chip8 = &batch->machines[lane];
+  for (int i = 0; i < 16; i++) {
+    chip8->V[i] = batch->V[i][lane];
+  }
+  chip8->I = batch->I[lane];
+  chip8->PC = batch->PC[lane];
+  chip8->delay_timer = batch->delay_timer[lane];
+  chip8->sound_timer = batch->sound_timer[lane];
+  chip8->rng_state = batch->rng_state[lane];
+  return chip8;
+}
+
+// Registers back from the machine after it ran an instruction on its own
+static void store_lane(chip8_batch_t *batch, int lane) {
+  const chip8_t *chip8 = &batch->machines[lane];
+  for (int i = 0; i < 16; i++) {
+    batch->V[i][lane] = chip8->V[i];
+  }
+  batch->I[lane] = chip8->I;
+  batch->PC[lane] = chip8->PC;
+  batch->delay_timer[lane] = chip8->delay_timer;
+  batch->sound_timer[lane] = chip8->sound_timer;
+  batch->rng_state[lane] = chip8->rng_state;
+}
+
+static bool is_written(const chip8_batch_t *batch, uint16_t addr) {
+  int block = addr / CHIP8_BATCH_BLOCK;
+  return (batch->written[block / 64] >> (block % 64)) & 1;
+}
+
+// Stores reach at most 16 bytes from I, so two blocks at most
+static void mark_written(chip8_batch_t *batch, uint16_t addr) {
+  int first = addr / CHIP8_BATCH_BLOCK;
+  int last = (uint16_t)(addr + 15) / CHIP8_BATCH_BLOCK;
+  batch->written[first / 64] |= 1ull << (first % 64);
+  batch->written[last / 64] |= 1ull << (last % 64);
+}
+
+// Runs the instruction at each masked lane's PC on its own machine
+static void step_lanes(chip8_batch_t *batch, const mask16_t *mask) {
+  for (int lane = 0; lane < LANES; lane++) {
+    if (!(*mask)[lane]) {
+      continue;
+    }
+
+    chip8_t *chip8 = chip8_batch_machine(batch, lane);
+    uint16_t I = chip8->I;
+    uint16_t pc = chip8->PC;
+    uint8_t high = chip8->ram[pc];
+    uint8_t low = chip8->ram[(uint16_t)(pc + 1)];
+
+    chip8_cycle(chip8);
+    store_lane(batch, lane);
+
+    // FX33, FX55 and 5XY2 store at I, the lanes may no longer agree there
+    if ((high & 0xF0) == 0xF0 ? low == 0x33 || low == 0x55
+                              : (high & 0xF0) == 0x50 && (low & 0xF) == 2) {
+      mark_written(batch, I);
+    }
+  }
+}
+
+// Length of the instruction a skip at pc steps over, F000 NNNN is 4 bytes
+// with CHIP8_QUIRK_LONG_F000
+static uint16_t skip_length(const chip8_t *leader, uint16_t pc,
+                            uint8_t quirks) {
+  uint16_t next = pc + 2;
+  return (quirks & CHIP8_QUIRK_LONG_F000) && leader->ram[next] == 0xF0 &&
+                 leader->ram[(uint16_t)(next + 1)] == 0
+             ? 4
+             : 2;
+}
+
+// Executes instr for the masked lanes, which are all at pc. Returns false
+// when it has no vector form for it, the lanes then run it one at a time.
+// Lanes that can make no progress until something outside the run changes
+// are cleared from done.
+static inline __attribute__((always_inline)) bool
+step_vector(chip8_batch_t *batch, const chip8_t *leader,
+            const chip8_instr_t *instr, uint16_t pc, const mask16_t *lanes,
+            mask16_t *done) {
+  const uint8_t quirks = batch->quirks;
+  const mask16_t mask = *lanes;
+  const mask8_t mask8 = NARROW16(mask);
+  const uint8_t X = instr->X;
+  const uint8_t Y = instr->Y;
+  const uint8_t NN = instr->NN;
+  chip8_lanes8_t *V = batch->V;
+  mask8_t skip8 = {0};
+
+  switch (instr->op) {
+  case CHIP8_OP_1NNN:
+    if (instr->NNN == pc) {
+      // Jumps to self forever
+      *done |= mask;
+      return true;
+    }
+    batch->PC = BLEND(mask, batch->PC, instr->NNN);
+    return true;
+
+  case CHIP8_OP_00FD:
+    *done |= mask;
+    return true;
+
+  case CHIP8_OP_3XNN:
+    skip8 = V[X] == NN;
+    break;
+  case CHIP8_OP_4XNN:
+    skip8 = V[X] != NN;
+    break;
+  case CHIP8_OP_5XY0:
+    skip8 = V[X] == V[Y];
+    break;
+  case CHIP8_OP_9XY0:
+    skip8 = V[X] != V[Y];
+    break;
+
+  case CHIP8_OP_EX9E:
+  case CHIP8_OP_EXA1: {
+    // Keys past F read past the keypad, leave those to the interpreter
+    mask16_t high = WIDEN8((mask8_t)(V[X] > 15)) & mask;
+    if (any_lane(&high)) {
+      return false;
+    }
+    chip8_lanes16_t vx = __builtin_convertvector(V[X], chip8_lanes16_t);
+    mask16_t down = ((batch->keys >> vx) & 1) != 0;
+    skip8 = NARROW16(instr->op == CHIP8_OP_EX9E ? down : ~down);
+    break;
+  }
+
+  case CHIP8_OP_6XNN:
+    V[X] = BLEND(mask8, V[X], NN);
+    break;
+  case CHIP8_OP_7XNN:
+    V[X] = BLEND(mask8, V[X], V[X] + NN);
+    break;
+
+  case CHIP8_OP_8XY0:
+    V[X] = BLEND(mask8, V[X], V[Y]);
+    break;
+  case CHIP8_OP_8XY1:
+  case CHIP8_OP_8XY2:
+  case CHIP8_OP_8XY3: {
+    chip8_lanes8_t result = instr->op == CHIP8_OP_8XY1   ? V[X] | V[Y]
+                            : instr->op == CHIP8_OP_8XY2 ? V[X] & V[Y]
+                                                         : V[X] ^ V[Y];
+    V[X] = BLEND(mask8, V[X], result);
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      V[0xF] = BLEND(mask8, V[0xF], 0);
+    }
+    break;
+  }
+  // The interpreter sets VF before VX here, so VX wins for X = F and the
+  // new VF is used for Y = F
+  case CHIP8_OP_8XY4: {
+    chip8_lanes8_t sum = V[X] + V[Y];
+    chip8_lanes8_t carry = (chip8_lanes8_t)(sum < V[X]) & 1;
+    V[0xF] = BLEND(mask8, V[0xF], carry);
+    V[X] = BLEND(mask8, V[X], sum);
+    break;
+  }
+  case CHIP8_OP_8XY5: {
+    chip8_lanes8_t no_borrow = (chip8_lanes8_t)(V[X] >= V[Y]) & 1;
+    V[0xF] = BLEND(mask8, V[0xF], no_borrow);
+    V[X] = BLEND(mask8, V[X], V[X] - V[Y]);
+    break;
+  }
+  case CHIP8_OP_8XY7: {
+    chip8_lanes8_t no_borrow = (chip8_lanes8_t)(V[Y] >= V[X]) & 1;
+    V[0xF] = BLEND(mask8, V[0xF], no_borrow);
+    V[X] = BLEND(mask8, V[X], V[Y] - V[X]);
+    break;
+  }
+  case CHIP8_OP_8XY6:
+  case CHIP8_OP_8XYE: {
+    // Shifting VY sets VF last, shifting VX sets it first
+    const bool vy = quirks & CHIP8_QUIRK_SHIFT_VY;
+    const bool right = instr->op == CHIP8_OP_8XY6;
+    chip8_lanes8_t value = vy ? V[Y] : V[X];
+    chip8_lanes8_t flag = right ? value & 1 : value >> 7;
+    if (!vy) {
+      V[0xF] = BLEND(mask8, V[0xF], flag);
+      value = V[X];
+    }
+    V[X] = BLEND(mask8, V[X], right ? value >> 1 : value << 1);
+    if (vy) {
+      V[0xF] = BLEND(mask8, V[0xF], flag);
+    }
+    break;
+  }
+
+  case CHIP8_OP_ANNN:
+    batch->I = BLEND(mask, batch->I, instr->NNN);
+    break;
+
+  case CHIP8_OP_BNNN: {
+    // The jump replaces the PC, so it returns before the increment below
+    chip8_lanes16_t base = __builtin_convertvector(
+        V[(quirks & CHIP8_QUIRK_JUMP_VX) ? X : 0], chip8_lanes16_t);
+    batch->PC = BLEND(mask, batch->PC, base + instr->NNN);
+    return true;
+  }
+
+  case CHIP8_OP_CXNN: {
+    // The interpreter's xorshift, a lane at a time
+    chip8_lanes32_t x = batch->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    mask32_t mask32 = __builtin_convertvector(mask, mask32_t);
+    batch->rng_state = BLEND(mask32, batch->rng_state, x);
+    chip8_lanes8_t random = __builtin_convertvector(x >> 24, chip8_lanes8_t);
+    V[X] = BLEND(mask8, V[X], random & NN);
+    break;
+  }
+
+  case CHIP8_OP_FX07:
+    V[X] = BLEND(mask8, V[X], batch->delay_timer);
+    break;
+  case CHIP8_OP_FX15:
+    batch->delay_timer = BLEND(mask8, batch->delay_timer, V[X]);
+    break;
+  case CHIP8_OP_FX18:
+    batch->sound_timer = BLEND(mask8, batch->sound_timer, V[X]);
+    break;
+  case CHIP8_OP_FX1E:
+    batch->I = BLEND(mask, batch->I,
+                     batch->I + __builtin_convertvector(V[X], chip8_lanes16_t));
+    break;
+  case CHIP8_OP_FX29:
+    batch->I = BLEND(mask, batch->I,
+                     __builtin_convertvector(V[X], chip8_lanes16_t) * 5);
+    break;
+
+  case CHIP8_OP_FX0A: {
+    // Lanes with no key down would execute it again and again
+    mask16_t idle = mask & (batch->keys == 0);
+    mask16_t pressed = mask & ~idle;
+    *done |= idle;
+    if (any_lane(&pressed)) {
+      step_lanes(batch, &pressed);
+    }
+    return true;
+  }
+
+  default:
+    return false;
+  }
+
+  // Past the instruction, and past the next one in lanes that skip it
+  mask16_t skip = WIDEN8(skip8) & mask;
+  const uint16_t skip_len = skip_length(leader, pc, quirks);
+  batch->PC += (chip8_lanes16_t)((mask & 2) + (skip & skip_len));
+  return true;
+}
+
+BATCH_TARGETS void chip8_batch_run(chip8_batch_t *batch, uint64_t cycles) {
+  // Budgets as wide as the PC keep every mask the same width
+  for (; cycles > UINT16_MAX; cycles -= UINT16_MAX) {
+    chip8_batch_run(batch, UINT16_MAX);
+  }
+
+  chip8_lanes16_t left = (chip8_lanes16_t){0} + (uint16_t)cycles;
+  int leader = -1;
+  while (true) {
+    // The lane furthest behind leads, the others at its address join in
+    if (leader < 0 || !left[leader]) {
+      leader = 0;
+      for (int lane = 1; lane < LANES; lane++) {
+        leader = left[lane] > left[leader] ? lane : leader;
+      }
+      if (!left[leader]) {
+        break;
+      }
+    }
+
+    const uint16_t pc = batch->PC[leader];
+    mask16_t mask = (batch->PC == pc) & (left != 0);
+    mask16_t done = {0};
+    chip8_t *chip8 = &batch->machines[leader];
+
+    // Code any lane stored to may differ between lanes, as may code past
+    // the decode cache, so each lane fetches its own
+    chip8_instr_t *instr = &chip8->decoded[pc % CHIP8_DECODE_SIZE];
+    bool shared = pc + 4 <= CHIP8_DECODE_SIZE && !is_written(batch, pc) &&
+                  !is_written(batch, pc + 3);
+    if (shared && instr->op == CHIP8_OP_NONE) {
+      chip8_decode(instr, (chip8->ram[pc] << 8) | chip8->ram[pc + 1]);
+    }
+    if (!shared || !step_vector(batch, chip8, instr, pc, &mask, &done)) {
+      step_lanes(batch, &mask);
+    }
+
+    // Lanes that are done would spend the rest of the run where they are
+    left = BLEND(done, left + (chip8_lanes16_t)mask, 0);
+    batch->steps++;
+    for (int lane = 0; lane < LANES; lane++) {
+      batch->lane_cycles -= mask[lane];
+    }
+
+    // When every lane with cycles left ran, they all kept their order and
+    // the leader is still furthest behind
+    mask16_t waiting = (left != 0) & ~mask;
+    if (any_lane(&waiting)) {
+      leader = -1;
+    }
+  }
+}
+
+void chip8_batch_decrement_timers(chip8_batch_t *batch) {
+  batch->delay_timer += (chip8_lanes8_t)(batch->delay_timer != 0);
+  batch->sound_timer += (chip8_lanes8_t)(batch->sound_timer != 0);
+}
@@ -0,0 +1,64 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define CHIP8_BATCH_LANES 16
+#define CHIP8_BATCH_BLOCK 64 // Bytes per bit of the written map
+
+// One value per lane, GCC vector extensions so the compiler picks the widest
+// registers the target has
+typedef uint8_t chip8_lanes8_t
+    __attribute__((vector_size(CHIP8_BATCH_LANES)));
+typedef uint16_t chip8_lanes16_t
+    __attribute__((vector_size(CHIP8_BATCH_LANES * 2)));
+typedef uint32_t chip8_lanes32_t
+    __attribute__((vector_size(CHIP8_BATCH_LANES * 4)));
+
+// Copies of one ROM run in lockstep, each lane with its own seed and keys.
+// Every step executes one instruction for all lanes at the same address, so
+// fetch and decode are shared and the registers are updated a vector at a
+// time. Lanes that branched differently wait and rejoin once they reach the
+// same address again.
+//
+// The registers live here, one vector per register. Memory, the display,
+// the stack and the rest stay in a whole machine per lane, and instructions
+// without a vector form (drawing, calls, stores) run on those one lane at a
+// time. Aligned for the widest vectors, which the compiler keeps to on the
+// stack and in statics, heap copies need aligned_alloc.
+typedef struct {
+  chip8_lanes8_t V[16];
+  chip8_lanes16_t I;
+  chip8_lanes16_t PC;
+  chip8_lanes8_t delay_timer;
+  chip8_lanes8_t sound_timer;
+  chip8_lanes16_t keys; // Bit n is key n
+  chip8_lanes32_t rng_state;
+
+  chip8_t *machines; // CHIP8_BATCH_LANES of them
+  uint8_t quirks;    // CHIP8_QUIRK_* bits of the machines' profile
+
+  // Blocks of memory any lane stored to, where lanes may hold different
+  // code. Instructions there are never shared.
+  uint64_t written[CHIP8_MEMORY_SIZE / CHIP8_BATCH_BLOCK / 64];
+
+  uint64_t steps;       // Shared instructions, each for one or more lanes
+  uint64_t lane_cycles; // Instructions summed over all lanes
+} __attribute__((aligned(64))) chip8_batch_t;
+
+// Every lane starts as a copy of prototype, seeded with seed + its lane
+bool chip8_batch_init(chip8_batch_t *batch, const chip8_t *prototype,
+                      uint32_t seed);
+void chip8_batch_free(chip8_batch_t *batch);
+void chip8_batch_set_keys(chip8_batch_t *batch, int lane, uint16_t keys);
+// Same result per lane as chip8_cycle called cycles times
+void chip8_batch_run(chip8_batch_t *batch, uint64_t cycles);
+void chip8_batch_decrement_timers(chip8_batch_t *batch);
+// Brings the lane's machine up to date with the registers and returns it,
+// for reading the display or saving a state
+chip8_t *chip8_batch_machine(chip8_batch_t *batch, int lane);
+
+#endif
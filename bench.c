@@ -0,0 +1,329 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "chip8.h"
+#include "jit.h"
+#include "render.h"
+
+#define DEFAULT_REPETITIONS 15
+#define DEFAULT_THRESHOLD 10.0 // Percent slower than baseline that fails
+#define CYCLES_PER_REP 2000000
+#define CALLS_PER_REP 200000
+#define MAX_REPETITIONS 1000
+
+/* Synthetic roms, each is a setup followed by an endless loop */
+
+// Arithmetic, logic and shifts
+static const uint16_t alu_rom[] = {
+    0x6001, 0x6103, 0x6205, // 0x200
+    0x7001, 0x8014, 0x8125, 0x8206, 0x830E, 0x8231, 0x8302, 0x8123, 0x7307,
+    0x1206, // Back to 0x206
+};
+
+// 15 row sprites of changing font glyphs at moving positions
+static const uint16_t sprite_rom[] = {
+    0x6000, 0x6100, 0x6200, // 0x200
+    0xF229, 0xD01F, 0x7005, 0x7103, 0x7201,
+    0x1206, // Back to 0x206
+};
+
+// 16x16 sprites on both planes in 128x64 with a scroll per sprite
+static const uint16_t hires_rom[] = {
+    0x00FF, 0xF301, 0x6000, 0x6100, 0x6200, // 0x200
+    0xF230, 0xD010, 0x7005, 0x7103, 0x7201, 0x00C1, 0x00FB,
+    0x120A, // Back to 0x20A
+};
+
+// Register dumps, loads and BCD stores to data at 0x400
+static const uint16_t memory_rom[] = {
+    0xA400, 0x6000, // 0x200
+    0xF555, 0xF565, 0xF033, 0x7001, 0xF555, 0xF565,
+    0x1204, // Back to 0x204
+};
+
+typedef struct {
+  const char *name;
+  const char *unit;
+  uint64_t ops; // Per repetition
+  double samples[MAX_REPETITIONS];
+  int repetitions;
+} result_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void load_program(chip8_t *chip8, const uint16_t *program,
+                         size_t count) {
+  chip8_init(chip8);
+  chip8_seed(chip8, 0);
+  for (size_t i = 0; i < count; i++) {
+    chip8->ram[0x200 + i * 2] = program[i] >> 8;
+    chip8->ram[0x200 + i * 2 + 1] = program[i] & 0xFF;
+  }
+  chip8_invalidate(chip8, 0x200, count * 2);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double median(const result_t *result) {
+  double sorted[MAX_REPETITIONS];
+  memcpy(sorted, result->samples, result->repetitions * sizeof(double));
+  qsort(sorted, result->repetitions, sizeof(double), compare_doubles);
+
+  int mid = result->repetitions / 2;
+  return result->repetitions % 2 ? sorted[mid]
+                                 : (sorted[mid - 1] + sorted[mid]) / 2;
+}
+
+static void bench_program(result_t *result, const uint16_t *program,
+                          size_t count, bool use_jit) {
+  static chip8_t chip8;
+  static chip8_jit_t jit;
+
+  result->ops = CYCLES_PER_REP;
+  if (use_jit) {
+    chip8_jit_init(&jit);
+  }
+
+  for (int rep = 0; rep < result->repetitions; rep++) {
+    load_program(&chip8, program, count);
+    if (use_jit) {
+      chip8_jit_reset(&jit);
+    }
+
+    uint64_t start = now_ns();
+    if (use_jit) {
+      chip8_jit_run(&jit, &chip8, CYCLES_PER_REP);
+    } else {
+      for (int i = 0; i < CYCLES_PER_REP; i++) {
+        chip8_cycle(&chip8);
+      }
+    }
+    result->samples[rep] = (double)(now_ns() - start) / CYCLES_PER_REP;
+  }
+
+  chip8_jit_free(&jit);
+}
+
+static void bench_clear_display(result_t *result) {
+  static chip8_t chip8;
+  chip8_init(&chip8);
+  result->ops = CALLS_PER_REP;
+
+  for (int rep = 0; rep < result->repetitions; rep++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < CALLS_PER_REP; i++) {
+      // Refill so every clear has rows to blank
+      memset(chip8.display, 0xA5, sizeof(chip8.display));
+      chip8_clear_display(&chip8);
+    }
+    result->samples[rep] = (double)(now_ns() - start) / CALLS_PER_REP;
+  }
+}
+
+// CPU side of draw_screen: expanding a full frame to ARGB pixels, a one
+// plane 64x32 frame or a two plane 128x64 one
+static void bench_render(result_t *result, bool hires) {
+  static chip8_t chip8;
+  static uint32_t pixels[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+  chip8_init(&chip8);
+  chip8_set_hires(&chip8, hires);
+  for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+    for (int word = 0; word < CHIP8_ROW_WORDS; word++) {
+      chip8.display[0][y][word] =
+          y % 2 ? 0xAAAAAAAAAAAAAAAAull : 0x5555555555555555ull;
+      chip8.display[1][y][word] = hires ? 0x0F0F0F0F0F0F0F0Full : 0;
+    }
+  }
+  const int width = chip8_screen_width(&chip8);
+  const int height = chip8_screen_height(&chip8);
+  result->ops = CALLS_PER_REP;
+
+  for (int rep = 0; rep < result->repetitions; rep++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < CALLS_PER_REP; i++) {
+      render_rows(&chip8, pixels, width * sizeof(uint32_t), 0, height);
+      // Keep the compiler from dropping the work
+      __asm__ volatile("" : : "r"(pixels) : "memory");
+    }
+    result->samples[rep] = (double)(now_ns() - start) / CALLS_PER_REP;
+  }
+}
+
+static void print_json(const result_t *results, int count) {
+  printf("{\n  \"benchmarks\": [\n");
+  for (int i = 0; i < count; i++) {
+    const result_t *r = &results[i];
+
+    double min = r->samples[0];
+    double sum = 0;
+    for (int rep = 0; rep < r->repetitions; rep++) {
+      min = r->samples[rep] < min ? r->samples[rep] : min;
+      sum += r->samples[rep];
+    }
+    double mean = sum / r->repetitions;
+    double variance = 0;
+    for (int rep = 0; rep < r->repetitions; rep++) {
+      variance += (r->samples[rep] - mean) * (r->samples[rep] - mean);
+    }
+    double stddev = sqrt(variance / r->repetitions);
+    double med = median(r);
+
+    printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, "
+           "\"repetitions\": %d, \"min_ns\": %.4f, \"median_ns\": %.4f, "
+           "\"mean_ns\": %.4f, \"stddev_ns\": %.4f, \"ops_per_sec\": %.0f}%s\n",
+           r->name, r->unit, (unsigned long long)r->ops, r->repetitions, min,
+           med, mean, stddev, 1e9 / med, i + 1 < count ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+// Looks up median_ns of name in a previous run's output
+static bool baseline_median(const char *json, const char *name, double *out) {
+  char key[128];
+  snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+  const char *entry = strstr(json, key);
+  if (!entry) {
+    return false;
+  }
+  const char *field = strstr(entry, "\"median_ns\": ");
+  return field && sscanf(field + strlen("\"median_ns\": "), "%lf", out) == 1;
+}
+
+// Returns false when any benchmark got slower than threshold percent
+static bool compare_baseline(const char *path, const result_t *results,
+                             int count, double threshold) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("fopen");
+    return false;
+  }
+
+  char json[16384];
+  size_t len = fread(json, 1, sizeof(json) - 1, file);
+  json[len] = '\0';
+  fclose(file);
+
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    double base;
+    if (!baseline_median(json, results[i].name, &base)) {
+      fprintf(stderr, "%-14s no baseline\n", results[i].name);
+      continue;
+    }
+
+    double change = (median(&results[i]) - base) / base * 100.0;
+    bool regressed = change > threshold;
+    fprintf(stderr, "%-14s %+7.2f%%%s\n", results[i].name, change,
+            regressed ? "  REGRESSION" : "");
+    ok &= !regressed;
+  }
+
+  return ok;
+}
+
+// Times are per instruction of one lane, comparable to the scalar run
+static void bench_batch(result_t *result, const uint16_t *program,
+                        size_t count) {
+  static chip8_t prototype;
+  static chip8_batch_t batch;
+
+  result->ops = CYCLES_PER_REP;
+  load_program(&prototype, program, count);
+
+  for (int rep = 0; rep < result->repetitions; rep++) {
+    if (!chip8_batch_init(&batch, &prototype, 0)) {
+      exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = now_ns();
+    chip8_batch_run(&batch, CYCLES_PER_REP / CHIP8_BATCH_LANES);
+    result->samples[rep] = (double)(now_ns() - start) / CYCLES_PER_REP;
+
+    chip8_batch_free(&batch);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-r repetitions] [-b baseline.json] [-t threshold %%]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  int repetitions = DEFAULT_REPETITIONS;
+  const char *baseline = NULL;
+  double threshold = DEFAULT_THRESHOLD;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:b:t:")) != -1) {
+    switch (opt) {
+    case 'r':
+      repetitions = atoi(optarg);
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (repetitions <= 0 || repetitions > MAX_REPETITIONS) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  static result_t results[] = {
+      {.name = "alu", .unit = "instruction"},
+      {.name = "alu_jit", .unit = "instruction"},
+      {.name = "alu_batch", .unit = "instruction"},
+      {.name = "sprite", .unit = "instruction"},
+      {.name = "sprite_hires", .unit = "instruction"},
+      {.name = "memory", .unit = "instruction"},
+      {.name = "clear_display", .unit = "call"},
+      {.name = "render", .unit = "frame"},
+      {.name = "render_hires", .unit = "frame"},
+  };
+  const int count = sizeof(results) / sizeof(results[0]);
+  for (int i = 0; i < count; i++) {
+    results[i].repetitions = repetitions;
+  }
+
+  bench_program(&results[0], alu_rom, sizeof(alu_rom) / 2, false);
+  bench_program(&results[1], alu_rom, sizeof(alu_rom) / 2, true);
+  bench_batch(&results[2], alu_rom, sizeof(alu_rom) / 2);
+  bench_program(&results[3], sprite_rom, sizeof(sprite_rom) / 2, false);
+  bench_program(&results[4], hires_rom, sizeof(hires_rom) / 2, false);
+  bench_program(&results[5], memory_rom, sizeof(memory_rom) / 2, false);
+  bench_clear_display(&results[6]);
+  bench_render(&results[7], false);
+  bench_render(&results[8], true);
+
+  print_json(results, count);
+
+  if (baseline && !compare_baseline(baseline, results, count, threshold)) {
+    exit(EXIT_FAILURE);
+  }
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "render.h"
+
+#define DEFAULT_SCALE 4
+#define MAX_SCALE 16
+#define MIN_DELAY_CS 2 // Viewers slow down GIF frames with shorter delays
+
+// Images are at the high resolution, low resolution pixels are drawn 2x2 so
+// a capture that switches keeps one size
+#define IMAGE_WIDTH CHIP8_HIRES_WIDTH
+#define IMAGE_HEIGHT CHIP8_HIRES_HEIGHT
+
+#define LZW_MIN_SIZE 2 // Bits per pixel, 4 colors
+#define LZW_CLEAR 4
+#define LZW_END 5
+#define LZW_CODES 4096
+
+#define PNG_STORED_MAX 65535 // Bytes per stored deflate block
+
+// Indexed by plane 1 bit | plane 2 bit << 1 like render.c
+static const uint32_t palette[4] = {RENDER_COLOR_OFF, RENDER_COLOR_ON,
+                                    RENDER_COLOR_PLANE2, RENDER_COLOR_BOTH};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-s scale] [-f frame] <capture file> "
+          "[out.gif | out.png]\n",
+          prog);
+}
+
+static void put_le16(FILE *file, uint16_t value) {
+  fputc(value & 0xFF, file);
+  fputc(value >> 8, file);
+}
+
+static void put_be32(FILE *file, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    fputc((value >> shift) & 0xFF, file);
+  }
+}
+
+static bool same_frame(const chip8_capture_frame_t *a,
+                       const chip8_capture_frame_t *b) {
+  return a->hires == b->hires &&
+         memcmp(a->display, b->display, sizeof(a->display)) == 0;
+}
+
+// One palette index per pixel, scale pixels per high resolution pixel
+static void render_indices(const chip8_capture_frame_t *frame,
+                           uint8_t *pixels, int scale) {
+  const int width = IMAGE_WIDTH * scale;
+  const int cell = frame->hires ? scale : 2 * scale;
+  const int columns = frame->hires ? CHIP8_HIRES_WIDTH : CHIP8_SCREEN_WIDTH;
+  const int rows = frame->hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < columns; x++) {
+      const int word = x / 64;
+      const int bit = 63 - x % 64;
+      uint8_t index = (frame->display[0][y][word] >> bit & 1) |
+                      (frame->display[1][y][word] >> bit & 1) << 1;
+      for (int dy = 0; dy < cell; dy++) {
+        memset(&pixels[(y * cell + dy) * width + x * cell], index, cell);
+      }
+    }
+  }
+}
+
+// LZW codes packed from the low bit up, in sub-blocks of up to 255 bytes
+typedef struct {
+  FILE *file;
+  uint8_t block[255];
+  int size;
+  uint32_t bits;
+  int count;
+} gif_bits_t;
+
+static void gif_put_byte(gif_bits_t *out, uint8_t byte) {
+  out->block[out->size++] = byte;
+  if (out->size == sizeof(out->block)) {
+    fputc(out->size, out->file);
+    fwrite(out->block, 1, out->size, out->file);
+    out->size = 0;
+  }
+}
+
+static void gif_put_code(gif_bits_t *out, int code, int size) {
+  out->bits |= (uint32_t)code << out->count;
+  out->count += size;
+  while (out->count >= 8) {
+    gif_put_byte(out, out->bits & 0xFF);
+    out->bits >>= 8;
+    out->count -= 8;
+  }
+}
+
+static void gif_encode(FILE *file, const uint8_t *pixels, size_t count) {
+  // Code for a string followed by each color, 0 when not in the table yet.
+  // No string extends to code 0, it is a single color.
+  static uint16_t next_code[LZW_CODES][4];
+  memset(next_code, 0, sizeof(next_code));
+
+  fputc(LZW_MIN_SIZE, file);
+  gif_bits_t out = {.file = file};
+  int size = LZW_MIN_SIZE + 1;
+  int next = LZW_END + 1;
+  gif_put_code(&out, LZW_CLEAR, size);
+
+  int code = pixels[0];
+  for (size_t i = 1; i < count; i++) {
+    const uint8_t pixel = pixels[i];
+    if (next_code[code][pixel]) {
+      code = next_code[code][pixel];
+      continue;
+    }
+
+    gif_put_code(&out, code, size);
+    if (next < LZW_CODES) {
+      if (next == 1 << size) {
+        size++;
+      }
+      next_code[code][pixel] = next++;
+    } else {
+      // Table full, start over
+      gif_put_code(&out, LZW_CLEAR, size);
+      memset(next_code, 0, sizeof(next_code));
+      size = LZW_MIN_SIZE + 1;
+      next = LZW_END + 1;
+    }
+    code = pixel;
+  }
+  gif_put_code(&out, code, size);
+  gif_put_code(&out, LZW_END, size);
+
+  if (out.count > 0) {
+    gif_put_byte(&out, out.bits & 0xFF);
+  }
+  if (out.size > 0) {
+    fputc(out.size, file);
+    fwrite(out.block, 1, out.size, file);
+  }
+  fputc(0, file);
+}
+
+// Writes the rows of image that differ from shown as one GIF frame, drawn
+// over the frames before it
+static void gif_frame(FILE *file, const uint8_t *image, uint8_t *shown,
+                      int width, int height, int delay_cs, bool first) {
+  int top = 0;
+  int bottom = height;
+  if (!first) {
+    while (top < height - 1 &&
+           memcmp(&image[top * width], &shown[top * width], width) == 0) {
+      top++;
+    }
+    while (bottom > top + 1 && memcmp(&image[(bottom - 1) * width],
+                                      &shown[(bottom - 1) * width],
+                                      width) == 0) {
+      bottom--;
+    }
+  }
+
+  // Graphic control: keep the frame when the next is drawn, delay
+  fputc(0x21, file);
+  fputc(0xF9, file);
+  fputc(4, file);
+  fputc(1 << 2, file);
+  put_le16(file, delay_cs);
+  fputc(0, file);
+  fputc(0, file);
+
+  fputc(0x2C, file);
+  put_le16(file, 0);
+  put_le16(file, top);
+  put_le16(file, width);
+  put_le16(file, bottom - top);
+  fputc(0, file);
+  gif_encode(file, &image[top * width], (size_t)(bottom - top) * width);
+
+  memcpy(&shown[top * width], &image[top * width],
+         (size_t)(bottom - top) * width);
+}
+
+// Time in hundredths of a second, the unit of GIF delays
+static uint64_t centiseconds(uint64_t frames, uint16_t fps) {
+  return (frames * 100 + fps / 2) / fps;
+}
+
+// The whole capture as a looping animation. Frames shown for less than
+// MIN_DELAY_CS are skipped, the next one takes their time.
+static bool write_gif(FILE *in, uint16_t fps, const char *path, int scale) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror("fopen");
+    return false;
+  }
+
+  const int width = IMAGE_WIDTH * scale;
+  const int height = IMAGE_HEIGHT * scale;
+  uint8_t *image = malloc((size_t)width * height);
+  uint8_t *shown = calloc((size_t)width * height, 1);
+  if (!image || !shown) {
+    perror("malloc");
+    free(image);
+    free(shown);
+    fclose(file);
+    return false;
+  }
+
+  // Screen with a 4 color global palette
+  fwrite("GIF89a", 1, 6, file);
+  put_le16(file, width);
+  put_le16(file, height);
+  fputc(0x80 | (LZW_MIN_SIZE - 1) << 4 | (LZW_MIN_SIZE - 1), file);
+  fputc(0, file);
+  fputc(0, file);
+  for (int i = 0; i < 4; i++) {
+    fputc(palette[i] >> 16 & 0xFF, file);
+    fputc(palette[i] >> 8 & 0xFF, file);
+    fputc(palette[i] & 0xFF, file);
+  }
+
+  // Loop forever
+  fputc(0x21, file);
+  fputc(0xFF, file);
+  fputc(11, file);
+  fwrite("NETSCAPE2.0", 1, 11, file);
+  fputc(3, file);
+  fputc(1, file);
+  put_le16(file, 0);
+  fputc(0, file);
+
+  static chip8_capture_frame_t frame, pending;
+  uint64_t time = 0;  // Frames read so far
+  uint64_t start = 0; // When pending was first shown
+  uint64_t written = 0;
+  while (chip8_capture_read(in, &frame)) {
+    if (time == 0) {
+      pending = frame;
+    } else if (!same_frame(&frame, &pending)) {
+      uint64_t delay = centiseconds(time, fps) - centiseconds(start, fps);
+      if (delay >= MIN_DELAY_CS) {
+        render_indices(&pending, image, scale);
+        gif_frame(file, image, shown, width, height, delay, written++ == 0);
+        start = time;
+      }
+      pending = frame;
+    }
+    time += frame.count;
+  }
+
+  if (time > 0) {
+    uint64_t delay = centiseconds(time, fps) - centiseconds(start, fps);
+    render_indices(&pending, image, scale);
+    gif_frame(file, image, shown, width, height,
+              delay > MIN_DELAY_CS ? delay : MIN_DELAY_CS, written++ == 0);
+  }
+  fputc(0x3B, file);
+
+  free(image);
+  free(shown);
+  bool ok = fclose(file) == 0;
+  if (!ok) {
+    perror("fclose");
+  }
+  printf("%llu frames as %llu GIF frames\n", (unsigned long long)time,
+         (unsigned long long)written);
+  return ok;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static void png_chunk(FILE *file, const char *type, const uint8_t *data,
+                      size_t size) {
+  put_be32(file, size);
+  fwrite(type, 1, 4, file);
+  fwrite(data, 1, size, file);
+  uint32_t crc = crc32(0, (const uint8_t *)type, 4);
+  put_be32(file, crc32(crc, data, size));
+}
+
+// An 8 bit palette PNG. The pixels go into stored deflate blocks, plain
+// CHIP-8 pixels compress well enough with any later tool.
+static bool write_png(const chip8_capture_frame_t *frame, const char *path,
+                      int scale) {
+  const int width = IMAGE_WIDTH * scale;
+  const int height = IMAGE_HEIGHT * scale;
+  const size_t raw_size = (size_t)height * (width + 1);
+  const size_t blocks = (raw_size + PNG_STORED_MAX - 1) / PNG_STORED_MAX;
+  uint8_t *image = malloc((size_t)width * height);
+  uint8_t *raw = malloc(raw_size);
+  uint8_t *zlib = malloc(2 + blocks * 5 + raw_size + 4);
+  if (!image || !raw || !zlib) {
+    perror("malloc");
+    free(image);
+    free(raw);
+    free(zlib);
+    return false;
+  }
+
+  // Every row starts with filter type 0, none
+  render_indices(frame, image, scale);
+  for (int y = 0; y < height; y++) {
+    raw[y * (width + 1)] = 0;
+    memcpy(&raw[y * (width + 1) + 1], &image[y * width], width);
+  }
+
+  uint8_t *p = zlib;
+  *p++ = 0x78;
+  *p++ = 0x01;
+  uint32_t a = 1, b = 0;
+  for (size_t pos = 0; pos < raw_size; pos += PNG_STORED_MAX) {
+    size_t size = raw_size - pos < PNG_STORED_MAX ? raw_size - pos
+                                                  : PNG_STORED_MAX;
+    *p++ = pos + size == raw_size;
+    *p++ = size & 0xFF;
+    *p++ = size >> 8;
+    *p++ = ~size & 0xFF;
+    *p++ = ~size >> 8 & 0xFF;
+    memcpy(p, &raw[pos], size);
+    p += size;
+    for (size_t i = pos; i < pos + size; i++) {
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  uint32_t adler = b << 16 | a;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    *p++ = adler >> shift & 0xFF;
+  }
+
+  bool ok = false;
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror("fopen");
+  } else {
+    uint8_t header[13] = {width >> 24, width >> 16 & 0xFF, width >> 8 & 0xFF,
+                          width & 0xFF, height >> 24, height >> 16 & 0xFF,
+                          height >> 8 & 0xFF, height & 0xFF, 8, 3};
+    uint8_t colors[4 * 3];
+    for (int i = 0; i < 4; i++) {
+      colors[i * 3] = palette[i] >> 16 & 0xFF;
+      colors[i * 3 + 1] = palette[i] >> 8 & 0xFF;
+      colors[i * 3 + 2] = palette[i] & 0xFF;
+    }
+
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+    png_chunk(file, "IHDR", header, sizeof(header));
+    png_chunk(file, "PLTE", colors, sizeof(colors));
+    png_chunk(file, "IDAT", zlib, p - zlib);
+    png_chunk(file, "IEND", NULL, 0);
+    ok = fclose(file) == 0;
+    if (!ok) {
+      perror("fclose");
+    }
+  }
+
+  free(image);
+  free(raw);
+  free(zlib);
+  return ok;
+}
+
+// Frame number at of the capture as a PNG
+static bool write_frame(FILE *in, uint64_t at, const char *path, int scale) {
+  static chip8_capture_frame_t frame;
+  uint64_t time = 0;
+  while (chip8_capture_read(in, &frame)) {
+    time += frame.count;
+    if (time > at) {
+      return write_png(&frame, path, scale);
+    }
+  }
+
+  fprintf(stderr, "The capture has %llu frames\n", (unsigned long long)time);
+  return false;
+}
+
+// Frames and how often the display changed
+static bool summarize(FILE *in, uint16_t fps) {
+  static chip8_capture_frame_t frame, last;
+  uint64_t frames = 0;
+  uint64_t changes = 0;
+  while (chip8_capture_read(in, &frame)) {
+    if (frames == 0 || !same_frame(&frame, &last)) {
+      changes++;
+      last = frame;
+    }
+    frames += frame.count;
+  }
+
+  long size = ftell(in);
+  printf("frames: %llu (%.1f s at %u fps)\n", (unsigned long long)frames,
+         (double)frames / fps, fps);
+  printf("changes: %llu\n", (unsigned long long)changes);
+  printf("size: %ld bytes, %.1f per frame\n", size,
+         frames ? (double)size / frames : 0.0);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int scale = DEFAULT_SCALE;
+  bool single = false;
+  uint64_t at = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:f:")) != -1) {
+    switch (opt) {
+    case 's':
+      scale = atoi(optarg);
+      break;
+    case 'f':
+      at = strtoull(optarg, NULL, 0);
+      single = true;
+      break;
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const char *out = optind + 1 < argc ? argv[optind + 1] : NULL;
+  const char *ext = out ? strrchr(out, '.') : NULL;
+  bool gif = ext && strcmp(ext, ".gif") == 0;
+  bool png = ext && strcmp(ext, ".png") == 0;
+  if (optind >= argc || optind + 2 < argc || scale < 1 || scale > MAX_SCALE ||
+      (out && !gif && !png) || (gif && single)) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *in = fopen(argv[optind], "rb");
+  if (!in) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  uint16_t fps = chip8_capture_read_header(in);
+  if (!fps) {
+    fclose(in);
+    exit(EXIT_FAILURE);
+  }
+
+  bool ok = gif   ? write_gif(in, fps, out, scale)
+            : png ? write_frame(in, at, out, scale)
+                  : summarize(in, fps);
+  fclose(in);
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define ENCODER_IDLE_NS 1000000 // Encoder sleep when the queue is empty
+#define PRODUCER_WAIT_NS 100000 // Emulator sleep when the queue is full
+
+static uint8_t *put_le(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    *p++ = value >> (i * 8);
+  }
+  return p;
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)p[i] << (i * 8);
+  }
+  return value;
+}
+
+// Rows and words per row the resolution uses
+static int frame_rows(bool hires) {
+  return hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+}
+
+static int frame_words(bool hires) {
+  return hires ? CHIP8_ROW_WORDS : 1;
+}
+
+static void write_repeat(chip8_capture_t *capture, uint32_t count) {
+  uint8_t record[1 + 4];
+  record[0] = CHIP8_CAPTURE_REPEAT;
+  put_le(record + 1, count, 4);
+  fwrite(record, 1, sizeof(record), capture->file);
+}
+
+// Writes the rows of frame that differ from the last one written
+static void encode(chip8_capture_t *capture,
+                   const chip8_capture_frame_t *frame) {
+  chip8_capture_frame_t *last = &capture->last;
+  if (frame->hires != last->hires) {
+    memset(last->display, 0, sizeof(last->display));
+    last->hires = frame->hires;
+  }
+
+  const int rows = frame_rows(frame->hires);
+  const size_t row_size = frame_words(frame->hires) * 8;
+  uint64_t changed = 0;
+  for (int y = 0; y < rows; y++) {
+    for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+      if (memcmp(frame->display[plane][y], last->display[plane][y],
+                 row_size) != 0) {
+        changed |= 1ull << y;
+      }
+    }
+  }
+
+  uint8_t buf[1 + 1 + 8 + sizeof(frame->display)];
+  uint8_t *p = buf;
+  *p++ = CHIP8_CAPTURE_ROWS;
+  *p++ = frame->hires;
+  p = put_le(p, changed, 8);
+  for (int y = 0; y < rows; y++) {
+    if (!(changed & (1ull << y))) {
+      continue;
+    }
+    for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+      for (int word = 0; word < frame_words(frame->hires); word++) {
+        p = put_le(p, frame->display[plane][y][word], 8);
+      }
+      memcpy(last->display[plane][y], frame->display[plane][y], row_size);
+    }
+  }
+  fwrite(buf, 1, p - buf, capture->file);
+
+  if (frame->count > 1) {
+    write_repeat(capture, frame->count - 1);
+  }
+  capture->encoded += frame->count;
+}
+
+// Encodes every queued frame, returns how many
+static uint64_t drain(chip8_capture_t *capture) {
+  uint64_t tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&capture->head, memory_order_acquire);
+
+  for (uint64_t i = tail; i < head; i++) {
+    encode(capture, &capture->frames[i & (CHIP8_CAPTURE_QUEUE - 1)]);
+    // Hand the slot back to the producer
+    atomic_store_explicit(&capture->tail, i + 1, memory_order_release);
+  }
+
+  return head - tail;
+}
+
+static void *encoder_main(void *arg) {
+  chip8_capture_t *capture = arg;
+
+  while (!atomic_load_explicit(&capture->stop, memory_order_acquire)) {
+    if (drain(capture) == 0) {
+      struct timespec idle = {0, ENCODER_IDLE_NS};
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  drain(capture);
+  return NULL;
+}
+
+bool chip8_capture_open(chip8_capture_t *capture, const char *path,
+                        uint16_t fps) {
+  memset(capture, 0, sizeof(chip8_capture_t));
+
+  capture->frames =
+      malloc(CHIP8_CAPTURE_QUEUE * sizeof(chip8_capture_frame_t));
+  if (!capture->frames) {
+    perror("malloc");
+    return false;
+  }
+
+  capture->file = fopen(path, "wb");
+  if (!capture->file) {
+    perror("fopen");
+    free(capture->frames);
+    return false;
+  }
+
+  uint8_t header[8];
+  memcpy(header, "C8CV", 4);
+  put_le(put_le(header + 4, CHIP8_CAPTURE_VERSION, 2), fps, 2);
+  fwrite(header, 1, sizeof(header), capture->file);
+
+  atomic_init(&capture->head, 0);
+  atomic_init(&capture->tail, 0);
+  atomic_init(&capture->stop, false);
+
+  if (pthread_create(&capture->encoder, NULL, encoder_main, capture) != 0) {
+    fprintf(stderr, "Could not start capture encoder\n");
+    fclose(capture->file);
+    free(capture->frames);
+    return false;
+  }
+
+  return true;
+}
+
+// Queues the pending frame, waiting for a free slot
+static void push_pending(chip8_capture_t *capture) {
+  uint64_t head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+
+  // Only reload the consumer position when the cached one says full
+  if (head - capture->cached_tail == CHIP8_CAPTURE_QUEUE) {
+    capture->cached_tail =
+        atomic_load_explicit(&capture->tail, memory_order_acquire);
+    if (head - capture->cached_tail == CHIP8_CAPTURE_QUEUE) {
+      capture->waits++;
+    }
+    while (head - capture->cached_tail == CHIP8_CAPTURE_QUEUE) {
+      struct timespec wait = {0, PRODUCER_WAIT_NS};
+      nanosleep(&wait, NULL);
+      capture->cached_tail =
+          atomic_load_explicit(&capture->tail, memory_order_acquire);
+    }
+  }
+
+  capture->frames[head & (CHIP8_CAPTURE_QUEUE - 1)] = capture->pending;
+  atomic_store_explicit(&capture->head, head + 1, memory_order_release);
+}
+
+void chip8_capture_frame(chip8_capture_t *capture, const chip8_t *chip8) {
+  chip8_capture_frame_t *pending = &capture->pending;
+
+  // A frame like the pending one only adds to its count, so still screens
+  // cost the encoder nothing
+  if (pending->count > 0 && pending->count < UINT32_MAX &&
+      pending->hires == chip8->hires &&
+      memcmp(pending->display, chip8->display, sizeof(pending->display)) ==
+          0) {
+    pending->count++;
+    return;
+  }
+
+  if (pending->count > 0) {
+    push_pending(capture);
+  }
+  pending->count = 1;
+  pending->hires = chip8->hires;
+  memcpy(pending->display, chip8->display, sizeof(pending->display));
+}
+
+bool chip8_capture_close(chip8_capture_t *capture) {
+  if (capture->pending.count > 0) {
+    push_pending(capture);
+  }
+
+  atomic_store_explicit(&capture->stop, true, memory_order_release);
+  pthread_join(capture->encoder, NULL);
+
+  if (capture->waits) {
+    fprintf(stderr, "Capture waited on the encoder for %llu frames\n",
+            (unsigned long long)capture->waits);
+  }
+
+  uint8_t end[1 + 8];
+  end[0] = CHIP8_CAPTURE_END;
+  put_le(end + 1, capture->encoded, 8);
+  fwrite(end, 1, sizeof(end), capture->file);
+
+  bool ok = fclose(capture->file) == 0;
+  if (!ok) {
+    perror("fclose");
+  }
+  free(capture->frames);
+  capture->frames = NULL;
+  return ok;
+}
+
+uint16_t chip8_capture_read_header(FILE *file) {
+  uint8_t header[8];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, "C8CV", 4) != 0) {
+    fprintf(stderr, "Not a CHIP-8 capture\n");
+    return 0;
+  }
+
+  uint16_t version = get_le(header + 4, 2);
+  if (version != CHIP8_CAPTURE_VERSION) {
+    fprintf(stderr, "Unsupported capture version %u\n", version);
+    return 0;
+  }
+  return get_le(header + 6, 2);
+}
+
+bool chip8_capture_read(FILE *file, chip8_capture_frame_t *frame) {
+  uint8_t buf[8];
+  int kind = fgetc(file);
+
+  if (kind == CHIP8_CAPTURE_REPEAT) {
+    if (fread(buf, 1, 4, file) != 4) {
+      fprintf(stderr, "Capture ends in a repeat\n");
+      return false;
+    }
+    frame->count = get_le(buf, 4);
+    return true;
+  }
+
+  if (kind != CHIP8_CAPTURE_ROWS) {
+    if (kind != CHIP8_CAPTURE_END) {
+      fprintf(stderr, "Capture ends without its end record\n");
+    }
+    return false;
+  }
+
+  int hires = fgetc(file);
+  if (hires == EOF || fread(buf, 1, 8, file) != 8) {
+    fprintf(stderr, "Capture ends in a frame\n");
+    return false;
+  }
+  if (hires != frame->hires) {
+    memset(frame->display, 0, sizeof(frame->display));
+    frame->hires = hires;
+  }
+
+  uint64_t changed = get_le(buf, 8);
+  for (int y = 0; y < frame_rows(frame->hires); y++) {
+    if (!(changed & (1ull << y))) {
+      continue;
+    }
+    for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+      for (int word = 0; word < frame_words(frame->hires); word++) {
+        if (fread(buf, 1, 8, file) != 8) {
+          fprintf(stderr, "Capture ends in a frame\n");
+          return false;
+        }
+        frame->display[plane][y][word] = get_le(buf, 8);
+      }
+    }
+  }
+  frame->count = 1;
+  return true;
+}
@@ -0,0 +1,77 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Capture file, all values little-endian:
+//   "C8CV", u16 version, u16 frames per second
+//   records, each a u8 kind followed by:
+//     ROWS: u8 hires, u64 mask of the rows that changed, then for each set
+//       bit y from 0 up the words of row y in every plane, 8 bytes each.
+//       Rows are 1 word in low resolution and 2 in high.
+//     REPEAT: u32 n, the previous frame was shown n more times
+//     END: u64 frames
+// A change of resolution starts from a blank display, as on the machine.
+#define CHIP8_CAPTURE_VERSION 1
+#define CHIP8_CAPTURE_QUEUE 256 // Distinct frames in flight, a power of two
+
+enum {
+  CHIP8_CAPTURE_END = 0,
+  CHIP8_CAPTURE_ROWS,
+  CHIP8_CAPTURE_REPEAT,
+};
+
+typedef struct {
+  uint32_t count; // Timer ticks it was shown for
+  bool hires;
+  uint64_t display[CHIP8_NUM_PLANES][CHIP8_HIRES_HEIGHT][CHIP8_ROW_WORDS];
+} chip8_capture_frame_t;
+
+// Single producer, single consumer queue like the trace's. The emulating
+// thread folds identical frames into a count and queues each distinct one,
+// an encoder thread diffs them against the one before and writes the rows
+// that changed. A full queue makes the emulator wait, frames are never
+// dropped.
+typedef struct chip8_capture {
+  chip8_capture_frame_t *frames;
+
+  // Producer side, only touched by the emulating thread
+  chip8_capture_frame_t pending; // Newest frame, queued once it changes
+  uint64_t cached_tail;
+  uint64_t waits; // Frames that found the queue full
+
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+
+  _Atomic bool stop;
+  FILE *file;
+  pthread_t encoder;
+
+  // Encoder side
+  chip8_capture_frame_t last; // Frame the file ends on so far
+  uint64_t encoded;           // Frames written
+} chip8_capture_t;
+
+// Opens path and starts the encoder thread, attach with
+// chip8->capture = capture
+bool chip8_capture_open(chip8_capture_t *capture, const char *path,
+                        uint16_t fps);
+// Called by chip8_decrement_timers, once per emulated frame
+void chip8_capture_frame(chip8_capture_t *capture, const chip8_t *chip8);
+// Detach first, then writes what is left and closes the file
+bool chip8_capture_close(chip8_capture_t *capture);
+
+// Checks the header of a capture file opened for reading, returns its frames
+// per second or 0
+uint16_t chip8_capture_read_header(FILE *file);
+// Applies the next record to frame, which starts zeroed. count is how many
+// frames it is shown for. False at the end or on a damaged file.
+bool chip8_capture_read(FILE *file, chip8_capture_frame_t *frame);
+
+#endif
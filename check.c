@@ -0,0 +1,703 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "chip8.h"
+#include "jit.h"
+#include "movie.h"
+#include "rewind.h"
+
+#define FRAMES 240
+#define CYCLES_PER_FRAME 40
+#define REWIND_FRAMES 32 // History kept, fewer than are pushed
+#define REWIND_KEYFRAME_INTERVAL 8
+#define JIT_PROGRAMS 64
+#define JIT_PROGRAM_WORDS 96
+
+/* Synthetic roms, each is a setup followed by an endless loop */
+
+// Random glyphs on both planes in 128x64, a call that sets the timers and
+// stores to ram, and a scroll when the random key is down
+static const uint16_t state_rom[] = {
+    0x00FF, 0xF301, 0x6A00, 0x6B00,                 // 0x200
+    0xC00F, 0xF029, 0xDAB5, 0x7A07, 0x7B03, 0x2230, // 0x208
+    0xE19E, 0x1208, 0x00C1, 0x1208,                 // 0x214
+    0x0000, 0x0000,                                 // 0x21C
+    0x0000, 0x0000, 0x0000, 0x0000,                 // 0x220
+    0x0000, 0x0000, 0x0000, 0x0000,                 // 0x228
+    0xC10F, 0xF015, 0xF118, 0xA400, 0xF033, 0xF255, // 0x230
+    0x00EE,                                         // 0x23C
+};
+
+// Every 8XYn with X or Y or both VF on random values, then a wait for a key
+static const uint16_t flags_rom[] = {
+    0xC0FF, 0xC1FF, 0xCFFF, 0x80F4, // 0x200
+    0xCFFF, 0x8F14, 0xCFFF, 0x8FF5, // 0x208
+    0xCFFF, 0x8F07, 0xCFFF, 0x8F06, // 0x210
+    0xCFFF, 0x80FE, 0xCFFF, 0x8F1E, // 0x218
+    0xCFFF, 0x8F11, 0x81F2, 0x8FF3, // 0x220
+    0xCFFF, 0x8FF4, 0xCFFF, 0x8FF7, // 0x228
+    0xCFFF, 0x8FF6, 0xCFFF, 0x8FFE, // 0x230
+    0xCFFF, 0x81F5, 0xCFFF, 0x81F7, // 0x238
+    0xF20A, 0x7301, 0x1200,         // 0x240
+};
+
+static uint32_t rng_state = 1;
+
+// xorshift32, so every run presses the same keys
+static uint32_t next_random(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static void load_program(chip8_t *chip8, const uint16_t *program,
+                         size_t count) {
+  chip8_init(chip8);
+  chip8_seed(chip8, 0);
+  for (size_t i = 0; i < count; i++) {
+    chip8->ram[0x200 + i * 2] = program[i] >> 8;
+    chip8->ram[0x200 + i * 2 + 1] = program[i] & 0xFF;
+  }
+  chip8_invalidate(chip8, 0x200, count * 2);
+}
+
+// One 60 Hz frame with keys held down
+static void run_frame(chip8_t *chip8, uint16_t keys) {
+  chip8_set_keys(chip8, keys);
+  chip8_run(chip8, CYCLES_PER_FRAME);
+  chip8_decrement_timers(chip8);
+}
+
+// A key or none, none more often so the scroll path is not always taken
+static uint16_t random_keys(void) {
+  uint32_t r = next_random();
+  return r % 3 == 0 ? 1u << (r >> 8) % CHIP8_NUM_KEYS : 0;
+}
+
+// Compares the machine state of a and b, the dirty rows are what a frontend
+// has yet to draw and are left out
+static bool same_state(const chip8_t *a, const chip8_t *b) {
+  return memcmp(a, b, offsetof(chip8_t, dirty_rows)) == 0;
+}
+
+// FX55 stores over the instruction right after it, which already ran and
+// sits in the decode cache. The new instruction is the one that runs.
+static bool check_decode_cache(void) {
+  static const uint16_t program[] = {
+      0x6072, // 0x200 V0 = 0x72
+      0x6110, // 0x202 V1 = 0x10
+      0xA20A, // 0x204 I = 0x20A
+      0x3300, // 0x206 Skips the store on the first pass
+      0xF155, // 0x208 Stores 7210 over 0x20A
+      0x7201, // 0x20A V2 += 1, then V2 += 0x10
+      0x7301, // 0x20C V3 += 1
+      0x3302, // 0x20E Skips the jump back on the second pass
+      0x1206, // 0x210
+      0x1212, // 0x212
+  };
+  static chip8_t chip8;
+  load_program(&chip8, program, sizeof(program) / 2);
+  chip8_run(&chip8, 32);
+
+  if (chip8.V[2] != 0x11) {
+    fprintf(stderr, "V2 is %#x after the store, expected 0x11\n", chip8.V[2]);
+    return false;
+  }
+  return true;
+}
+
+// An 8 pixel wide sprite at x = 60 wraps around to x = 0-3, or is clipped
+// at the right edge in profiles that clip. Drawing it again erases it and
+// reports the collision in VF.
+static bool check_sprite_edge(void) {
+  static const uint16_t program[] = {
+      0x603C, // 0x200 V0 = 60
+      0x6100, // 0x202 V1 = 0
+      0xA20E, // 0x204 I = sprite
+      0xD011, // 0x206 Draws 8x1 at (60, 0)
+      0x82F0, // 0x208 V2 = VF
+      0xD011, // 0x20A Draws it again
+      0x120C, // 0x20C
+      0xFF00, // 0x20E Sprite, one row of 8 pixels
+  };
+  static chip8_t chip8;
+
+  for (uint8_t quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+    load_program(&chip8, program, sizeof(program) / 2);
+    chip8_set_quirks(&chip8, quirks);
+    bool wrap = !(chip8_quirk_flags(quirks) & CHIP8_QUIRK_CLIP);
+
+    chip8_run(&chip8, 5);
+    bool drawn = true;
+    for (uint8_t x = 0; x < CHIP8_SCREEN_WIDTH; x++) {
+      bool expected = x >= 60 || (wrap && x < 4);
+      drawn &= chip8_get_pixel(&chip8, x, 0) == expected;
+    }
+    chip8_run(&chip8, 1);
+    bool erased = true;
+    for (uint8_t x = 0; x < CHIP8_SCREEN_WIDTH; x++) {
+      erased &= !chip8_get_pixel(&chip8, x, 0);
+    }
+
+    if (!drawn || !erased || chip8.V[2] != 0 || chip8.V[0xF] != 1) {
+      fprintf(stderr, "%s: sprite at x = 60 %s%s, VF %d then %d\n",
+              chip8_quirks_name(quirks), drawn ? "" : "drawn wrong ",
+              erased ? "erased" : "not erased", chip8.V[2], chip8.V[0xF]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Only the rows a sprite touched are dirty, wrapped ones included, a clear
+// marks the rows that had pixels and clearing a blank display marks none
+static bool check_dirty_rows(void) {
+  static const uint16_t program[] = {
+      0x6000, // 0x200 V0 = 0
+      0x611E, // 0x202 V1 = 30
+      0xF029, // 0x204 I = glyph 0, 5 rows
+      0xD015, // 0x206 Draws at (0, 30), rows 30, 31, 0, 1 and 2
+      0x00E0, // 0x208
+      0x00E0, // 0x20A
+      0x120C, // 0x20C
+  };
+  static const uint64_t drawn = 3ull << 30 | 7;
+  static chip8_t chip8;
+  load_program(&chip8, program, sizeof(program) / 2);
+  chip8_consume_dirty(&chip8);
+
+  chip8_run(&chip8, 4);
+  uint64_t draw = chip8_consume_dirty(&chip8);
+  chip8_run(&chip8, 1);
+  uint64_t clear = chip8_consume_dirty(&chip8);
+  chip8_run(&chip8, 1);
+  uint64_t blank = chip8_consume_dirty(&chip8);
+
+  if (draw != drawn || clear != drawn || blank != 0) {
+    fprintf(stderr, "dirty rows %#llx, %#llx, %#llx, expected %#llx twice\n",
+            (unsigned long long)draw, (unsigned long long)clear,
+            (unsigned long long)blank, (unsigned long long)drawn);
+    return false;
+  }
+  return true;
+}
+
+// The high resolution display shows the one row sprite 0xA5 at (x, y) and
+// nothing else
+static bool shows_sprite(const chip8_t *chip8, int x, int y) {
+  for (int py = 0; py < 64; py++) {
+    for (int px = 0; px < 128; px++) {
+      bool lit =
+          py == y && px >= x && px < x + 8 && (0xA5 >> (7 - (px - x))) & 1;
+      if (chip8_get_pixel(chip8, px, py) != lit) {
+        fprintf(stderr, "scroll: pixel (%d, %d) is wrong, expected the sprite "
+                "at (%d, %d)\n", px, py, x, y);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// 00CN, 00FB and 00FC move a sprite drawn across the two words of a high
+// resolution row
+static bool check_scroll(void) {
+  static const uint16_t program[] = {
+      0x00FF, // 0x200 128x64
+      0x603C, // 0x202 V0 = 60
+      0x610A, // 0x204 V1 = 10
+      0xA214, // 0x206 I = 0x214
+      0xD011, // 0x208 Draws at (60, 10)
+      0x00C3, // 0x20A Down to (60, 13)
+      0x00FB, // 0x20C Right to (64, 13)
+      0x00FC, // 0x20E Left to (60, 13)
+      0x00FC, // 0x210 Left to (56, 13)
+      0x1212, // 0x212
+      0xA500, // 0x214 Sprite
+  };
+  static chip8_t chip8;
+  load_program(&chip8, program, sizeof(program) / 2);
+  chip8_set_quirks(&chip8, CHIP8_QUIRKS_SCHIP);
+
+  chip8_run(&chip8, 5);
+  if (!shows_sprite(&chip8, 60, 10)) {
+    return false;
+  }
+  chip8_run(&chip8, 1);
+  if (!shows_sprite(&chip8, 60, 13)) {
+    return false;
+  }
+  chip8_run(&chip8, 1);
+  if (!shows_sprite(&chip8, 64, 13)) {
+    return false;
+  }
+  chip8_run(&chip8, 2);
+  return shows_sprite(&chip8, 56, 13);
+}
+
+// Runs program with chip8_run and with chip8_cycle, frame by frame with
+// keys[frame] held. Both must end every frame in the same state and
+// chip8_run must report idle[frame].
+static bool run_idle(const char *name, const uint16_t *program, size_t count,
+                     const uint16_t *keys, const chip8_idle_t *idle,
+                     int frames) {
+  static chip8_t skipped, stepped;
+  load_program(&skipped, program, count);
+  load_program(&stepped, program, count);
+
+  for (int frame = 0; frame < frames; frame++) {
+    chip8_set_keys(&skipped, keys[frame]);
+    chip8_set_keys(&stepped, keys[frame]);
+    chip8_idle_t result = chip8_run(&skipped, CYCLES_PER_FRAME);
+    for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+      chip8_cycle(&stepped);
+    }
+    chip8_decrement_timers(&skipped);
+    chip8_decrement_timers(&stepped);
+
+    bool same = same_state(&skipped, &stepped);
+    if (result != idle[frame] || !same) {
+      fprintf(stderr, "%s frame %d: idle %d, expected %d%s\n", name, frame,
+              result, idle[frame], same ? "" : ", differs from chip8_cycle");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Skipping a loop that polls the delay timer, a wait for a key and a jump to
+// self ends each frame where chip8_cycle does
+static bool check_idle(void) {
+  static const uint16_t timer_program[] = {
+      0x6005, // 0x200 V0 = 5
+      0xF015, // 0x202 Delay timer = 5
+      0xF107, // 0x204 V1 = delay timer
+      0x3100, // 0x206 Leaves the loop once it is 0
+      0x1204, // 0x208
+      0x7201, // 0x20A V2 += 1
+      0x120C, // 0x20C
+  };
+  static const uint16_t timer_keys[7] = {0};
+  static const chip8_idle_t timer_idle[7] = {
+      CHIP8_IDLE_TIMER, CHIP8_IDLE_TIMER, CHIP8_IDLE_TIMER, CHIP8_IDLE_TIMER,
+      CHIP8_IDLE_TIMER, CHIP8_IDLE_HALT,  CHIP8_IDLE_HALT,
+  };
+
+  static const uint16_t key_program[] = {
+      0xF30A, // 0x200 V3 = key
+      0x7401, // 0x202 V4 += 1
+      0x1200, // 0x204
+  };
+  static const uint16_t key_keys[6] = {0, 0, 1 << 5, 1 << 5, 0, 0};
+  static const chip8_idle_t key_idle[6] = {
+      CHIP8_IDLE_KEY, CHIP8_IDLE_KEY, CHIP8_BUSY,
+      CHIP8_BUSY,     CHIP8_IDLE_KEY, CHIP8_IDLE_KEY,
+  };
+
+  return run_idle("timer", timer_program, sizeof(timer_program) / 2,
+                  timer_keys, timer_idle, 7) &&
+         run_idle("key", key_program, sizeof(key_program) / 2, key_keys,
+                  key_idle, 6);
+}
+
+// Every quirk but clipping, which sprite_edge covers, leaves its own mark
+// and each profile shows the marks of the quirks it has
+static bool check_quirks(void) {
+  static const uint16_t program[] = {
+      0x6004, // 0x200 V0 = 4
+      0x6210, // 0x202 V2 = 0x10
+      0xB208, // 0x204 Jumps to 0x20C, or to 0x218 with the VX quirk
+      0x0000, 0x0000, 0x0000, // 0x206
+      0x6301, // 0x20C V3 = 1
+      0x121C, // 0x20E
+      0x0000, 0x0000, 0x0000, 0x0000, // 0x210
+      0x6302, // 0x218 V3 = 2
+      0x121C, // 0x21A
+      0x6F07, // 0x21C VF = 7
+      0x6103, // 0x21E V1 = 3
+      0x8011, // 0x220 V0 |= V1, clears VF with the reset quirk
+      0x8EF0, // 0x222 VE = VF
+      0x8216, // 0x224 V2 = V2 >> 1, or V1 >> 1 with the shift quirk
+      0x8DF0, // 0x226 VD = VF
+      0xA300, // 0x228 I = 0x300
+      0xF155, // 0x22A Stores V0 and V1, I += 2 with the load/store quirk
+      0x6009, // 0x22C V0 = 9
+      0xF055, // 0x22E Stores V0 at 0x300, or at 0x302 with the quirk
+      0xA000, // 0x230 I = glyph 0
+      0xD550, // 0x232 Draws 16x16 with the DXY0 quirk, else nothing
+      0x4000, // 0x234 Skips the next instruction, V0 is not 0
+      0xF000, // 0x236 Skipped with its next word with the F000 quirk
+      0x6401, // 0x238 V4 = 1
+      0x123A, // 0x23A
+  };
+  static chip8_t chip8;
+
+  for (uint8_t quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+    load_program(&chip8, program, sizeof(program) / 2);
+    chip8_set_quirks(&chip8, quirks);
+    chip8_run(&chip8, 32);
+
+    uint8_t flags = chip8_quirk_flags(quirks);
+    bool shift_vy = flags & CHIP8_QUIRK_SHIFT_VY;
+    if (chip8.V[3] != (flags & CHIP8_QUIRK_JUMP_VX ? 2 : 1) ||
+        chip8.V[0xE] != (flags & CHIP8_QUIRK_VF_RESET ? 0 : 7) ||
+        chip8.V[2] != (shift_vy ? 1 : 8) || chip8.V[0xD] != shift_vy ||
+        chip8.ram[0x302] != (flags & CHIP8_QUIRK_LOAD_STORE_I ? 9 : 0) ||
+        chip8_get_pixel(&chip8, 0, 0) != !!(flags & CHIP8_QUIRK_LORES_DXY0) ||
+        chip8.V[4] != !(flags & CHIP8_QUIRK_LONG_F000)) {
+      fprintf(stderr, "%s: V2 %d V3 %d V4 %d VD %d VE %d 0x302 %d pixel %d\n",
+              chip8_quirks_name(quirks), chip8.V[2], chip8.V[3], chip8.V[4],
+              chip8.V[0xD], chip8.V[0xE], chip8.ram[0x302],
+              chip8_get_pixel(&chip8, 0, 0));
+      return false;
+    }
+  }
+  return true;
+}
+
+// A saved state loads into a fresh machine as an identical one, which then
+// runs on exactly like the original
+static bool check_save_state(void) {
+  static chip8_t chip8, loaded;
+  static uint8_t buf[CHIP8_SAVE_STATE_SIZE];
+  load_program(&chip8, state_rom, sizeof(state_rom) / 2);
+
+  for (int frame = 0; frame < FRAMES; frame++) {
+    run_frame(&chip8, random_keys());
+    if (frame % 16 != 0) {
+      continue;
+    }
+
+    size_t size = chip8_save_state(&chip8, buf, sizeof(buf));
+    chip8_init(&loaded);
+    if (size != CHIP8_SAVE_STATE_SIZE ||
+        !chip8_load_state(&loaded, buf, size) ||
+        !same_state(&chip8, &loaded)) {
+      fprintf(stderr, "frame %d: loaded state differs\n", frame);
+      return false;
+    }
+
+    for (int i = 0; i < 8; i++) {
+      uint16_t keys = random_keys();
+      run_frame(&chip8, keys);
+      run_frame(&loaded, keys);
+    }
+    if (!same_state(&chip8, &loaded)) {
+      fprintf(stderr, "frame %d: loaded state ran differently\n", frame);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Popping the rewind history gives back the states pushed, newest first,
+// and stops after the oldest one still kept
+static bool check_rewind(void) {
+  static chip8_t chip8;
+  static chip8_snapshot_t pushed[REWIND_FRAMES * 2];
+  rewind_t rw;
+  if (!rewind_init(&rw, REWIND_FRAMES * sizeof(chip8_snapshot_t),
+                   REWIND_FRAMES, REWIND_KEYFRAME_INTERVAL)) {
+    return false;
+  }
+  load_program(&chip8, state_rom, sizeof(state_rom) / 2);
+
+  bool ok = true;
+  for (int frame = 0; frame < REWIND_FRAMES * 2 && ok; frame++) {
+    run_frame(&chip8, random_keys());
+    chip8_consume_dirty(&chip8);
+    chip8_snapshot(&chip8, &pushed[frame]);
+    ok = rewind_push(&rw, &chip8);
+  }
+
+  for (int frame = REWIND_FRAMES * 2 - 1; frame >= REWIND_FRAMES && ok;
+       frame--) {
+    chip8_snapshot_t popped;
+    ok = rewind_pop(&rw, &chip8);
+    chip8_consume_dirty(&chip8);
+    chip8_snapshot(&chip8, &popped);
+    if (!ok || memcmp(&popped, &pushed[frame], sizeof(popped)) != 0) {
+      fprintf(stderr, "frame %d: popped state differs\n", frame);
+      ok = false;
+    }
+  }
+  if (ok && rewind_pop(&rw, &chip8)) {
+    fprintf(stderr, "popped a frame that should have been evicted\n");
+    ok = false;
+  }
+
+  rewind_free(&rw);
+  return ok;
+}
+
+// A recorded movie replays to the same display and state as the recording
+static bool check_movie(void) {
+  static chip8_t recorded, replayed;
+  char path[] = "/tmp/chip8_check_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return false;
+  }
+  close(fd);
+
+  movie_t movie;
+  load_program(&recorded, state_rom, sizeof(state_rom) / 2);
+  bool ok = movie_record_open(&movie, path, &recorded, 1234, CYCLES_PER_FRAME);
+  if (ok) {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      uint16_t keys = random_keys();
+      movie_record_frame(&movie, keys);
+      run_frame(&recorded, keys);
+    }
+    ok = movie_record_close(&movie, &recorded);
+  }
+
+  load_program(&replayed, state_rom, sizeof(state_rom) / 2);
+  if (ok && (ok = movie_replay_open(&movie, path, &replayed))) {
+    uint16_t keys;
+    while (movie_replay_frame(&movie, &keys)) {
+      run_frame(&replayed, keys);
+    }
+    ok = movie_replay_verify(&movie, &replayed);
+    movie_replay_close(&movie);
+  }
+  unlink(path);
+
+  if (ok && (chip8_display_hash(&replayed) != chip8_display_hash(&recorded) ||
+             !same_state(&replayed, &recorded))) {
+    fprintf(stderr, "replay ended in a different state\n");
+    ok = false;
+  }
+  return ok;
+}
+
+// Every lane of a batch matches a machine running the same rom with
+// chip8_cycle, in every quirks profile. A quarter of the lanes never get a
+// key and stay parked on FX0A while the others get through it.
+static bool check_batch(void) {
+  static chip8_t prototype, scalar[CHIP8_BATCH_LANES];
+  static chip8_batch_t batch __attribute__((aligned(64)));
+
+  for (uint8_t quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+    load_program(&prototype, flags_rom, sizeof(flags_rom) / 2);
+    chip8_set_quirks(&prototype, quirks);
+    if (!chip8_batch_init(&batch, &prototype, 7)) {
+      return false;
+    }
+    for (int lane = 0; lane < CHIP8_BATCH_LANES; lane++) {
+      scalar[lane] = prototype;
+      chip8_seed(&scalar[lane], 7 + lane);
+    }
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (int lane = 0; lane < CHIP8_BATCH_LANES; lane++) {
+        uint16_t keys = lane % 4 == 0 ? 0 : random_keys();
+        chip8_batch_set_keys(&batch, lane, keys);
+        chip8_set_keys(&scalar[lane], keys);
+      }
+
+      chip8_batch_run(&batch, CYCLES_PER_FRAME);
+      chip8_batch_decrement_timers(&batch);
+      for (int lane = 0; lane < CHIP8_BATCH_LANES; lane++) {
+        for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+          chip8_cycle(&scalar[lane]);
+        }
+        chip8_decrement_timers(&scalar[lane]);
+      }
+
+      for (int lane = 0; lane < CHIP8_BATCH_LANES; lane++) {
+        if (!same_state(chip8_batch_machine(&batch, lane), &scalar[lane])) {
+          fprintf(stderr, "%s frame %d lane %d: differs from chip8_cycle\n",
+                  chip8_quirks_name(quirks), frame, lane);
+          chip8_batch_free(&batch);
+          return false;
+        }
+      }
+    }
+    chip8_batch_free(&batch);
+  }
+
+  return true;
+}
+
+// An instruction the JIT compiles, or with control also a skip, key test or
+// jump that ends a block. Jumps are left for the caller to aim.
+static uint16_t random_instr(bool control) {
+  static const uint8_t alu[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE};
+  uint32_t r = next_random();
+  uint16_t x = (r >> 8 & 0xF) << 8;
+  uint16_t y = (r >> 12 & 0xF) << 4;
+  uint8_t nn = r >> 16;
+
+  switch (r % (control ? 16 : 11)) {
+  case 0:
+    return 0x6000 | x | nn;
+  case 1:
+    return 0x7000 | x | nn;
+  case 2:
+  case 3:
+  case 4:
+    return 0x8000 | x | y | alu[nn % sizeof(alu)];
+  case 5:
+    return 0xA000 | (r >> 16 & 0xFFF);
+  case 6:
+    return 0xF01E | x;
+  case 7:
+    return 0xF029 | x;
+  case 8:
+    return 0xF065 | x;
+  case 9:
+    return 0xF007 | x;
+  case 10:
+    return 0xF015 | x;
+  case 11:
+    return 0x3000 | x | (nn & 3);
+  case 12:
+    return 0x5000 | x | y;
+  case 13:
+    return (nn & 1 ? 0xE09E : 0xE0A1) | x;
+  case 14:
+    return 0x1000;
+  default:
+    return 0x9000 | x | y;
+  }
+}
+
+static bool is_skip(uint16_t instr) {
+  uint8_t kind = instr >> 12;
+  return kind == 0x3 || kind == 0x5 || kind == 0x9 || kind == 0xE;
+}
+
+// Random instructions with stores over the program mixed in. A store sets
+// I and writes with FX55 one more valid instruction over a single one, or
+// with FX33 three digits over the NN of a 7XNN that belongs to a store and
+// the 0000 after it, which still decodes as 0NNN and does nothing. Jumps only
+// go to the first word of an instruction or store and nothing skips into a
+// store, so every write lands where it was aimed. Returns the length in
+// words.
+static size_t jit_program(uint16_t *program) {
+  size_t starts[JIT_PROGRAM_WORDS], singles[JIT_PROGRAM_WORDS];
+  size_t digits[JIT_PROGRAM_WORDS], targets[JIT_PROGRAM_WORDS];
+  size_t num_starts = 0, num_singles = 0, num_digits = 0, num_targets = 0;
+  size_t count = 0;
+
+  while (count + 4 < JIT_PROGRAM_WORDS) {
+    uint32_t r = next_random();
+    starts[num_starts++] = count;
+    if (r % 8 != 0 || (count > 0 && is_skip(program[count - 1]))) {
+      singles[num_singles++] = count;
+      program[count++] = random_instr(true);
+    } else if (r & 8 && num_singles > 0) {
+      uint16_t instr = random_instr(false);
+      targets[num_targets++] = count + 2;
+      program[count++] = 0x6000 | instr >> 8;
+      program[count++] = 0x6100 | (instr & 0xFF);
+      program[count++] = 0xA000;
+      program[count++] = 0xF155;
+    } else {
+      targets[num_targets++] = count;
+      program[count++] = 0xA000;
+      program[count++] = 0xF033 | (r >> 8 & 0xF) << 8;
+      digits[num_digits++] = count;
+      program[count++] = 0x7000 | (r >> 12 & 0xFFF);
+      program[count++] = 0x0000;
+    }
+  }
+  program[count++] = 0x1200;
+
+  // Aim the jumps and stores now that the program is laid out
+  for (size_t i = 0; i < num_singles; i++) {
+    if (program[singles[i]] == 0x1000) {
+      program[singles[i]] |= 0x200 + starts[next_random() % num_starts] * 2;
+    }
+  }
+  for (size_t i = 0; i < num_targets; i++) {
+    size_t at = targets[i];
+    if (program[at + 1] == 0xF155) {
+      program[at] |= 0x200 + singles[next_random() % num_singles] * 2;
+    } else {
+      program[at] |= 0x200 + digits[next_random() % num_digits] * 2 + 1;
+    }
+  }
+  return count;
+}
+
+// The JIT matches chip8_cycle on random programs in every quirks profile,
+// including ones that store over blocks it has already compiled
+static bool check_jit(void) {
+  static chip8_t interpreted, compiled;
+  static chip8_jit_t jit;
+  uint16_t program[JIT_PROGRAM_WORDS];
+
+  for (int n = 0; n < JIT_PROGRAMS; n++) {
+    size_t count = jit_program(program);
+
+    for (uint8_t quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+      load_program(&interpreted, program, count);
+      chip8_set_quirks(&interpreted, quirks);
+      compiled = interpreted;
+      chip8_jit_init(&jit);
+
+      for (int frame = 0; frame < FRAMES / 4; frame++) {
+        uint16_t keys = random_keys();
+        chip8_set_keys(&interpreted, keys);
+        chip8_set_keys(&compiled, keys);
+        for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+          chip8_cycle(&interpreted);
+        }
+        chip8_jit_run(&jit, &compiled, CYCLES_PER_FRAME);
+        chip8_decrement_timers(&interpreted);
+        chip8_decrement_timers(&compiled);
+
+        if (!same_state(&compiled, &interpreted)) {
+          fprintf(stderr, "%s program %d frame %d: differs from chip8_cycle\n",
+                  chip8_quirks_name(quirks), n, frame);
+          chip8_jit_free(&jit);
+          return false;
+        }
+      }
+      chip8_jit_free(&jit);
+    }
+  }
+
+  return true;
+}
+
+typedef struct {
+  const char *name;
+  bool (*run)(void);
+} check_t;
+
+int main(void) {
+  static const check_t checks[] = {
+      {"decode_cache", check_decode_cache},
+      {"sprite_edge", check_sprite_edge},
+      {"dirty_rows", check_dirty_rows},
+      {"scroll", check_scroll},
+      {"idle", check_idle},
+      {"quirks", check_quirks},
+      {"save_state", check_save_state},
+      {"rewind", check_rewind},
+      {"movie", check_movie},
+      {"batch", check_batch},
+      {"jit", check_jit},
+  };
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    bool ok = checks[i].run();
+    printf("%-12s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+    failed += !ok;
+  }
+
+  exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -3,7 +3,16 @@
 #include <string.h>
 #include <time.h>
 
+#include "audio.h"
+#include "capture.h"
 #include "chip8.h"
+#include "profile.h"
+#include "trace.h"
+
+// Mask with a bit set for every display row
+#define ALL_ROWS ((1ull << (CHIP8_HIRES_HEIGHT - 1) << 1) - 1)
+
+#define BIG_FONT_ADDR 80 // Right after the small font
 
 /* CHIP-8 fontset (0–F) */
 static const uint8_t chip8_fontset[80] = {
@@ -25,8 +34,75 @@ static const uint8_t chip8_fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+/* SUPER-CHIP 8x10 fontset (0-9), XO-CHIP adds A-F */
+static const uint8_t chip8_big_fontset[160] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x3C, 0x7E, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0, // F
+};
+
+int chip8_screen_width(const chip8_t *chip8) {
+  return chip8->hires ? CHIP8_HIRES_WIDTH : CHIP8_SCREEN_WIDTH;
+}
+
+int chip8_screen_height(const chip8_t *chip8) {
+  return chip8->hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+}
+
 void chip8_clear_display(chip8_t *chip8) {
-  memset(chip8->display, false, sizeof(chip8->display));
+  // Only the area of the current resolution can be set, switching clears
+  const int height = chip8_screen_height(chip8);
+  const int words = chip8_screen_width(chip8) / 64;
+
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    if (!(chip8->planes & (1 << plane))) {
+      continue;
+    }
+
+    for (int y = 0; y < height; y++) {
+      uint64_t *line = chip8->display[plane][y];
+      // Rows that were already blank do not change
+      for (int word = 0; word < words; word++) {
+        if (line[word]) {
+          chip8->dirty_rows |= 1ull << y;
+          line[word] = 0;
+        }
+      }
+    }
+  }
+}
+
+void chip8_set_hires(chip8_t *chip8, bool hires) {
+  chip8->hires = hires;
+  memset(chip8->display, 0, sizeof(chip8->display));
+  chip8->dirty_rows = ALL_ROWS;
+}
+
+bool chip8_get_pixel(const chip8_t *chip8, uint8_t x, uint8_t y) {
+  uint64_t bits = 0;
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    bits |= chip8->display[plane][y][x / 64];
+  }
+  return (bits >> (63 - x % 64)) & 1;
+}
+
+uint64_t chip8_consume_dirty(chip8_t *chip8) {
+  uint64_t dirty = chip8->dirty_rows;
+  chip8->dirty_rows = 0;
+  return dirty;
 }
 
 void chip8_init(chip8_t *chip8) {
@@ -34,14 +110,35 @@ void chip8_init(chip8_t *chip8) {
 
   chip8->PC = 0x200; // Program entry point
 
-  for (int i = 0; i < 80; i++) {
-    chip8->ram[i] = chip8_fontset[i];
-  }
+  memcpy(chip8->ram, chip8_fontset, sizeof(chip8_fontset));
+  memcpy(&chip8->ram[BIG_FONT_ADDR], chip8_big_fontset,
+         sizeof(chip8_big_fontset));
+
+  chip8->planes = 1;
+  chip8->pitch = 64; // 4000 hz, one pattern bit per sample
 
-  chip8_clear_display(chip8);
+  // Frontends have not drawn anything yet
+  chip8->dirty_rows = ALL_ROWS;
 
-  // Used for CXNN opcode
-  srand(time(NULL));
+  // Used for CXNN opcode, call chip8_seed for a reproducible run
+  chip8_seed(chip8, time(NULL));
+}
+
+void chip8_seed(chip8_t *chip8, uint32_t seed) {
+  // Spread nearby seeds apart, xorshift never leaves a zero state
+  chip8->rng_state = seed * 2654435761u ^ 0x9E3779B9u;
+  if (chip8->rng_state == 0) {
+    chip8->rng_state = 1;
+  }
+}
+
+// xorshift32
+static uint32_t chip8_random(chip8_t *chip8) {
+  uint32_t x = chip8->rng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return chip8->rng_state = x;
 }
 
 bool chip8_load_rom(chip8_t *chip8, const char *filename) {
@@ -51,18 +148,37 @@ bool chip8_load_rom(chip8_t *chip8, const char *filename) {
     return false;
   }
 
-  fseek(rom, 0, SEEK_END);
-  size_t size = ftell(rom);
-  rewind(rom);
+  // Read straight into the entry point, a byte left over after the limit
+  // means the rom is too large
+  size_t size = fread(&chip8->ram[0x200], 1, CHIP8_MAX_ROM_SIZE, rom);
+  bool oversized = size == CHIP8_MAX_ROM_SIZE && fgetc(rom) != EOF;
+  bool failed = ferror(rom);
+  fclose(rom);
+  chip8_invalidate(chip8, 0x200, size);
+
+  if (failed) {
+    fprintf(stderr, "Could not read %s\n", filename);
+    return false;
+  }
+  if (oversized) {
+    fprintf(stderr, "%s is larger than %d bytes\n", filename,
+            CHIP8_MAX_ROM_SIZE);
+    return false;
+  }
+
+  return true;
+}
 
-  if (size > (CHIP8_MEMORY_SIZE - 0x200)) {
-    fclose(rom);
+bool chip8_load_rom_mem(chip8_t *chip8, const uint8_t *data, size_t size) {
+  if (size > CHIP8_MAX_ROM_SIZE) {
+    fprintf(stderr, "ROM is %zu bytes, at most %d fit\n", size,
+            CHIP8_MAX_ROM_SIZE);
     return false;
   }
 
   // Load rom into entry point
-  fread(&chip8->ram[0x200], 1, size, rom);
-  fclose(rom);
+  memcpy(&chip8->ram[0x200], data, size);
+  chip8_invalidate(chip8, 0x200, size);
 
   return true;
 }
@@ -75,416 +191,1262 @@ void chip8_set_key(chip8_t *chip8, uint8_t key, bool pressed) {
   chip8->keypad[key] = pressed;
 }
 
-void chip8_cycle(chip8_t *chip8) {
-  /* Fetch */
-  // Get the first two bytes and combine to get the opcode
-  uint16_t opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
-
-  chip8->PC += 2;
-
-  /* Decode */
-  uint16_t NNN = opcode & 0x0FFF;
-  uint8_t NN = opcode & 0x00FF;
-  uint8_t N = opcode & 0x000F;
-  uint8_t X = (opcode & 0x0F00) >> 8;
-  uint8_t Y = (opcode & 0x00F0) >> 4;
+void chip8_decode(chip8_instr_t *instr, uint16_t opcode) {
+  instr->opcode = opcode;
+  instr->NNN = opcode & 0x0FFF;
+  instr->NN = opcode & 0x00FF;
+  instr->X = (opcode & 0x0F00) >> 8;
+  instr->Y = (opcode & 0x00F0) >> 4;
 
-  /* Execute */
   switch (opcode & 0xF000) {
   case 0x0000:
     switch (opcode) {
     case 0x00E0:
-      // 00E0 Clears the screen
-#ifdef DEBUG
-      printf("Opcode 0x%04x: Clears the screen\n", opcode);
-#endif
-      chip8_clear_display(chip8);
+      instr->op = CHIP8_OP_00E0;
       break;
     case 0x00EE:
-      // 00EE Returns from a subroutine
-#ifdef DEBUG
-      printf("Opcode 0x%04x: Returns from a subroutine\n", opcode);
-#endif
-      chip8->sp--;
-      chip8->PC = chip8->stack[chip8->sp];
+      instr->op = CHIP8_OP_00EE;
+      break;
+    case 0x00FB:
+      instr->op = CHIP8_OP_00FB;
+      break;
+    case 0x00FC:
+      instr->op = CHIP8_OP_00FC;
+      break;
+    case 0x00FD:
+      instr->op = CHIP8_OP_00FD;
+      break;
+    case 0x00FE:
+      instr->op = CHIP8_OP_00FE;
+      break;
+    case 0x00FF:
+      instr->op = CHIP8_OP_00FF;
+      break;
+    default:
+      if ((opcode & 0xFFF0) == 0x00C0) {
+        instr->op = CHIP8_OP_00CN;
+      } else if ((opcode & 0xFFF0) == 0x00D0) {
+        instr->op = CHIP8_OP_00DN;
+      } else {
+        instr->op = CHIP8_OP_0NNN;
+      }
       break;
     }
     break;
-
   case 0x1000:
+    instr->op = CHIP8_OP_1NNN;
+    break;
+  case 0x2000:
+    instr->op = CHIP8_OP_2NNN;
+    break;
+  case 0x3000:
+    instr->op = CHIP8_OP_3XNN;
+    break;
+  case 0x4000:
+    instr->op = CHIP8_OP_4XNN;
+    break;
+  case 0x5000:
+    switch (opcode & 0x000F) {
+    case 0x0002:
+      instr->op = CHIP8_OP_5XY2;
+      break;
+    case 0x0003:
+      instr->op = CHIP8_OP_5XY3;
+      break;
+    default:
+      // Other low nibbles have always run as 5XY0
+      instr->op = CHIP8_OP_5XY0;
+      break;
+    }
+    break;
+  case 0x6000:
+    instr->op = CHIP8_OP_6XNN;
+    break;
+  case 0x7000:
+    instr->op = CHIP8_OP_7XNN;
+    break;
+  case 0x8000:
+    switch (opcode & 0x000F) {
+    case 0x0000:
+      instr->op = CHIP8_OP_8XY0;
+      break;
+    case 0x0001:
+      instr->op = CHIP8_OP_8XY1;
+      break;
+    case 0x0002:
+      instr->op = CHIP8_OP_8XY2;
+      break;
+    case 0x0003:
+      instr->op = CHIP8_OP_8XY3;
+      break;
+    case 0x0004:
+      instr->op = CHIP8_OP_8XY4;
+      break;
+    case 0x0005:
+      instr->op = CHIP8_OP_8XY5;
+      break;
+    case 0x0006:
+      instr->op = CHIP8_OP_8XY6;
+      break;
+    case 0x0007:
+      instr->op = CHIP8_OP_8XY7;
+      break;
+    case 0x000E:
+      instr->op = CHIP8_OP_8XYE;
+      break;
+    default:
+      instr->op = CHIP8_OP_UNKNOWN;
+      break;
+    }
+    break;
+  case 0x9000:
+    instr->op = CHIP8_OP_9XY0;
+    break;
+  case 0xA000:
+    instr->op = CHIP8_OP_ANNN;
+    break;
+  case 0xB000:
+    instr->op = CHIP8_OP_BNNN;
+    break;
+  case 0xC000:
+    instr->op = CHIP8_OP_CXNN;
+    break;
+  case 0xD000:
+    instr->op = CHIP8_OP_DXYN;
+    break;
+  case 0xE000:
+    switch (opcode & 0x00FF) {
+    case 0x009E:
+      instr->op = CHIP8_OP_EX9E;
+      break;
+    case 0x00A1:
+      instr->op = CHIP8_OP_EXA1;
+      break;
+    default:
+      instr->op = CHIP8_OP_UNKNOWN;
+      break;
+    }
+    break;
+  case 0xF000:
+    switch (opcode & 0x00FF) {
+    case 0x0000:
+      instr->op = opcode == 0xF000 ? CHIP8_OP_F000 : CHIP8_OP_UNKNOWN;
+      break;
+    case 0x0001:
+      instr->op = CHIP8_OP_FN01;
+      break;
+    case 0x0002:
+      instr->op = opcode == 0xF002 ? CHIP8_OP_F002 : CHIP8_OP_UNKNOWN;
+      break;
+    case 0x0007:
+      instr->op = CHIP8_OP_FX07;
+      break;
+    case 0x000A:
+      instr->op = CHIP8_OP_FX0A;
+      break;
+    case 0x0015:
+      instr->op = CHIP8_OP_FX15;
+      break;
+    case 0x0018:
+      instr->op = CHIP8_OP_FX18;
+      break;
+    case 0x001E:
+      instr->op = CHIP8_OP_FX1E;
+      break;
+    case 0x0029:
+      instr->op = CHIP8_OP_FX29;
+      break;
+    case 0x0030:
+      instr->op = CHIP8_OP_FX30;
+      break;
+    case 0x0033:
+      instr->op = CHIP8_OP_FX33;
+      break;
+    case 0x003A:
+      instr->op = CHIP8_OP_FX3A;
+      break;
+    case 0x0055:
+      instr->op = CHIP8_OP_FX55;
+      break;
+    case 0x0065:
+      instr->op = CHIP8_OP_FX65;
+      break;
+    case 0x0075:
+      instr->op = CHIP8_OP_FX75;
+      break;
+    case 0x0085:
+      instr->op = CHIP8_OP_FX85;
+      break;
+    default:
+      instr->op = CHIP8_OP_UNKNOWN;
+      break;
+    }
+    break;
+  }
+}
+
+void chip8_invalidate(chip8_t *chip8, uint16_t addr, uint32_t len) {
+  // The instruction starting one byte before addr also reads addr
+  uint32_t start = addr > 0 ? addr - 1 : 0;
+  uint32_t end = (uint32_t)addr + len;
+  if (end > CHIP8_DECODE_SIZE) {
+    end = CHIP8_DECODE_SIZE;
+  }
+
+  for (uint32_t i = start; i < end; i++) {
+    chip8->decoded[i].op = CHIP8_OP_NONE;
+  }
+}
+
+uint16_t chip8_get_keys(const chip8_t *chip8) {
+  uint16_t keys = 0;
+  for (int i = 0; i < CHIP8_NUM_KEYS; i++) {
+    keys |= chip8->keypad[i] << i;
+  }
+  return keys;
+}
+
+void chip8_set_keys(chip8_t *chip8, uint16_t keys) {
+  for (int i = 0; i < CHIP8_NUM_KEYS; i++) {
+    chip8->keypad[i] = (keys >> i) & 1;
+  }
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+uint64_t chip8_display_hash(const chip8_t *chip8) {
+  uint64_t hash = FNV_OFFSET;
+
+  hash ^= chip8->hires;
+  hash *= FNV_PRIME;
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+      for (int word = 0; word < CHIP8_ROW_WORDS; word++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+          hash ^= (chip8->display[plane][y][word] >> shift) & 0xFF;
+          hash *= FNV_PRIME;
+        }
+      }
+    }
+  }
+
+  return hash;
+}
+
+uint64_t chip8_ram_hash(const chip8_t *chip8) {
+  uint64_t hash = FNV_OFFSET;
+
+  for (int i = 0; i < CHIP8_MEMORY_SIZE; i++) {
+    hash ^= chip8->ram[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+// Skips the instruction at PC, F000 NNNN is two words long when the quirks
+// have CHIP8_QUIRK_LONG_F000
+static inline __attribute__((always_inline)) void
+chip8_skip(chip8_t *chip8, const uint8_t quirks) {
+  uint16_t pc = chip8->PC;
+  bool long_instr = (quirks & CHIP8_QUIRK_LONG_F000) &&
+                    chip8->ram[pc] == 0xF0 &&
+                    chip8->ram[(uint16_t)(pc + 1)] == 0x00;
+  chip8->PC += long_instr ? 4 : 2;
+}
+
+// XORs a sprite into each selected plane at (VX, VY), returns true if any
+// pixel was turned off. Rows are 8 pixels wide, or 16 wide and 16 high when
+// n is 0. Each plane takes the next sprite from I. Inlined with the row
+// width in words and the sprite width as constants.
+static inline __attribute__((always_inline)) bool
+chip8_draw_sprite(chip8_t *chip8, uint8_t vx, uint8_t vy, uint8_t n,
+                  const int words, const int row_bytes, const bool clip) {
+  const int height = words == 2 ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+  const int rows = row_bytes == 2 ? 16 : n;
+  const uint8_t x = vx % (words * 64);
+  const uint8_t y = vy % height;
+  const int word = x / 64;
+  const int shift = x % 64;
+
+  // The part of a row that spills out of its word goes into the next one, or
+  // wraps around to the first
+  int next = word + 1;
+  bool spill = true;
+  if (next == words) {
+    next = 0;
+    spill = !clip;
+  }
+
+  // Kept in locals, stores to the display could alias them
+  const uint8_t planes = chip8->planes;
+  uint64_t dirty = 0;
+  bool collision = false;
+  uint16_t data = chip8->I;
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    if (!(planes & (1 << plane))) {
+      continue;
+    }
+
+    for (int row = 0; row < rows; row++) {
+      int py = y + row;
+      if (py >= height) {
+        if (clip) {
+          break;
+        }
+        py -= height;
+      }
+
+      // Move the sprite row to x = 0 of a word
+      const uint16_t at = data + row * row_bytes;
+      uint64_t sprite = (uint64_t)chip8->ram[at] << 56;
+      if (row_bytes == 2) {
+        sprite |= (uint64_t)chip8->ram[(uint16_t)(at + 1)] << 48;
+      }
+      if (!sprite) {
+        continue;
+      }
+
+      uint64_t left = sprite >> shift;
+      uint64_t right = shift && spill ? sprite << (64 - shift) : 0;
+      uint64_t *line = chip8->display[plane][py];
+
+      // Sprite pixel is on and display pixel is on
+      collision |= ((line[word] & left) | (line[next] & right)) != 0;
+
+      // Toggles the display pixels
+      line[word] ^= left;
+      line[next] ^= right;
+      dirty |= 1ull << py;
+    }
+
+    data += rows * row_bytes;
+  }
+
+  chip8->dirty_rows |= dirty;
+  return collision;
+}
+
+// Scrolls the selected planes down by n rows, or up when n is negative.
+// Rows move as whole words.
+static void chip8_scroll_rows(chip8_t *chip8, int n) {
+  const int height = chip8_screen_height(chip8);
+  const int count = n < 0 ? -n : n;
+  const int kept = count < height ? height - count : 0;
+
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    if (!(chip8->planes & (1 << plane))) {
+      continue;
+    }
+
+    uint64_t(*rows)[CHIP8_ROW_WORDS] = chip8->display[plane];
+    if (n > 0) {
+      memmove(rows[height - kept], rows[0], kept * sizeof(rows[0]));
+      memset(rows[0], 0, (height - kept) * sizeof(rows[0]));
+    } else {
+      memmove(rows[0], rows[height - kept], kept * sizeof(rows[0]));
+      memset(rows[kept], 0, (height - kept) * sizeof(rows[0]));
+    }
+  }
+
+  chip8->dirty_rows |= ALL_ROWS;
+}
+
+// Scrolls the selected planes 4 pixels right, or left, shifting bits across
+// the two words of a high resolution row
+static void chip8_scroll_columns(chip8_t *chip8, bool right) {
+  const int height = chip8_screen_height(chip8);
+
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    if (!(chip8->planes & (1 << plane))) {
+      continue;
+    }
+
+    for (int y = 0; y < height; y++) {
+      uint64_t *line = chip8->display[plane][y];
+      if (!chip8->hires) {
+        line[0] = right ? line[0] >> 4 : line[0] << 4;
+      } else if (right) {
+        line[1] = (line[1] >> 4) | (line[0] << 60);
+        line[0] >>= 4;
+      } else {
+        line[0] = (line[0] << 4) | (line[1] >> 60);
+        line[1] <<= 4;
+      }
+    }
+  }
+
+  chip8->dirty_rows |= ALL_ROWS;
+}
+
+// One instruction with the quirks of a profile. Always inlined into a copy
+// per profile so the quirk tests are constants and compile away. left is
+// the cycles still to run after this one, it times sound changes.
+static inline __attribute__((always_inline)) void
+chip8_step(chip8_t *chip8, const uint8_t quirks, uint64_t left) {
+  /* Fetch */
+  // Decoding only happens the first time an address is executed, code past
+  // the cache is decoded every time
+  uint16_t pc = chip8->PC;
+  chip8_instr_t uncached;
+  chip8_instr_t *instr = &uncached;
+  if (pc < CHIP8_DECODE_SIZE) {
+    instr = &chip8->decoded[pc];
+  }
+  if (pc >= CHIP8_DECODE_SIZE || instr->op == CHIP8_OP_NONE) {
+    // Get the first two bytes and combine to get the opcode
+    chip8_decode(instr, (chip8->ram[pc] << 8) | chip8->ram[(uint16_t)(pc + 1)]);
+  }
+
+  if (chip8->profile) {
+    chip8_profile_step(chip8->profile, chip8, pc, instr);
+  }
+
+  chip8->PC += 2;
+
+  /* Decode */
+  const uint16_t opcode = instr->opcode;
+  const uint16_t NNN = instr->NNN;
+  const uint8_t NN = instr->NN;
+  const uint8_t N = instr->NN & 0x000F;
+  const uint8_t X = instr->X;
+  const uint8_t Y = instr->Y;
+
+  /* Execute */
+  switch (instr->op) {
+  case CHIP8_OP_0NNN:
+    break;
+
+  case CHIP8_OP_00E0:
+    // 00E0 Clears the screen
+    chip8_clear_display(chip8);
+    break;
+
+  case CHIP8_OP_00CN:
+    // 00CN Scrolls the display down N pixels
+    chip8_scroll_rows(chip8, N);
+    break;
+
+  case CHIP8_OP_00DN:
+    // 00DN Scrolls the display up N pixels
+    chip8_scroll_rows(chip8, -N);
+    break;
+
+  case CHIP8_OP_00FB:
+    // 00FB Scrolls the display right 4 pixels
+    chip8_scroll_columns(chip8, true);
+    break;
+
+  case CHIP8_OP_00FC:
+    // 00FC Scrolls the display left 4 pixels
+    chip8_scroll_columns(chip8, false);
+    break;
+
+  case CHIP8_OP_00FD:
+    // 00FD Exits the interpreter, which here stops on this instruction
+    chip8->PC -= 2;
+    break;
+
+  case CHIP8_OP_00FE:
+    // 00FE Switches to 64x32
+    chip8_set_hires(chip8, false);
+    break;
+
+  case CHIP8_OP_00FF:
+    // 00FF Switches to 128x64
+    chip8_set_hires(chip8, true);
+    break;
+
+  case CHIP8_OP_00EE:
+    // 00EE Returns from a subroutine
+    chip8->sp--;
+    chip8->PC = chip8->stack[chip8->sp];
+    break;
+
+  case CHIP8_OP_1NNN:
     // 1NNN Jumps to address NNN
-#ifdef DEBUG
-    printf("Opcode %#04x: Jumps address to %#x\n", opcode, NNN);
-#endif
     chip8->PC = NNN;
     break;
 
-  case 0x2000:
+  case CHIP8_OP_2NNN:
     // 2NNN Calls subroutine at NNN
-#ifdef DEBUG
-    printf("Opcode %#04x: Calls subroutine at %#x\n", opcode, NNN);
-#endif
     chip8->stack[chip8->sp++] = chip8->PC;
     chip8->PC = NNN;
     break;
 
-  case 0x3000:
+  case CHIP8_OP_3XNN:
     // 3XNN Skips the next instruction if V[X] == NN
-#ifdef DEBUG
-    printf("Opcode %#04x: Skips the next instruction if V[%u] == %u\n", opcode,
-           X, NN);
-#endif
     if (chip8->V[X] == NN) {
-      chip8->PC += 2;
+      chip8_skip(chip8, quirks);
     }
     break;
 
-  case 0x4000:
+  case CHIP8_OP_4XNN:
     // 4XNN Skips the next instruction if V[X] != NN
-#ifdef DEBUG
-    printf("Opcode %#04x: Skips the next instruction if V[%u] != %u\n", opcode,
-           X, NN);
-#endif
     if (chip8->V[X] != NN) {
-      chip8->PC += 2;
+      chip8_skip(chip8, quirks);
     }
     break;
 
-  case 0x5000:
+  case CHIP8_OP_5XY0:
     // 5XY0 Skips the next instruction if V[X] == V[Y]
-#ifdef DEBUG
-    printf("Opcode %#04x: Skips the next instruction if V[%u] == V[%u]\n",
-           opcode, X, Y);
-#endif
     if (chip8->V[X] == chip8->V[Y]) {
-      chip8->PC += 2;
+      chip8_skip(chip8, quirks);
     }
     break;
 
-  case 0x6000:
+  case CHIP8_OP_5XY2:
+    // 5XY2 Stores VX to VY in memory at I, in reverse order when X > Y.
+    // I is left unmodified.
+    for (int i = 0; i <= abs(X - Y); i++) {
+      chip8->ram[(uint16_t)(chip8->I + i)] = chip8->V[X < Y ? X + i : X - i];
+    }
+    chip8_invalidate(chip8, chip8->I, abs(X - Y) + 1);
+    break;
+
+  case CHIP8_OP_5XY3:
+    // 5XY3 Loads VX to VY from memory at I, in reverse order when X > Y
+    for (int i = 0; i <= abs(X - Y); i++) {
+      chip8->V[X < Y ? X + i : X - i] = chip8->ram[(uint16_t)(chip8->I + i)];
+    }
+    break;
+
+  case CHIP8_OP_6XNN:
     // 6XNN Sets VX to NN
-#ifdef DEBUG
-    printf("Opcode %#04x: Sets V[%u] to %u\n", opcode, X, NN);
-#endif
     chip8->V[X] = NN;
     break;
 
-  case 0x7000:
+  case CHIP8_OP_7XNN:
     // 7XNN Adds NN to VX
-#ifdef DEBUG
-    printf("Opcode %#04x: Adds %u to V[%u]\n", opcode, NN, X);
-#endif
     chip8->V[X] += NN;
     break;
 
-  case 0x8000:
-    switch (opcode & 0x000F) {
-    case 0x0000:
-      // 8XY0 Sets VX to the value VY
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets V[%u] to the value V[%u]\n", opcode, X, Y);
-#endif
-      chip8->V[X] = chip8->V[Y];
-      break;
-    case 0x0001:
-      // 8XY1 Sets VX to VX bitwise or VY
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets V[%u] to V[%u] bitwise or V[%u]\n", opcode, X,
-             X, Y);
-#endif
-      chip8->V[X] |= chip8->V[Y];
-      break;
-    case 0x0002:
-      // 8XY2 Sets VX to VX bitwise and VY
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets V[%u] to V[%u] bitwise and V[%u]\n", opcode, X,
-             X, Y);
-#endif
-      chip8->V[X] &= chip8->V[Y];
-      break;
-    case 0x0003:
-      // 8XY3 Sets VX to VX xor VY
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets V[%u] to V[%u] xor V[%u]\n", opcode, X, X, Y);
-#endif
-      chip8->V[X] ^= chip8->V[Y];
-      break;
-    case 0x0004: {
-      // 8XY4 Adds VY to VX, Sets VF to 1 if there's an overflow otherwise 0
-#ifdef DEBUG
-      printf("Opcode %#04x: Adds V[%u] to V[%u], Sets VF to 1 if there's an "
-             "overflow otherwise 0\n",
-             opcode, Y, X);
-#endif
-      // uint16 to store more than 256
-      uint16_t sum = chip8->V[X] + chip8->V[Y];
-
-      chip8->V[0xF] = (sum > 255);
-      // sum & 0xFF wraps sum to 255 e.g. 256 = 0, 257 = 1
-      chip8->V[X] = sum & 0xFF;
-      break;
+  case CHIP8_OP_8XY0:
+    // 8XY0 Sets VX to the value VY
+    chip8->V[X] = chip8->V[Y];
+    break;
+
+  case CHIP8_OP_8XY1:
+    // 8XY1 Sets VX to VX bitwise or VY
+    chip8->V[X] |= chip8->V[Y];
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      chip8->V[0xF] = 0;
     }
-    case 0x0005:
-      // 8XY5 VY is subtracted from VX, Sets VF to 0 if theres an underflow
-      // otherwise 1
-#ifdef DEBUG
-      printf("Opcode %#04x: V[%u] is subtracted from V[%u], Sets VF to 0 if "
-             "theres an underflow otherwise 1\n",
-             opcode, Y, X);
-#endif
-      // If VX is larger than VY there is no underflow
-      chip8->V[0xF] = (chip8->V[X] >= chip8->V[Y]);
-      chip8->V[X] -= chip8->V[Y];
-      break;
-    case 0x0006:
-      // 8XY6 Shifts VX to the right by 1, Sets VF to the least significant bit
-      // of VX prior to shift
-#ifdef DEBUG
-      printf("Opcode %#04x: Shifts V[%u] to the right by 1, Sets VF to the "
-             "least significant bit of V[%u] prior to shift\n",
-             opcode, X, X);
-#endif
-      chip8->V[0xF] = (chip8->V[X] & 1);
-      chip8->V[X] >>= 1;
-      break;
-    case 0x0007:
-      // 8XY7 Sets VX to VY - VX, VF is set to 1 if VY >= VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets V[%u] to V[%u] - V[%u], VF is set to 1 if "
-             "V[%u] >= V[%u]\n",
-             opcode, X, Y, X, Y, X);
-#endif
-      chip8->V[0xF] = (chip8->V[Y] >= chip8->V[X]);
-      chip8->V[X] = chip8->V[Y] - chip8->V[X];
-      break;
-    case 0x000E:
-      // 8XYE Shifts VX to the left by 1, Store most significant bit of VX to VF
-#ifdef DEBUG
-      printf("Opcode %#04x: Shifts V[%u] to the left by 1, Store the most "
-             "significant bit of V[%u] to VF\n",
-             opcode, X, X);
-#endif
-      // Store most significant bit of VX to VF
-      chip8->V[0xF] = (chip8->V[X] & 0b10000000) >> 7;
-      chip8->V[X] <<= 1;
+    break;
+
+  case CHIP8_OP_8XY2:
+    // 8XY2 Sets VX to VX bitwise and VY
+    chip8->V[X] &= chip8->V[Y];
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      chip8->V[0xF] = 0;
+    }
+    break;
+
+  case CHIP8_OP_8XY3:
+    // 8XY3 Sets VX to VX xor VY
+    chip8->V[X] ^= chip8->V[Y];
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      chip8->V[0xF] = 0;
+    }
+    break;
+
+  case CHIP8_OP_8XY4: {
+    // 8XY4 Adds VY to VX, Sets VF to 1 if there's an overflow otherwise 0
+    // uint16 to store more than 256
+    uint16_t sum = chip8->V[X] + chip8->V[Y];
+
+    chip8->V[0xF] = (sum > 255);
+    // sum & 0xFF wraps sum to 255 e.g. 256 = 0, 257 = 1
+    chip8->V[X] = sum & 0xFF;
+    break;
+  }
+
+  case CHIP8_OP_8XY5:
+    // 8XY5 VY is subtracted from VX, Sets VF to 0 if theres an underflow
+    // otherwise 1
+    // If VX is larger than VY there is no underflow
+    chip8->V[0xF] = (chip8->V[X] >= chip8->V[Y]);
+    chip8->V[X] -= chip8->V[Y];
+    break;
+
+  case CHIP8_OP_8XY6:
+    // 8XY6 Shifts VX to the right by 1, Sets VF to the least significant bit
+    // of VX prior to shift
+    if (quirks & CHIP8_QUIRK_SHIFT_VY) {
+      // The original interpreter shifts VY into VX
+      uint8_t value = chip8->V[Y];
+      chip8->V[X] = value >> 1;
+      chip8->V[0xF] = value & 1;
       break;
-    default:
-      fprintf(stderr, "\x1b[31mUnknown opcode: %#04x\x1b[0m\n", opcode);
+    }
+    chip8->V[0xF] = (chip8->V[X] & 1);
+    chip8->V[X] >>= 1;
+    break;
+
+  case CHIP8_OP_8XY7:
+    // 8XY7 Sets VX to VY - VX, VF is set to 1 if VY >= VX
+    chip8->V[0xF] = (chip8->V[Y] >= chip8->V[X]);
+    chip8->V[X] = chip8->V[Y] - chip8->V[X];
+    break;
+
+  case CHIP8_OP_8XYE:
+    // 8XYE Shifts VX to the left by 1, Store most significant bit of VX to VF
+    if (quirks & CHIP8_QUIRK_SHIFT_VY) {
+      uint8_t value = chip8->V[Y];
+      chip8->V[X] = value << 1;
+      chip8->V[0xF] = value >> 7;
       break;
     }
+    // Store most significant bit of VX to VF
+    chip8->V[0xF] = (chip8->V[X] & 0b10000000) >> 7;
+    chip8->V[X] <<= 1;
     break;
 
-  case 0x9000:
+  case CHIP8_OP_9XY0:
     // 9XY0 Skips the next instruction if VX != VY
-#ifdef DEBUG
-    printf("Opcode %#04x: Skips the next instruction if V[%u] != V[%u]\n",
-           opcode, X, Y);
-#endif
     if (chip8->V[X] != chip8->V[Y]) {
-      chip8->PC += 2;
+      chip8_skip(chip8, quirks);
     }
     break;
 
-  case 0xA000:
+  case CHIP8_OP_ANNN:
     // ANNN Sets I to address NNN
-#ifdef DEBUG
-    printf("Opcode %#04x: Sets I to %#x\n", opcode, NNN);
-#endif
     chip8->I = NNN;
     break;
 
-  case 0xB000:
-    // BNNN Jumps to the address V[0] + NNN
-#ifdef DEBUG
-    printf("Opcode %#04x: Jumps to the address V[0] + %u\n", opcode, NNN);
-#endif
-    chip8->PC = chip8->V[0] + NNN;
+  case CHIP8_OP_BNNN:
+    // BNNN Jumps to the address V[0] + NNN, or BXNN to VX + XNN
+    chip8->PC = chip8->V[(quirks & CHIP8_QUIRK_JUMP_VX) ? X : 0] + NNN;
     break;
 
-  case 0xC000: {
+  case CHIP8_OP_CXNN: {
     // CXNN Sets VX to rand() & NN
-#ifdef DEBUG
-    printf("Opcode %#04x: Sets V[%u] to rand() & %u\n", opcode, X, NN);
-#endif
     uint8_t random_number =
-        rand() % 256; // Generate random number from 0 to 255
+        chip8_random(chip8) >> 24; // Generate random number from 0 to 255
     chip8->V[X] = random_number & NN;
     break;
   }
 
-  case 0xD000: {
+  case CHIP8_OP_DXYN: {
     // DXYN
-    // Draws a sprite at coordinates (VX, VY) with a width of 8 and height of N
+    // Draws a sprite at coordinates (VX, VY) with a width of 8 and height of N,
+    // DXY0 draws a 16x16 sprite in 128x64, and in 64x32 only with
+    // CHIP8_QUIRK_LORES_DXY0, otherwise nothing
     // VF is set to 1 if any pixels are flipped from set to unset
-#ifdef DEBUG
-    printf("Opcode %#04x: draw(V[%u], V[%u], %u)\n", opcode, X, Y, N);
-#endif
-    uint8_t x_coord = chip8->V[X] % CHIP8_SCREEN_WIDTH;
-    uint8_t y_coord = chip8->V[Y] % CHIP8_SCREEN_HEIGHT;
-    chip8->V[0xF] = 0;
-
-    for (int row = 0; row < N; row++) {
-      uint8_t sprite = chip8->ram[chip8->I + row];
-
-      // 8 is the sprite width on the fonts
-      for (int col = 0; col < 8; col++) {
-        // Check if bit is on from most to least significant bit
-        if (sprite & (0b10000000 >> col)) {
-          // Get the display index
-          uint8_t px = (x_coord + col) % CHIP8_SCREEN_WIDTH;
-          uint8_t py = (y_coord + row) % CHIP8_SCREEN_HEIGHT;
-          int index = py * CHIP8_SCREEN_WIDTH + px;
-
-          // Sprite pixel is on and display pixel is on
-          if (chip8->display[index] == 1) {
-            chip8->V[0xF] = 1;
-          }
-
-          // Toggles the display pixel
-          chip8->display[index] ^= 1;
-        }
+    const bool clip = quirks & CHIP8_QUIRK_CLIP;
+    const uint8_t vx = chip8->V[X];
+    const uint8_t vy = chip8->V[Y];
+    bool collision;
+    if (!chip8->hires) {
+      if (N) {
+        collision = chip8_draw_sprite(chip8, vx, vy, N, 1, 1, clip);
+      } else if (quirks & CHIP8_QUIRK_LORES_DXY0) {
+        collision = chip8_draw_sprite(chip8, vx, vy, N, 1, 2, clip);
+      } else {
+        collision = false;
+      }
+    } else {
+      collision = N ? chip8_draw_sprite(chip8, vx, vy, N, 2, 1, clip)
+                    : chip8_draw_sprite(chip8, vx, vy, N, 2, 2, clip);
+    }
+    chip8->V[0xF] = collision;
+    break;
+  }
+
+  case CHIP8_OP_EX9E:
+    // EX9E Skips the next instruction if key() == VX
+    if (chip8->keypad[chip8->V[X]]) {
+      chip8_skip(chip8, quirks);
+    }
+    break;
+
+  case CHIP8_OP_EXA1:
+    // EXA1 Skips the next instruction if key() != VX
+    if (!chip8->keypad[chip8->V[X]]) {
+      chip8_skip(chip8, quirks);
+    }
+    break;
+
+  case CHIP8_OP_FX07:
+    // FX07 Sets VX to the delay timer
+    chip8->V[X] = chip8->delay_timer;
+    break;
+
+  case CHIP8_OP_FX0A: {
+    // FX0A Await key press then store to VX
+    bool key_found = false;
+
+    for (uint8_t i = 0; i < CHIP8_NUM_KEYS; i++) {
+      if (chip8->keypad[i]) {
+        chip8->V[X] = i;
+        key_found = true;
+        break;
       }
     }
 
+    if (!key_found) {
+      chip8->PC -= 2;
+    }
+
     break;
   }
 
-  case 0xE000:
-    switch (opcode & 0x00FF) {
-    case 0x009E:
-      // EX9E Skips the next instruction if key() == VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Skips the next instruction if key() == V[%u]\n",
-             opcode, X);
-#endif
-      if (chip8->keypad[chip8->V[X]]) {
-        chip8->PC += 2;
+  case CHIP8_OP_FX15:
+    // FX15 Sets the delay timer to VX
+    chip8->delay_timer = chip8->V[X];
+    break;
+
+  case CHIP8_OP_FX18:
+    // FX18 Sets the sound timer to VX
+    chip8->sound_timer = chip8->V[X];
+    if (chip8->audio) {
+      chip8_audio_changed(chip8->audio, chip8, left);
+    }
+    break;
+
+  case CHIP8_OP_FX1E:
+    // FX1E Adds VX to I
+    chip8->I += chip8->V[X];
+    break;
+
+  case CHIP8_OP_FX29:
+    // FX29 Sets I to the location of the sprite for the character in VX
+    chip8->I = chip8->V[X] * 5;
+    break;
+
+  case CHIP8_OP_FX30:
+    // FX30 Sets I to the 8x10 sprite for the character in VX
+    chip8->I = BIG_FONT_ADDR + (chip8->V[X] & 0xF) * 10;
+    break;
+
+  case CHIP8_OP_FX33: {
+    // FX33 Stores the decimal representation of VX with 100s digit to memory
+    // location I 10s digit to I+1 and ones digit to I+3
+    // E.g. if value is 210
+    // I + 0 = 2
+    // I + 1 = 1
+    // I + 3 = 0
+    uint8_t value = chip8->V[X];
+    chip8->ram[chip8->I] = value / 100;
+    chip8->ram[(uint16_t)(chip8->I + 1)] = (value / 10) % 10;
+    chip8->ram[(uint16_t)(chip8->I + 2)] = value % 10;
+    // Keep self-modifying ROMs correct
+    chip8_invalidate(chip8, chip8->I, 3);
+    break;
+  }
+
+  case CHIP8_OP_FX55:
+    // FX55 Stores from V0 to VX (including VX) in memory, starting at address
+    // I. The offset from I is increased by 1 for each value written
+    for (int i = 0; i <= X; i++) {
+      chip8->ram[(uint16_t)(chip8->I + i)] = chip8->V[i];
+    }
+    chip8_invalidate(chip8, chip8->I, X + 1);
+    if (quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+      chip8->I += X + 1;
+    }
+    break;
+
+  case CHIP8_OP_FX65:
+    // FX65 Fills from V0 to VX (including VX) with values from memory,
+    // starting at address I. The offset from I is increased by 1 for each
+    // value read, but I itself is left unmodified.
+    for (int i = 0; i <= X; i++) {
+      chip8->V[i] = chip8->ram[(uint16_t)(chip8->I + i)];
+    }
+    if (quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+      chip8->I += X + 1;
+    }
+    break;
+
+  case CHIP8_OP_FX3A:
+    // FX3A Sets the audio pattern playback rate from VX
+    chip8->pitch = chip8->V[X];
+    if (chip8->audio) {
+      chip8_audio_changed(chip8->audio, chip8, left);
+    }
+    break;
+
+  case CHIP8_OP_FX75:
+    // FX75 Saves V0 to VX in the user flags
+    for (int i = 0; i <= X; i++) {
+      chip8->flags[i] = chip8->V[i];
+    }
+    break;
+
+  case CHIP8_OP_FX85:
+    // FX85 Loads V0 to VX from the user flags
+    for (int i = 0; i <= X; i++) {
+      chip8->V[i] = chip8->flags[i];
+    }
+    break;
+
+  case CHIP8_OP_F000:
+    // F000 NNNN Sets I to the 16-bit address in the next word
+    chip8->I = (chip8->ram[chip8->PC] << 8) |
+               chip8->ram[(uint16_t)(chip8->PC + 1)];
+    chip8->PC += 2;
+    break;
+
+  case CHIP8_OP_FN01:
+    // FN01 Selects the planes drawn to, N is a bitmask
+    chip8->planes = X & 3;
+    break;
+
+  case CHIP8_OP_F002:
+    // F002 Loads the 16 byte audio pattern from I
+    for (int i = 0; i < CHIP8_PATTERN_SIZE; i++) {
+      chip8->pattern[i] = chip8->ram[(uint16_t)(chip8->I + i)];
+    }
+    if (chip8->audio) {
+      chip8_audio_changed(chip8->audio, chip8, left);
+    }
+    break;
+
+  default:
+    fprintf(stderr, "\x1b[31mUnknown opcode: %#04x\x1b[0m\n", opcode);
+    break;
+  }
+
+  if (chip8->trace) {
+    chip8_trace_step(chip8->trace, chip8, pc, opcode);
+  }
+}
+
+#define DEFAULT_QUIRKS 0
+#define COSMAC_QUIRKS                                                          \
+  (CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I | CHIP8_QUIRK_VF_RESET |    \
+   CHIP8_QUIRK_CLIP)
+#define SCHIP_QUIRKS                                                           \
+  (CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP | CHIP8_QUIRK_LORES_DXY0 |           \
+   CHIP8_QUIRK_LONG_F000)
+#define XOCHIP_QUIRKS                                                          \
+  (CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I | CHIP8_QUIRK_LORES_DXY0 |  \
+   CHIP8_QUIRK_LONG_F000)
+
+static const uint8_t quirk_flags[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_DEFAULT] = DEFAULT_QUIRKS,
+    [CHIP8_QUIRKS_COSMAC] = COSMAC_QUIRKS,
+    [CHIP8_QUIRKS_SCHIP] = SCHIP_QUIRKS,
+    [CHIP8_QUIRKS_XOCHIP] = XOCHIP_QUIRKS,
+};
+
+static const char *quirk_names[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_DEFAULT] = "default",
+    [CHIP8_QUIRKS_COSMAC] = "cosmac",
+    [CHIP8_QUIRKS_SCHIP] = "schip",
+    [CHIP8_QUIRKS_XOCHIP] = "xochip",
+};
+
+uint8_t chip8_quirk_flags(uint8_t quirks) {
+  return quirks < CHIP8_QUIRKS_COUNT ? quirk_flags[quirks] : 0;
+}
+
+const char *chip8_quirks_name(uint8_t quirks) {
+  return quirks < CHIP8_QUIRKS_COUNT ? quirk_names[quirks] : NULL;
+}
+
+int chip8_quirks_from_name(const char *name) {
+  for (int i = 0; i < CHIP8_QUIRKS_COUNT; i++) {
+    if (strcmp(name, quirk_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool chip8_set_quirks(chip8_t *chip8, uint8_t quirks) {
+  if (quirks >= CHIP8_QUIRKS_COUNT) {
+    fprintf(stderr, "Unknown quirks profile %u\n", quirks);
+    return false;
+  }
+  chip8->quirks = quirks;
+  return true;
+}
+
+// Checks for FX07 VX at pc followed by a skip on VX that does not fire for
+// the current delay timer and a jump back to pc. Until the next timer tick
+// every pass through it leaves the machine exactly as it was.
+static bool chip8_timer_loop(const chip8_t *chip8, uint16_t pc,
+                             const chip8_instr_t *read) {
+  if (!chip8->delay_timer) {
+    return false;
+  }
+
+  chip8_instr_t skip, jump;
+  uint16_t at = (pc + 2) & (CHIP8_MEMORY_SIZE - 1);
+  chip8_decode(&skip, (chip8->ram[at] << 8) |
+                          chip8->ram[(at + 1) & (CHIP8_MEMORY_SIZE - 1)]);
+  at = (pc + 4) & (CHIP8_MEMORY_SIZE - 1);
+  chip8_decode(&jump, (chip8->ram[at] << 8) |
+                          chip8->ram[(at + 1) & (CHIP8_MEMORY_SIZE - 1)]);
+
+  if (skip.X != read->X || jump.op != CHIP8_OP_1NNN || jump.NNN != pc) {
+    return false;
+  }
+
+  return (skip.op == CHIP8_OP_3XNN && chip8->delay_timer != skip.NN) ||
+         (skip.op == CHIP8_OP_4XNN && chip8->delay_timer == skip.NN);
+}
+
+// The CHIP8_EVENT_* an instruction raises when it runs, at most one
+static int chip8_op_events(uint8_t op) {
+  switch (op) {
+  case CHIP8_OP_00E0:
+  case CHIP8_OP_DXYN:
+  case CHIP8_OP_00CN:
+  case CHIP8_OP_00DN:
+  case CHIP8_OP_00FB:
+  case CHIP8_OP_00FC:
+  case CHIP8_OP_00FE:
+  case CHIP8_OP_00FF:
+    return CHIP8_EVENT_DRAW;
+  case CHIP8_OP_FX18:
+  case CHIP8_OP_F002:
+  case CHIP8_OP_FX3A:
+    return CHIP8_EVENT_SOUND;
+  default:
+    return 0;
+  }
+}
+
+// Decodes the instruction at pc unless the cache already has it
+static uint8_t chip8_op_at(const chip8_t *chip8, uint16_t pc) {
+  if (pc < CHIP8_DECODE_SIZE && chip8->decoded[pc].op != CHIP8_OP_NONE) {
+    return chip8->decoded[pc].op;
+  }
+  chip8_instr_t instr;
+  chip8_decode(&instr, (chip8->ram[pc] << 8) |
+                           chip8->ram[(uint16_t)(pc + 1)]);
+  return instr.op;
+}
+
+// Runs like chip8_run and stops after an instruction that raises one of
+// events, which go to raised. Returns the cycles left, an idle machine uses
+// up the whole budget. Without events the checks compile away.
+static inline __attribute__((always_inline)) uint64_t
+chip8_run_with(chip8_t *chip8, uint64_t cycles, const uint8_t quirks,
+               const int events, chip8_idle_t *idle, int *raised) {
+  // Code past the decode cache is never found idle
+  static const chip8_instr_t uncached = {.op = CHIP8_OP_NONE};
+
+  for (; cycles > 0; cycles--) {
+    uint16_t pc = chip8->PC;
+    const chip8_instr_t *instr =
+        pc < CHIP8_DECODE_SIZE ? &chip8->decoded[pc] : &uncached;
+
+    switch (instr->op) {
+    case CHIP8_OP_FX0A:
+      // Executing it again changes nothing until a key goes down
+      if (chip8_get_keys(chip8) == 0) {
+        *idle = CHIP8_IDLE_KEY;
+        return 0;
       }
       break;
-    case 0x00A1:
-      // EXA1 Skips the next instruction if key() != VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Skips the next instruction if key() != V[%u]\n",
-             opcode, X);
-#endif
-      if (!chip8->keypad[chip8->V[X]]) {
-        chip8->PC += 2;
+
+    case CHIP8_OP_1NNN:
+      if (instr->NNN == pc) {
+        *idle = CHIP8_IDLE_HALT;
+        return 0;
       }
       break;
-    default:
-      fprintf(stderr, "\x1b[31mUnknown opcode: %#04x\x1b[0m\n", opcode);
-      break;
-    }
-    break;
 
-  case 0xF000:
-    switch (opcode & 0x00FF) {
-    case 0x0007:
-      // FX07 Sets VX to the delay timer
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets V[%u] to the delay timer\n", opcode, X);
-#endif
-      chip8->V[X] = chip8->delay_timer;
-      break;
-    case 0x000A: {
-      // FX0A Await key press then store to VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Await key press then store to V[%u]\n", opcode, X);
-#endif
-      bool key_found = false;
-
-      for (uint8_t i = 0; i < CHIP8_NUM_KEYS; i++) {
-        if (chip8->keypad[i]) {
-          chip8->V[X] = i;
-          key_found = true;
-          break;
+    case CHIP8_OP_00FD:
+      *idle = CHIP8_IDLE_HALT;
+      return 0;
+
+    case CHIP8_OP_FX07:
+      // Whole passes of the 3 instruction loop only leave VX = delay timer,
+      // the remainder runs so PC ends where it would have
+      if (cycles >= 3 && chip8_timer_loop(chip8, pc, instr)) {
+        chip8->V[instr->X] = chip8->delay_timer;
+        for (cycles %= 3; cycles > 0; cycles--) {
+          chip8_step(chip8, quirks, cycles - 1);
         }
+        *idle = CHIP8_IDLE_TIMER;
+        return 0;
       }
+      break;
+    }
 
-      if (!key_found) {
-        chip8->PC -= 2;
+    if (events) {
+      uint8_t op = instr->op ? instr->op : chip8_op_at(chip8, pc);
+      chip8_step(chip8, quirks, cycles - 1);
+      *raised = chip8_op_events(op) & events;
+      if (*raised) {
+        return cycles - 1;
       }
+    } else {
+      chip8_step(chip8, quirks, cycles - 1);
+    }
+  }
 
-      break;
+  *idle = CHIP8_BUSY;
+  return 0;
+}
+
+// An out of line interpreter and run loops per profile. A lone instruction
+// has no run around it, its sound changes count as at the end of the run.
+#define CHIP8_PROFILE(name, flags)                                             \
+  static void chip8_step_##name(chip8_t *chip8) {                              \
+    chip8_step(chip8, flags, 0);                                               \
+  }                                                                            \
+  static chip8_idle_t chip8_run_##name(chip8_t *chip8, uint64_t cycles) {      \
+    chip8_idle_t idle;                                                         \
+    chip8_run_with(chip8, cycles, flags, 0, &idle, NULL);                      \
+    return idle;                                                               \
+  }                                                                            \
+  static uint64_t chip8_until_##name(chip8_t *chip8, uint64_t cycles,          \
+                                     int events, chip8_idle_t *idle,           \
+                                     int *raised) {                            \
+    return chip8_run_with(chip8, cycles, flags, events, idle, raised);        \
+  }
+
+CHIP8_PROFILE(default, DEFAULT_QUIRKS)
+CHIP8_PROFILE(cosmac, COSMAC_QUIRKS)
+CHIP8_PROFILE(schip, SCHIP_QUIRKS)
+CHIP8_PROFILE(xochip, XOCHIP_QUIRKS)
+
+void chip8_cycle(chip8_t *chip8) {
+  switch (chip8->quirks) {
+  case CHIP8_QUIRKS_COSMAC:
+    chip8_step_cosmac(chip8);
+    break;
+  case CHIP8_QUIRKS_SCHIP:
+    chip8_step_schip(chip8);
+    break;
+  case CHIP8_QUIRKS_XOCHIP:
+    chip8_step_xochip(chip8);
+    break;
+  default:
+    chip8_step_default(chip8);
+    break;
+  }
+}
+
+chip8_idle_t chip8_run(chip8_t *chip8, uint64_t cycles) {
+  // Observers expect to see every instruction
+  if (chip8->profile || chip8->trace) {
+    for (; cycles > 0; cycles--) {
+      chip8_cycle(chip8);
     }
-    case 0x0015:
-      // FX15 Sets the delay timer to VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets the delay timer to V[%u]\n", opcode, X);
-#endif
-      chip8->delay_timer = chip8->V[X];
+    return CHIP8_BUSY;
+  }
+
+  // The profile is picked once per call, not per instruction
+  switch (chip8->quirks) {
+  case CHIP8_QUIRKS_COSMAC:
+    return chip8_run_cosmac(chip8, cycles);
+  case CHIP8_QUIRKS_SCHIP:
+    return chip8_run_schip(chip8, cycles);
+  case CHIP8_QUIRKS_XOCHIP:
+    return chip8_run_xochip(chip8, cycles);
+  default:
+    return chip8_run_default(chip8, cycles);
+  }
+}
+
+chip8_idle_t chip8_run_frame(chip8_t *chip8, uint64_t cycles) {
+  chip8_idle_t idle = chip8_run(chip8, cycles);
+  chip8_decrement_timers(chip8);
+  return idle;
+}
+
+int chip8_run_until(chip8_t *chip8, uint64_t cycles, int events,
+                    uint64_t *ran) {
+  chip8_idle_t idle = CHIP8_BUSY;
+  int raised = 0;
+  uint64_t left = 0;
+
+  if (chip8->profile || chip8->trace) {
+    // Observers expect to see every instruction, so nothing is skipped
+    for (left = cycles; left > 0 && !raised; left--) {
+      raised = chip8_op_events(chip8_op_at(chip8, chip8->PC)) & events;
+      chip8_cycle(chip8);
+    }
+  } else {
+    switch (chip8->quirks) {
+    case CHIP8_QUIRKS_COSMAC:
+      left = chip8_until_cosmac(chip8, cycles, events, &idle, &raised);
       break;
-    case 0x0018:
-      // FX18 Sets the sound timer to VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets the sound timer to V[%u]\n", opcode, X);
-#endif
-      chip8->sound_timer = chip8->V[X];
+    case CHIP8_QUIRKS_SCHIP:
+      left = chip8_until_schip(chip8, cycles, events, &idle, &raised);
       break;
-    case 0x001E:
-      // FX1E Adds VX to I
-#ifdef DEBUG
-      printf("Opcode %#04x: Adds V[%u] to I\n", opcode, X);
-#endif
-      chip8->I += chip8->V[X];
+    case CHIP8_QUIRKS_XOCHIP:
+      left = chip8_until_xochip(chip8, cycles, events, &idle, &raised);
       break;
-    case 0x0029:
-      // FX29 Sets I to the location of the sprite for the character in VX
-#ifdef DEBUG
-      printf("Opcode %#04x: Sets I to the location of the sprite for the "
-             "character in V[%u]\n",
-             opcode, X);
-#endif
-      chip8->I = chip8->V[X] * 5;
-      break;
-    case 0x0033: {
-      // FX33 Stores the decimal representation of VX with 100s digit to memory
-      // location I 10s digit to I+1 and ones digit to I+3
-      // E.g. if value is 210
-      // I + 0 = 2
-      // I + 1 = 1
-      // I + 3 = 0
-#ifdef DEBUG
-      printf(
-          "Opcode %#04x: Stores binary coded decimal representation of V[%u]\n",
-          opcode, X);
-#endif
-      uint8_t value = chip8->V[X];
-      chip8->ram[chip8->I] = value / 100;
-      chip8->ram[chip8->I + 1] = (value / 10) % 10;
-      chip8->ram[chip8->I + 2] = value % 10;
+    default:
+      left = chip8_until_default(chip8, cycles, events, &idle, &raised);
       break;
     }
-    case 0x0055:
-      // FX55 Stores from V0 to VX (including VX) in memory, starting at address
-      // I. The offset from I is increased by 1 for each value written
-#ifdef DEBUG
-      printf("Opcode %#04x: reg_dump(V[%u], &I)\n", opcode, X);
-#endif
-      for (int i = 0; i <= X; i++) {
-        chip8->ram[chip8->I + i] = chip8->V[i];
+  }
+
+  if (ran) {
+    *ran = cycles - left;
+  }
+  if (!raised && idle != CHIP8_BUSY && (events & CHIP8_EVENT_IDLE)) {
+    return CHIP8_EVENT_IDLE;
+  }
+  return raised;
+}
+
+int chip8_abi_version(void) { return CHIP8_ABI_VERSION; }
+
+size_t chip8_size(void) { return sizeof(chip8_t); }
+
+void chip8_snapshot(const chip8_t *chip8, chip8_snapshot_t *snapshot) {
+  memcpy(snapshot->data, chip8, CHIP8_STATE_SIZE);
+}
+
+void chip8_restore(chip8_t *chip8, const chip8_snapshot_t *snapshot) {
+  const chip8_t *state = (const chip8_t *)snapshot->data;
+
+  // Only drop decoded instructions where ram actually differs, restoring to
+  // a nearby point of the same rom usually touches a few bytes
+  for (uint32_t addr = 0; addr < CHIP8_DECODE_SIZE; addr += 8) {
+    if (memcmp(&chip8->ram[addr], &state->ram[addr], 8) != 0) {
+      chip8_invalidate(chip8, addr, 8);
+    }
+  }
+
+  uint64_t dirty = chip8->dirty_rows | state->dirty_rows;
+  if (chip8->hires != state->hires) {
+    dirty = ALL_ROWS;
+  }
+  for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+    for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+      if (memcmp(chip8->display[plane][y], state->display[plane][y],
+                 sizeof(chip8->display[plane][y])) != 0) {
+        dirty |= 1ull << y;
       }
-      break;
-    case 0x0065:
-      // FX65 Fills from V0 to VX (including VX) with values from memory,
-      // starting at address I. The offset from I is increased by 1 for each
-      // value read, but I itself is left unmodified.
-#ifdef DEBUG
-      printf("Opcode %#04x: reg_load(V[%u], &I)\n", opcode, X);
-#endif
-      for (int i = 0; i <= X; i++) {
-        chip8->V[i] = chip8->ram[chip8->I + i];
+    }
+  }
+
+  memcpy(chip8, snapshot->data, CHIP8_STATE_SIZE);
+  chip8->dirty_rows = dirty;
+}
+
+static uint8_t *put_le(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    *p++ = value >> (i * 8);
+  }
+  return p;
+}
+
+static uint64_t get_le(const uint8_t **p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)(*p)[i] << (i * 8);
+  }
+  *p += bytes;
+  return value;
+}
+
+size_t chip8_save_state(const chip8_t *chip8, uint8_t *buf, size_t size) {
+  if (size < CHIP8_SAVE_STATE_SIZE) {
+    return 0;
+  }
+
+  uint8_t *p = buf;
+  memcpy(p, "C8SS", 4);
+  p = put_le(p + 4, CHIP8_SAVE_STATE_VERSION, 2);
+
+  memcpy(p, chip8->ram, CHIP8_MEMORY_SIZE);
+  p += CHIP8_MEMORY_SIZE;
+  memcpy(p, chip8->V, 16);
+  p += 16;
+  p = put_le(p, chip8->I, 2);
+  p = put_le(p, chip8->PC, 2);
+  for (int i = 0; i < CHIP8_STACK_SIZE; i++) {
+    p = put_le(p, chip8->stack[i], 2);
+  }
+  *p++ = chip8->sp;
+  *p++ = chip8->delay_timer;
+  *p++ = chip8->sound_timer;
+  for (int i = 0; i < CHIP8_NUM_KEYS; i++) {
+    *p++ = chip8->keypad[i];
+  }
+  p = put_le(p, chip8->rng_state, 4);
+  *p++ = chip8->quirks;
+  memcpy(p, chip8->flags, CHIP8_NUM_FLAGS);
+  p += CHIP8_NUM_FLAGS;
+  memcpy(p, chip8->pattern, CHIP8_PATTERN_SIZE);
+  p += CHIP8_PATTERN_SIZE;
+  *p++ = chip8->pitch;
+  *p++ = chip8->hires;
+  *p++ = chip8->planes;
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+      for (int word = 0; word < CHIP8_ROW_WORDS; word++) {
+        p = put_le(p, chip8->display[plane][y][word], 8);
       }
-      break;
-    default:
-      fprintf(stderr, "\x1b[31mUnknown opcode: %#04x\x1b[0m\n", opcode);
-      break;
     }
-    break;
-  default:
-    fprintf(stderr, "\x1b[31mUnknown opcode: %#04x\x1b[0m\n", opcode);
-    break;
   }
+
+  return p - buf;
+}
+
+bool chip8_load_state(chip8_t *chip8, const uint8_t *buf, size_t size) {
+  if (size < CHIP8_SAVE_STATE_SIZE || memcmp(buf, "C8SS", 4) != 0) {
+    fprintf(stderr, "Not a CHIP-8 save state\n");
+    return false;
+  }
+
+  const uint8_t *p = buf + 4;
+  uint16_t version = get_le(&p, 2);
+  if (version != CHIP8_SAVE_STATE_VERSION) {
+    fprintf(stderr, "Unsupported save state version %u\n", version);
+    return false;
+  }
+
+  // The stack pointer, profile and planes are checked before anything is
+  // overwritten
+  const uint8_t *regs = p + CHIP8_MEMORY_SIZE + 16 + 2 + 2;
+  const uint8_t *quirks = regs + CHIP8_STACK_SIZE * 2 + 3 + CHIP8_NUM_KEYS + 4;
+  const uint8_t *planes = quirks + 1 + CHIP8_NUM_FLAGS + CHIP8_PATTERN_SIZE + 2;
+  if (regs[CHIP8_STACK_SIZE * 2] > CHIP8_STACK_SIZE ||
+      *quirks >= CHIP8_QUIRKS_COUNT || *planes > 3) {
+    fprintf(stderr, "Corrupt save state\n");
+    return false;
+  }
+
+  memcpy(chip8->ram, p, CHIP8_MEMORY_SIZE);
+  p += CHIP8_MEMORY_SIZE;
+  memcpy(chip8->V, p, 16);
+  p += 16;
+  chip8->I = get_le(&p, 2);
+  chip8->PC = get_le(&p, 2);
+  for (int i = 0; i < CHIP8_STACK_SIZE; i++) {
+    chip8->stack[i] = get_le(&p, 2);
+  }
+  chip8->sp = *p++;
+  chip8->delay_timer = *p++;
+  chip8->sound_timer = *p++;
+  for (int i = 0; i < CHIP8_NUM_KEYS; i++) {
+    chip8->keypad[i] = *p++ != 0;
+  }
+  chip8->rng_state = get_le(&p, 4);
+  chip8->quirks = *p++;
+  memcpy(chip8->flags, p, CHIP8_NUM_FLAGS);
+  p += CHIP8_NUM_FLAGS;
+  memcpy(chip8->pattern, p, CHIP8_PATTERN_SIZE);
+  p += CHIP8_PATTERN_SIZE;
+  chip8->pitch = *p++;
+  chip8->hires = *p++ != 0;
+  chip8->planes = *p++;
+  for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+    for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+      for (int word = 0; word < CHIP8_ROW_WORDS; word++) {
+        chip8->display[plane][y][word] = get_le(&p, 8);
+      }
+    }
+  }
+
+  chip8_invalidate(chip8, 0, CHIP8_MEMORY_SIZE);
+  chip8->dirty_rows = ALL_ROWS;
+
+  return true;
 }
 
 void chip8_decrement_timers(chip8_t *chip8) {
@@ -494,4 +1456,7 @@ void chip8_decrement_timers(chip8_t *chip8) {
   if (chip8->sound_timer > 0) {
     chip8->sound_timer--;
   }
+  if (chip8->capture) {
+    chip8_capture_frame(chip8->capture, chip8);
+  }
 }
@@ -2,21 +2,99 @@
 #define CHIP8_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define CHIP8_MEMORY_SIZE 4096
+#define CHIP8_MEMORY_SIZE 65536 // XO-CHIP, the original machine had 4K
+#define CHIP8_DECODE_SIZE 4096  // Addresses covered by the decode cache
 #define CHIP8_SCREEN_WIDTH 64
 #define CHIP8_SCREEN_HEIGHT 32
+#define CHIP8_HIRES_WIDTH 128 // SUPER-CHIP high resolution mode
+#define CHIP8_HIRES_HEIGHT 64
+#define CHIP8_ROW_WORDS (CHIP8_HIRES_WIDTH / 64)
+#define CHIP8_NUM_PLANES 2 // XO-CHIP bitplanes
 #define CHIP8_STACK_SIZE 12
 #define CHIP8_NUM_KEYS 16
+#define CHIP8_NUM_FLAGS 16 // SUPER-CHIP user flags, 8 on the HP48
+#define CHIP8_PATTERN_SIZE 16 // XO-CHIP audio pattern, 128 1-bit samples
+#define CHIP8_MAX_ROM_SIZE (CHIP8_MEMORY_SIZE - 0x200) // Loaded at 0x200
+
+// Handler slots for pre-decoded instructions, 0 marks an empty cache entry
+enum {
+  CHIP8_OP_NONE = 0,
+  CHIP8_OP_0NNN,
+  CHIP8_OP_00E0,
+  CHIP8_OP_00EE,
+  CHIP8_OP_1NNN,
+  CHIP8_OP_2NNN,
+  CHIP8_OP_3XNN,
+  CHIP8_OP_4XNN,
+  CHIP8_OP_5XY0,
+  CHIP8_OP_6XNN,
+  CHIP8_OP_7XNN,
+  CHIP8_OP_8XY0,
+  CHIP8_OP_8XY1,
+  CHIP8_OP_8XY2,
+  CHIP8_OP_8XY3,
+  CHIP8_OP_8XY4,
+  CHIP8_OP_8XY5,
+  CHIP8_OP_8XY6,
+  CHIP8_OP_8XY7,
+  CHIP8_OP_8XYE,
+  CHIP8_OP_9XY0,
+  CHIP8_OP_ANNN,
+  CHIP8_OP_BNNN,
+  CHIP8_OP_CXNN,
+  CHIP8_OP_DXYN,
+  CHIP8_OP_EX9E,
+  CHIP8_OP_EXA1,
+  CHIP8_OP_FX07,
+  CHIP8_OP_FX0A,
+  CHIP8_OP_FX15,
+  CHIP8_OP_FX18,
+  CHIP8_OP_FX1E,
+  CHIP8_OP_FX29,
+  CHIP8_OP_FX33,
+  CHIP8_OP_FX55,
+  CHIP8_OP_FX65,
+  // SUPER-CHIP
+  CHIP8_OP_00CN,
+  CHIP8_OP_00FB,
+  CHIP8_OP_00FC,
+  CHIP8_OP_00FD,
+  CHIP8_OP_00FE,
+  CHIP8_OP_00FF,
+  CHIP8_OP_FX30,
+  CHIP8_OP_FX75,
+  CHIP8_OP_FX85,
+  // XO-CHIP
+  CHIP8_OP_00DN,
+  CHIP8_OP_5XY2,
+  CHIP8_OP_5XY3,
+  CHIP8_OP_F000,
+  CHIP8_OP_FN01,
+  CHIP8_OP_F002,
+  CHIP8_OP_FX3A,
+  CHIP8_OP_UNKNOWN,
+};
+
+// An opcode with its operands already extracted
+typedef struct {
+  uint16_t opcode;
+  uint16_t NNN;
+  uint8_t op; // CHIP8_OP_* slot
+  uint8_t X;
+  uint8_t Y;
+  uint8_t NN; // N is the low nibble
+} chip8_instr_t;
 
 typedef struct {
   // Memory
-  uint8_t ram[CHIP8_MEMORY_SIZE]; // 4K bytes of ram
+  uint8_t ram[CHIP8_MEMORY_SIZE]; // 64K bytes of ram
 
   // Registers
   uint8_t V[16]; // 16 8-bit registers V0-VF
-  uint16_t I;    // 12-bit address register
+  uint16_t I;    // Address register, 12 bits before XO-CHIP
   uint16_t PC;   // Program counter
 
   // Stack
@@ -30,16 +108,151 @@ typedef struct {
   // Input
   bool keypad[CHIP8_NUM_KEYS]; // 16 keys 0-F
 
+  // Random number state for CXNN, per instance so runs are reproducible
+  uint32_t rng_state;
+
+  // CHIP8_QUIRKS_* profile, how ambiguous opcodes behave
+  uint8_t quirks;
+
+  uint8_t flags[CHIP8_NUM_FLAGS]; // Saved and loaded by FX75/FX85
+
+  // XO-CHIP audio, played while the sound timer runs
+  uint8_t pattern[CHIP8_PATTERN_SIZE];
+  uint8_t pitch; // Playback rate is 4000 * 2^((pitch - 64) / 48) hz
+
   // Graphics
-  bool display[CHIP8_SCREEN_WIDTH * CHIP8_SCREEN_HEIGHT];
+  // One bit per pixel, two words per row. The most significant bit of word 0
+  // is x = 0. Low resolution only uses word 0 of the top 32 rows.
+  bool hires;
+  uint8_t planes; // Bitmask of the planes drawn, cleared and scrolled
+  uint64_t display[CHIP8_NUM_PLANES][CHIP8_HIRES_HEIGHT][CHIP8_ROW_WORDS];
+  uint64_t dirty_rows; // Bit y is set when row y changed since last consumed
+
+  // Everything above is machine state, everything below can be rebuilt
 
+  // Decode cache indexed by address, filled lazily by chip8_cycle. Code
+  // past its end is decoded on every execution.
+  chip8_instr_t decoded[CHIP8_DECODE_SIZE];
+
+  // Counting profiler, NULL unless one is attached, see profile.h
+  struct chip8_profile *profile;
+  // Binary trace log, NULL unless one is attached, see trace.h
+  struct chip8_trace *trace;
+  // Sound change queue, NULL unless one is attached, see audio.h
+  struct chip8_audio *audio;
+  // Frame recorder fed once per timer tick, NULL unless one is attached,
+  // see capture.h
+  struct chip8_capture *capture;
 } chip8_t;
 
+// Quirk profiles, the behaviour of opcodes that CHIP-8 variants disagree on
+enum {
+  CHIP8_QUIRKS_DEFAULT = 0, // This emulator's original behaviour
+  CHIP8_QUIRKS_COSMAC,      // The COSMAC VIP interpreter
+  CHIP8_QUIRKS_SCHIP,       // SUPER-CHIP 1.1
+  CHIP8_QUIRKS_XOCHIP,      // XO-CHIP
+  CHIP8_QUIRKS_COUNT,
+};
+
+// Individual quirks that make up a profile
+#define CHIP8_QUIRK_SHIFT_VY (1 << 0)     // 8XY6/8XYE shift VY into VX
+#define CHIP8_QUIRK_LOAD_STORE_I (1 << 1) // FX55/FX65 advance I past VX
+#define CHIP8_QUIRK_JUMP_VX (1 << 2)      // BXNN jumps to XNN + VX
+#define CHIP8_QUIRK_VF_RESET (1 << 3)     // 8XY1/8XY2/8XY3 clear VF
+#define CHIP8_QUIRK_CLIP (1 << 4)         // Sprites clip instead of wrapping
+#define CHIP8_QUIRK_LORES_DXY0 (1 << 5)   // DXY0 draws 16x16 in 64x32 too
+#define CHIP8_QUIRK_LONG_F000 (1 << 6)    // Skips step over all of F000 NNNN
+
+// Bumped whenever chip8_t or a function signature changes, the shared
+// library's soname carries it
+#define CHIP8_ABI_VERSION 2
+
+// What chip8_run_until stops after, or them together to stop on several
+#define CHIP8_EVENT_DRAW (1 << 0)  // Drew, cleared, scrolled or resized
+#define CHIP8_EVENT_SOUND (1 << 1) // FX18, F002 or FX3A
+#define CHIP8_EVENT_IDLE (1 << 2)  // Ended idle, see chip8_run
+
+// What chip8_run found the machine waiting on when it returned
+typedef enum {
+  CHIP8_BUSY = 0,
+  CHIP8_IDLE_KEY,   // FX0A with no key down
+  CHIP8_IDLE_TIMER, // Loop polling the delay timer until it changes
+  CHIP8_IDLE_HALT,  // Jump to self, nothing but a reset gets it out
+} chip8_idle_t;
+
+// Raw copy of the machine state in host layout, for fast in-process restores
+#define CHIP8_STATE_SIZE offsetof(chip8_t, decoded)
+typedef struct {
+  uint8_t data[CHIP8_STATE_SIZE];
+} chip8_snapshot_t;
+
+// Portable save state: "C8SS", version, then every field little-endian
+#define CHIP8_SAVE_STATE_VERSION 3
+#define CHIP8_SAVE_STATE_SIZE                                                  \
+  (4 + 2 + CHIP8_MEMORY_SIZE + 16 + 2 + 2 + CHIP8_STACK_SIZE * 2 + 1 + 1 + 1 + \
+   CHIP8_NUM_KEYS + 4 + 1 + CHIP8_NUM_FLAGS + CHIP8_PATTERN_SIZE + 1 + 1 + 1 + \
+   CHIP8_NUM_PLANES * CHIP8_HIRES_HEIGHT * CHIP8_ROW_WORDS * 8)
+
+// CHIP8_ABI_VERSION of the library, for checking it against the header
+int chip8_abi_version(void);
+// sizeof(chip8_t), for bindings that allocate the machine themselves. The
+// core never allocates one, any memory of this size and 8 byte alignment
+// works.
+size_t chip8_size(void);
+
 void chip8_init(chip8_t *chip8);
+void chip8_seed(chip8_t *chip8, uint32_t seed);
+// Selects a CHIP8_QUIRKS_* profile, false if it does not exist
+bool chip8_set_quirks(chip8_t *chip8, uint8_t quirks);
+// CHIP8_QUIRK_* bits of a profile
+uint8_t chip8_quirk_flags(uint8_t quirks);
+// Profile names for command lines, "default", "cosmac", "schip", "xochip"
+const char *chip8_quirks_name(uint8_t quirks);
+int chip8_quirks_from_name(const char *name); // -1 when unknown
 bool chip8_load_rom(chip8_t *chip8, const char *filename);
+// Copies size bytes of rom straight from data, e.g. a mapped rom pack
+bool chip8_load_rom_mem(chip8_t *chip8, const uint8_t *data, size_t size);
 void chip8_cycle(chip8_t *chip8);
+// Same result as calling chip8_cycle cycles times, but idle loops are skipped
+// over instead of executed. A value other than CHIP8_BUSY means the machine
+// ended idle, so the host may sleep until the next key or timer tick.
+chip8_idle_t chip8_run(chip8_t *chip8, uint64_t cycles);
+// A 60 Hz frame, chip8_run followed by chip8_decrement_timers
+chip8_idle_t chip8_run_frame(chip8_t *chip8, uint64_t cycles);
+// chip8_run that returns right after the first instruction raising one of
+// the CHIP8_EVENT_* in events, with that event, or 0 once the cycles ran
+// out. Idle loops are skipped and use up the rest of the cycles. ran, when
+// not NULL, gets the cycles used.
+int chip8_run_until(chip8_t *chip8, uint64_t cycles, int events,
+                    uint64_t *ran);
 void chip8_set_key(chip8_t *chip8, uint8_t key, bool pressed);
+// Whole keypad as a bitmask, bit n is key n
+uint16_t chip8_get_keys(const chip8_t *chip8);
+void chip8_set_keys(chip8_t *chip8, uint16_t keys);
+// Clears the selected planes
 void chip8_clear_display(chip8_t *chip8);
+// Switches between 64x32 and 128x64, which clears the whole display
+void chip8_set_hires(chip8_t *chip8, bool hires);
+// Size of the display in the current resolution
+int chip8_screen_width(const chip8_t *chip8);
+int chip8_screen_height(const chip8_t *chip8);
+// True when the pixel is set in any plane
+bool chip8_get_pixel(const chip8_t *chip8, uint8_t x, uint8_t y);
+// Returns the rows changed since the previous call and resets them
+uint64_t chip8_consume_dirty(chip8_t *chip8);
 void chip8_decrement_timers(chip8_t *chip8);
+void chip8_decode(chip8_instr_t *instr, uint16_t opcode);
+// FNV-1a hashes with a fixed byte order so they match across hosts
+uint64_t chip8_display_hash(const chip8_t *chip8);
+uint64_t chip8_ram_hash(const chip8_t *chip8);
+// Must be called after writing to ram outside of chip8_cycle
+void chip8_invalidate(chip8_t *chip8, uint16_t addr, uint32_t len);
+
+void chip8_snapshot(const chip8_t *chip8, chip8_snapshot_t *snapshot);
+void chip8_restore(chip8_t *chip8, const chip8_snapshot_t *snapshot);
+// Returns the number of bytes written, 0 if size is too small
+size_t chip8_save_state(const chip8_t *chip8, uint8_t *buf, size_t size);
+// Leaves chip8 untouched and returns false on a bad or truncated state
+bool chip8_load_state(chip8_t *chip8, const uint8_t *buf, size_t size);
 
 #endif
@@ -0,0 +1,505 @@
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "capture.h"
+#include "chip8.h"
+#include "jit.h"
+#include "movie.h"
+#include "pool.h"
+#include "profile.h"
+#include "rompack.h"
+#include "shm.h"
+#include "trace.h"
+
+#define DEFAULT_CYCLES_PER_FRAME 10 // 600hz / 60fps like the SDL frontend
+#define DEFAULT_FRAMES 600
+#define SERVE_HZ 60 // Frames per second published to shared memory
+
+static volatile sig_atomic_t interrupted;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-c cycles | -f frames] [-p cycles per frame] [-j] "
+          "[-s seed] [-q quirks] [-n instances] [-t threads | -l] "
+          "[-w movie | -r movie] [-P] [-T trace] [-C capture] [-S name] "
+          "<rom file>\n"
+          "       %s -k pack [options] [rom name or hash]\n",
+          prog, prog);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Looks a rom up by name, then by its 16 hex digit hash
+static bool find_rom(const rom_pack_t *pack, const char *key,
+                     rom_info_t *info) {
+  if (rom_pack_find_name(pack, key, info)) {
+    return true;
+  }
+
+  char *end;
+  uint64_t hash = strtoull(key, &end, 16);
+  return strlen(key) == 16 && *end == '\0' &&
+         rom_pack_find_hash(pack, hash, info);
+}
+
+static int pack_cycles_per_frame(const rom_info_t *info, int fallback) {
+  return info->cpu_hz >= 60 ? (int)(info->cpu_hz / 60) : fallback;
+}
+
+// Runs every rom of the pack in turn, loading each straight from the mapping
+static void run_pack(const rom_pack_t *pack, uint64_t frames,
+                     int cycles_per_frame, bool per_frame_set, int quirks,
+                     uint32_t seed) {
+  static chip8_t chip8;
+  uint64_t executed = 0;
+  uint64_t start = now_ns();
+
+  for (uint32_t i = 0; i < pack->count; i++) {
+    rom_info_t info;
+    rom_pack_get(pack, i, &info);
+    int budget = per_frame_set ? cycles_per_frame
+                               : pack_cycles_per_frame(&info, cycles_per_frame);
+
+    chip8_init(&chip8);
+    chip8_seed(&chip8, seed);
+    chip8_load_rom_mem(&chip8, info.data, info.size);
+    if (!chip8_set_quirks(&chip8, quirks >= 0 ? quirks : info.quirks)) {
+      continue;
+    }
+    for (uint64_t frame = 0; frame < frames; frame++) {
+      chip8_run(&chip8, budget);
+      chip8_decrement_timers(&chip8);
+    }
+    executed += frames * budget;
+
+    printf("%016llx %016llx %s\n", (unsigned long long)info.hash,
+           (unsigned long long)chip8_display_hash(&chip8), info.name);
+  }
+
+  double seconds = (now_ns() - start) / 1e9;
+  printf("roms: %u elapsed: %.6f s, %.0f emulated cycles/sec\n", pack->count,
+         seconds, seconds > 0 ? executed / seconds : 0.0);
+}
+
+// Runs the instances on this thread, CHIP8_BATCH_LANES at a time in lockstep.
+// The last batch is filled up with extra instances.
+static bool run_batches(const chip8_t *prototype, size_t instances,
+                        uint64_t frames, int cycles_per_frame, uint32_t seed,
+                        const char *rom) {
+  static chip8_batch_t batch;
+  size_t batches = (instances + CHIP8_BATCH_LANES - 1) / CHIP8_BATCH_LANES;
+  uint64_t display_hash = 0;
+  uint64_t steps = 0;
+  uint64_t lane_cycles = 0;
+  uint64_t start = now_ns();
+
+  for (size_t i = 0; i < batches; i++) {
+    if (!chip8_batch_init(&batch, prototype, seed + i * CHIP8_BATCH_LANES)) {
+      return false;
+    }
+    for (uint64_t frame = 0; frame < frames; frame++) {
+      chip8_batch_run(&batch, cycles_per_frame);
+      chip8_batch_decrement_timers(&batch);
+    }
+    if (i == 0) {
+      display_hash = chip8_display_hash(chip8_batch_machine(&batch, 0));
+    }
+    steps += batch.steps;
+    lane_cycles += batch.lane_cycles;
+    chip8_batch_free(&batch);
+  }
+
+  double seconds = (now_ns() - start) / 1e9;
+  uint64_t executed = batches * CHIP8_BATCH_LANES * frames * cycles_per_frame;
+  printf("rom: %s\n", rom);
+  printf("instances: %zu batches: %zu frames: %llu\n",
+         batches * CHIP8_BATCH_LANES, batches, (unsigned long long)frames);
+  printf("instance 0 display hash: %016llx\n",
+         (unsigned long long)display_hash);
+  printf("lanes per step: %.2f\n", steps ? (double)lane_cycles / steps : 0.0);
+  printf("elapsed: %.6f s, %.0f instructions/sec\n", seconds,
+         seconds > 0 ? executed / seconds : 0.0);
+  return true;
+}
+
+static void on_signal(int sig) {
+  (void)sig;
+  interrupted = 1;
+}
+
+// Runs in real time and publishes every frame to shared memory /name, for
+// viewers and agents in other processes. The keypad is whatever the
+// attached clients hold down. Runs until a client asks it to stop, or for
+// frames frames when that is not 0.
+static bool serve(chip8_t *chip8, const char *name, const char *rom,
+                  uint64_t frames, int cycles_per_frame) {
+  chip8_shm_t shm;
+  if (!chip8_shm_host_open(&shm, name, rom, cycles_per_frame * SERVE_HZ)) {
+    return false;
+  }
+
+  // Ctrl-C still removes the block
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  struct timespec due;
+  clock_gettime(CLOCK_MONOTONIC, &due);
+  uint64_t frame = 0;
+
+  while (!interrupted && !chip8_shm_stop_requested(&shm) &&
+         (!frames || frame < frames)) {
+    chip8_set_keys(chip8, chip8_shm_keys(&shm));
+    chip8_run_frame(chip8, cycles_per_frame);
+    chip8_shm_publish(&shm, chip8);
+    frame++;
+
+    // Absolute deadlines so the rate does not drift with the work done
+    due.tv_nsec += 1000000000 / SERVE_HZ;
+    if (due.tv_nsec >= 1000000000) {
+      due.tv_nsec -= 1000000000;
+      due.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+  }
+
+  chip8_shm_host_close(&shm);
+  printf("rom: %s\n", rom);
+  printf("frames: %llu\n", (unsigned long long)frame);
+  printf("display hash: %016llx\n",
+         (unsigned long long)chip8_display_hash(chip8));
+  return true;
+}
+
+static void dump_registers(const chip8_t *chip8) {
+  for (int i = 0; i < 16; i++) {
+    printf("V%X=%02x%c", i, chip8->V[i], (i % 8 == 7) ? '\n' : ' ');
+  }
+  printf("I=%03x PC=%03x SP=%u DT=%u ST=%u\n", chip8->I, chip8->PC, chip8->sp,
+         chip8->delay_timer, chip8->sound_timer);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t cycles = 0;
+  uint64_t frames = 0;
+  int cycles_per_frame = DEFAULT_CYCLES_PER_FRAME;
+  bool use_jit = false;
+  bool seeded = false;
+  uint32_t seed = 0;
+  size_t instances = 1;
+  int threads = 0;
+  bool lockstep = false;
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  bool profiling = false;
+  const char *trace_path = NULL;
+  const char *capture_path = NULL;
+  const char *pack_path = NULL;
+  const char *serve_name = NULL;
+  bool per_frame_set = false;
+  int quirks = -1; // From the pack, or the default profile
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:f:p:js:q:n:t:lw:r:PT:C:k:S:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cycles = strtoull(optarg, NULL, 0);
+      break;
+    case 'f':
+      frames = strtoull(optarg, NULL, 0);
+      break;
+    case 'p':
+      cycles_per_frame = atoi(optarg);
+      per_frame_set = true;
+      break;
+    case 'j':
+      use_jit = true;
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      seeded = true;
+      break;
+    case 'q':
+      quirks = chip8_quirks_from_name(optarg);
+      if (quirks < 0) {
+        fprintf(stderr, "Unknown quirks %s, use default, cosmac, schip or "
+                        "xochip\n",
+                optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'n':
+      instances = strtoull(optarg, NULL, 0);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'l':
+      lockstep = true;
+      break;
+    case 'w':
+      record_path = optarg;
+      break;
+    case 'r':
+      replay_path = optarg;
+      break;
+    case 'P':
+      profiling = true;
+      break;
+    case 'T':
+      trace_path = optarg;
+      break;
+    case 'C':
+      capture_path = optarg;
+      break;
+    case 'k':
+      pack_path = optarg;
+      break;
+    case 'S':
+      serve_name = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Movies are made of whole frames. A pack without a rom name runs every
+  // rom in it for the same number of frames.
+  bool in_movie = record_path || replay_path;
+  bool whole_pack = pack_path && optind >= argc;
+  if ((optind >= argc && !pack_path) || (cycles && frames) ||
+      cycles_per_frame <= 0 || instances == 0 ||
+      (record_path && replay_path) ||
+      (in_movie && (cycles || instances > 1)) ||
+      ((profiling || trace_path || capture_path) && instances > 1) ||
+      (lockstep && (in_movie || profiling || trace_path || capture_path ||
+                    use_jit || threads)) ||
+      (serve_name && (cycles || in_movie || instances > 1 || lockstep ||
+                      use_jit || profiling || trace_path || whole_pack)) ||
+      (whole_pack && (cycles || in_movie || instances > 1 || lockstep ||
+                      profiling || trace_path || capture_path || use_jit))) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  rom_pack_t pack;
+  rom_info_t info;
+  if (pack_path) {
+    if (!rom_pack_open(&pack, pack_path)) {
+      exit(EXIT_FAILURE);
+    }
+
+    if (whole_pack) {
+      run_pack(&pack, frames ? frames : DEFAULT_FRAMES, cycles_per_frame,
+               per_frame_set, quirks, seed);
+      rom_pack_close(&pack);
+      exit(EXIT_SUCCESS);
+    }
+
+    if (!find_rom(&pack, argv[optind], &info)) {
+      fprintf(stderr, "%s is not in %s\n", argv[optind], pack_path);
+      exit(EXIT_FAILURE);
+    }
+    if (!per_frame_set) {
+      cycles_per_frame = pack_cycles_per_frame(&info, cycles_per_frame);
+    }
+    if (quirks < 0) {
+      quirks = info.quirks;
+    }
+  }
+
+  // Served until stopped unless a frame count was given
+  uint64_t serve_frames = frames;
+
+  // A cycle budget is run as whole frames so the timers still tick
+  if (cycles) {
+    frames = (cycles + cycles_per_frame - 1) / cycles_per_frame;
+  } else if (!frames) {
+    frames = DEFAULT_FRAMES;
+  }
+
+  chip8_t chip8 = {0};
+  chip8_init(&chip8);
+  if (pack_path ? !chip8_load_rom_mem(&chip8, info.data, info.size)
+                : !chip8_load_rom(&chip8, argv[optind])) {
+    exit(EXIT_FAILURE);
+  }
+  if (pack_path) {
+    rom_pack_close(&pack);
+  }
+  if (seeded) {
+    chip8_seed(&chip8, seed);
+  }
+  if (quirks >= 0 && !chip8_set_quirks(&chip8, quirks)) {
+    exit(EXIT_FAILURE);
+  }
+
+  movie_t movie;
+  if (record_path && !movie_record_open(&movie, record_path, &chip8, seed,
+                                        cycles_per_frame)) {
+    exit(EXIT_FAILURE);
+  }
+  if (replay_path) {
+    if (!movie_replay_open(&movie, replay_path, &chip8)) {
+      exit(EXIT_FAILURE);
+    }
+    frames = movie.total_frames;
+    cycles_per_frame = movie.cycles_per_frame;
+  }
+
+  // Every frame, also those served or replayed
+  static chip8_capture_t capture;
+  if (capture_path) {
+    if (!chip8_capture_open(&capture, capture_path, SERVE_HZ)) {
+      exit(EXIT_FAILURE);
+    }
+    chip8.capture = &capture;
+  }
+
+  if (serve_name) {
+    bool ok = serve(&chip8, serve_name, argv[optind], serve_frames,
+                    cycles_per_frame);
+    if (capture_path) {
+      chip8.capture = NULL;
+      ok &= chip8_capture_close(&capture);
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  // Many copies of the rom on one core, sharing fetch and decode
+  if (lockstep) {
+    exit(run_batches(&chip8, instances, frames, cycles_per_frame, seed,
+                     argv[optind])
+             ? EXIT_SUCCESS
+             : EXIT_FAILURE);
+  }
+
+  // Many copies of the rom across all cores, each with its own seed
+  if (instances > 1) {
+    chip8_pool_t pool;
+    if (!chip8_pool_init(&pool, instances, threads, &chip8, seed)) {
+      exit(EXIT_FAILURE);
+    }
+
+    chip8_pool_stats_t stats;
+    if (!chip8_pool_run(&pool, frames, cycles_per_frame, &stats)) {
+      chip8_pool_free(&pool);
+      exit(EXIT_FAILURE);
+    }
+
+    printf("rom: %s\n", argv[optind]);
+    printf("instances: %zu threads: %d frames: %llu\n", pool.count,
+           pool.threads, (unsigned long long)frames);
+    printf("instance 0 display hash: %016llx\n",
+           (unsigned long long)chip8_display_hash(&pool.machines[0]));
+    printf("elapsed: %.6f s, %.0f emulated cycles/sec, %llu steals\n",
+           stats.elapsed_ns / 1e9, stats.instructions_per_sec,
+           (unsigned long long)stats.steals);
+
+    chip8_pool_free(&pool);
+    exit(EXIT_SUCCESS);
+  }
+
+  static chip8_profile_t profile;
+  if (profiling) {
+    chip8_profile_reset(&profile);
+    chip8.profile = &profile;
+  }
+
+  static chip8_trace_t trace;
+  if (trace_path) {
+    if (!chip8_trace_open(&trace, trace_path)) {
+      exit(EXIT_FAILURE);
+    }
+    chip8.trace = &trace;
+  }
+
+  // Static since the block table is too large for the stack
+  static chip8_jit_t jit;
+  if (use_jit && !chip8_jit_init(&jit)) {
+    fprintf(stderr, "JIT unavailable, interpreting\n");
+  }
+
+  // Cycles skipped in idle loops count as executed, the rate is of emulated
+  // cycles rather than of instructions the interpreter ran
+  uint64_t executed = 0;
+  uint64_t idle_frames = 0;
+  uint64_t start = now_ns();
+
+  for (uint64_t frame = 0; frame < frames; frame++) {
+    int budget = cycles_per_frame;
+    if (cycles && cycles - executed < (uint64_t)budget) {
+      budget = cycles - executed;
+    }
+
+    if (replay_path) {
+      uint16_t keys;
+      if (!movie_replay_frame(&movie, &keys)) {
+        break;
+      }
+      chip8_set_keys(&chip8, keys);
+    } else if (record_path) {
+      movie_record_frame(&movie, chip8_get_keys(&chip8));
+    }
+
+    if (use_jit) {
+      chip8_jit_run(&jit, &chip8, budget);
+    } else if (chip8_run(&chip8, budget) != CHIP8_BUSY) {
+      idle_frames++;
+    }
+    executed += budget;
+
+    chip8_decrement_timers(&chip8);
+  }
+
+  uint64_t elapsed = now_ns() - start;
+  double seconds = elapsed / 1e9;
+
+  printf("rom: %s\n", argv[optind]);
+  printf("frames: %llu cycles: %llu\n", (unsigned long long)frames,
+         (unsigned long long)executed);
+  printf("display hash: %016llx\n",
+         (unsigned long long)chip8_display_hash(&chip8));
+  if (!use_jit) {
+    printf("idle frames: %llu\n", (unsigned long long)idle_frames);
+  }
+  dump_registers(&chip8);
+  printf("elapsed: %.6f s, %.0f emulated cycles/sec\n", seconds,
+         seconds > 0 ? executed / seconds : 0.0);
+
+  if (profiling) {
+    chip8_profile_dump(&profile, &chip8, stdout);
+  }
+
+  chip8_jit_free(&jit);
+
+  bool ok = true;
+  if (trace_path) {
+    chip8.trace = NULL;
+    ok = chip8_trace_close(&trace);
+  }
+  if (capture_path) {
+    chip8.capture = NULL;
+    ok &= chip8_capture_close(&capture);
+  }
+  if (record_path) {
+    ok &= movie_record_close(&movie, &chip8);
+  }
+  if (replay_path) {
+    ok &= movie_replay_verify(&movie, &chip8);
+    movie_replay_close(&movie);
+  }
+
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,715 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+// Worst case host code for one instruction is FX65 with X = F
+#define MAX_INSTR_CODE 384
+// Saving, loading and spilling the allocated registers around a block
+#define MAX_FRAME_CODE 256
+
+typedef struct {
+  uint8_t bytes[CHIP8_JIT_MAX_BLOCK * MAX_INSTR_CODE + MAX_FRAME_CODE];
+  size_t len;
+} code_buf_t;
+
+#if defined(__x86_64__)
+
+/* x86-64 encoding helpers, chip8_t * is always in rdi */
+#define REG_AL 0
+#define REG_CL 1
+
+#define OFF_V(x) ((int32_t)(offsetof(chip8_t, V) + (x)))
+#define OFF_I ((int32_t)offsetof(chip8_t, I))
+#define OFF_PC ((int32_t)offsetof(chip8_t, PC))
+#define OFF_DT ((int32_t)offsetof(chip8_t, delay_timer))
+#define OFF_ST ((int32_t)offsetof(chip8_t, sound_timer))
+#define OFF_RAM ((int32_t)offsetof(chip8_t, ram))
+#define OFF_STACK ((int32_t)offsetof(chip8_t, stack))
+#define OFF_SP ((int32_t)offsetof(chip8_t, sp))
+#define OFF_KEYPAD ((int32_t)offsetof(chip8_t, keypad))
+
+// Flags above the opcode byte
+#define OP_16 0x100 // 16-bit operands
+#define OP_0F 0x200 // Two byte opcode
+
+// Register numbering of the allocator, I comes after V0-VF
+#define REG_I 16
+#define NUM_REGS 17
+
+// Host registers V and I are kept in, most used first. Blocks call nothing,
+// so rdx, rsi and r8-r11 are free, the callee saved ones are pushed first.
+static const uint8_t host_regs[] = {2, 6, 8, 9, 10, 11, 3, 5, 12, 13, 14, 15};
+#define NUM_CALLER_SAVED 6
+
+// Where each register lives while a block runs
+typedef struct {
+  int8_t host[NUM_REGS]; // Host register, -1 for its field in chip8_t
+  uint8_t num_host;      // host_regs in use
+  // Filled in while emitting, to pick the registers worth allocating
+  uint16_t uses[NUM_REGS];
+  uint32_t live_in; // Bit per register read before the block writes it
+  uint32_t written;
+} alloc_t;
+
+// An operand, a host register or a field of chip8_t
+typedef struct {
+  int8_t reg; // -1 for [rdi + disp]
+  int32_t disp;
+} loc_t;
+
+static loc_t mem(int32_t disp) { return (loc_t){.reg = -1, .disp = disp}; }
+
+static loc_t reg_loc(alloc_t *alloc, int reg, bool read, bool write) {
+  alloc->uses[reg]++;
+  if (read && !(alloc->written & (1u << reg))) {
+    alloc->live_in |= 1u << reg;
+  }
+  if (write) {
+    alloc->written |= 1u << reg;
+  }
+  if (alloc->host[reg] >= 0) {
+    return (loc_t){.reg = alloc->host[reg]};
+  }
+  return mem(reg == REG_I ? OFF_I : OFF_V(reg));
+}
+
+// Operand VX or I that the instruction reads, overwrites or modifies
+static loc_t v_src(alloc_t *alloc, uint8_t x) {
+  return reg_loc(alloc, x, true, false);
+}
+
+static loc_t v_dst(alloc_t *alloc, uint8_t x) {
+  return reg_loc(alloc, x, false, true);
+}
+
+static loc_t v_mod(alloc_t *alloc, uint8_t x) {
+  return reg_loc(alloc, x, true, true);
+}
+
+static loc_t i_src(alloc_t *alloc) {
+  return reg_loc(alloc, REG_I, true, false);
+}
+
+static loc_t i_dst(alloc_t *alloc) {
+  return reg_loc(alloc, REG_I, false, true);
+}
+
+static loc_t i_mod(alloc_t *alloc) { return reg_loc(alloc, REG_I, true, true); }
+
+static void emit(code_buf_t *buf, uint8_t byte) {
+  buf->bytes[buf->len++] = byte;
+}
+
+static void emit16(code_buf_t *buf, uint16_t value) {
+  emit(buf, value & 0xFF);
+  emit(buf, value >> 8);
+}
+
+static void emit32(code_buf_t *buf, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit(buf, ((uint32_t)value >> (i * 8)) & 0xFF);
+  }
+}
+
+// [66] [REX] [0F] <opcode> with reg, a host register or an opcode extension
+// when is_reg is false, and loc as the r/m operand
+static void emit_modrm(code_buf_t *buf, uint16_t opcode, uint8_t reg,
+                       bool is_reg, loc_t loc) {
+  if (opcode & OP_16) {
+    emit(buf, 0x66);
+  }
+
+  // Without a REX prefix byte registers 4-7 are ah, ch, dh and bh
+  uint8_t rex = 0;
+  if (is_reg && reg >= 4) {
+    rex |= 0x40 | (reg >= 8 ? 0x04 : 0);
+  }
+  if (loc.reg >= 4) {
+    rex |= 0x40 | (loc.reg >= 8 ? 0x01 : 0);
+  }
+  if (rex) {
+    emit(buf, rex);
+  }
+
+  if (opcode & OP_0F) {
+    emit(buf, 0x0F);
+  }
+  emit(buf, opcode & 0xFF);
+  if (loc.reg >= 0) {
+    emit(buf, 0xC0 | ((reg & 7) << 3) | (loc.reg & 7));
+  } else {
+    emit(buf, 0x80 | ((reg & 7) << 3) | 7);
+    emit32(buf, loc.disp);
+  }
+}
+
+// <opcode> reg, loc
+static void emit_rm(code_buf_t *buf, uint16_t opcode, uint8_t reg, loc_t loc) {
+  emit_modrm(buf, opcode, reg, true, loc);
+}
+
+// <opcode> /digit loc
+static void emit_ext(code_buf_t *buf, uint16_t opcode, uint8_t digit,
+                     loc_t loc) {
+  emit_modrm(buf, opcode, digit, false, loc);
+}
+
+static void emit_load_al(code_buf_t *buf, loc_t src) {
+  emit_rm(buf, 0x8A, REG_AL, src); // mov al, src
+}
+
+static void emit_store_al(code_buf_t *buf, loc_t dst) {
+  emit_rm(buf, 0x88, REG_AL, dst); // mov dst, al
+}
+
+static void emit_store_cl(code_buf_t *buf, loc_t dst) {
+  emit_rm(buf, 0x88, REG_CL, dst); // mov dst, cl
+}
+
+static void emit_store_imm16(code_buf_t *buf, loc_t dst, uint16_t value) {
+  emit_ext(buf, OP_16 | 0xC7, 0, dst); // mov word dst, imm16
+  emit16(buf, value);
+}
+
+static void emit_setcc_cl(code_buf_t *buf, uint8_t cc) {
+  emit(buf, 0x0F);
+  emit(buf, cc);
+  emit(buf, 0xC1);
+}
+
+#define SETC 0x92
+#define SETAE 0x93
+#define JE 0x74
+#define JNE 0x75
+
+// Ends a block on a skip, flags have to be set by the caller. PC is set to
+// the next instruction and jcc jumps over the store that skips it to
+// skip_to.
+static void emit_skip(code_buf_t *buf, uint8_t jcc, uint16_t next,
+                      uint16_t skip_to) {
+  emit_store_imm16(buf, mem(OFF_PC), next);
+  emit(buf, jcc);
+  emit(buf, 9); // Size of the store below
+  emit_store_imm16(buf, mem(OFF_PC), skip_to);
+}
+
+// Loads the key for VX into flags, ZF is set when it is not pressed
+static void emit_test_key(code_buf_t *buf, loc_t vx) {
+  emit_rm(buf, OP_0F | 0xB6, REG_AL, vx); // movzx eax, byte vx
+  emit(buf, 0x80); // cmp byte [rdi + rax + keypad], 0
+  emit(buf, 0xBC);
+  emit(buf, 0x07);
+  emit32(buf, OFF_KEYPAD);
+  emit(buf, 0x00);
+}
+
+typedef enum { EMIT_FAIL, EMIT_NEXT, EMIT_END } emit_result_t;
+
+static void emit_clear_vf(code_buf_t *buf, alloc_t *alloc) {
+  emit_ext(buf, 0xC6, 0, v_dst(alloc, 0xF)); // mov byte VF, 0
+  emit(buf, 0);
+}
+
+// Emits one instruction at addr with the CHIP8_QUIRK_* bits in quirks,
+// skips continue at skip_to. Control flow ends the block with PC already set,
+// anything that can not be emitted is left to the interpreter. The order of
+// reads and writes mirrors chip8_cycle so VF aliasing with X or Y gives the
+// same result.
+static emit_result_t emit_instr(code_buf_t *buf, alloc_t *alloc,
+                                const chip8_instr_t *instr, uint16_t addr,
+                                uint16_t skip_to, uint8_t quirks) {
+  const uint8_t X = instr->X;
+  const uint8_t Y = instr->Y;
+  const uint8_t NN = instr->NN;
+  const uint16_t next = addr + 2;
+
+  switch (instr->op) {
+  case CHIP8_OP_0NNN:
+    break;
+  case CHIP8_OP_00EE:
+    emit_ext(buf, 0xFE, 1, mem(OFF_SP));             // dec byte [sp]
+    emit_rm(buf, OP_0F | 0xB6, REG_AL, mem(OFF_SP)); // movzx eax, byte [sp]
+    emit(buf, 0x0F); // movzx ecx, word [rdi+rax*2+stack]
+    emit(buf, 0xB7);
+    emit(buf, 0x8C);
+    emit(buf, 0x47);
+    emit32(buf, OFF_STACK);
+    emit_rm(buf, OP_16 | 0x89, REG_CL, mem(OFF_PC)); // mov [PC], cx
+    return EMIT_END;
+  case CHIP8_OP_1NNN:
+    emit_store_imm16(buf, mem(OFF_PC), instr->NNN);
+    return EMIT_END;
+  case CHIP8_OP_2NNN:
+    emit_rm(buf, OP_0F | 0xB6, REG_AL, mem(OFF_SP)); // movzx eax, byte [sp]
+    emit(buf, 0x66); // mov word [rdi+rax*2+stack], next
+    emit(buf, 0xC7);
+    emit(buf, 0x84);
+    emit(buf, 0x47);
+    emit32(buf, OFF_STACK);
+    emit16(buf, next);
+    emit_ext(buf, 0xFE, 0, mem(OFF_SP)); // inc byte [sp]
+    emit_store_imm16(buf, mem(OFF_PC), instr->NNN);
+    return EMIT_END;
+  case CHIP8_OP_3XNN:
+    emit_ext(buf, 0x80, 7, v_src(alloc, X)); // cmp byte Vx, NN
+    emit(buf, NN);
+    emit_skip(buf, JNE, next, skip_to);
+    return EMIT_END;
+  case CHIP8_OP_4XNN:
+    emit_ext(buf, 0x80, 7, v_src(alloc, X)); // cmp byte Vx, NN
+    emit(buf, NN);
+    emit_skip(buf, JE, next, skip_to);
+    return EMIT_END;
+  case CHIP8_OP_5XY0:
+    emit_load_al(buf, v_src(alloc, X));
+    emit_rm(buf, 0x3A, REG_AL, v_src(alloc, Y)); // cmp al, Vy
+    emit_skip(buf, JNE, next, skip_to);
+    return EMIT_END;
+  case CHIP8_OP_9XY0:
+    emit_load_al(buf, v_src(alloc, X));
+    emit_rm(buf, 0x3A, REG_AL, v_src(alloc, Y)); // cmp al, Vy
+    emit_skip(buf, JE, next, skip_to);
+    return EMIT_END;
+  case CHIP8_OP_EX9E:
+    emit_test_key(buf, v_src(alloc, X));
+    emit_skip(buf, JE, next, skip_to);
+    return EMIT_END;
+  case CHIP8_OP_EXA1:
+    emit_test_key(buf, v_src(alloc, X));
+    emit_skip(buf, JNE, next, skip_to);
+    return EMIT_END;
+  case CHIP8_OP_6XNN:
+    emit_ext(buf, 0xC6, 0, v_dst(alloc, X)); // mov byte Vx, NN
+    emit(buf, NN);
+    break;
+  case CHIP8_OP_7XNN:
+    emit_ext(buf, 0x80, 0, v_mod(alloc, X)); // add byte Vx, NN
+    emit(buf, NN);
+    break;
+  case CHIP8_OP_8XY0:
+    emit_load_al(buf, v_src(alloc, Y));
+    emit_store_al(buf, v_dst(alloc, X));
+    break;
+  case CHIP8_OP_8XY1:
+    emit_load_al(buf, v_src(alloc, Y));
+    emit_rm(buf, 0x08, REG_AL, v_mod(alloc, X)); // or Vx, al
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      emit_clear_vf(buf, alloc);
+    }
+    break;
+  case CHIP8_OP_8XY2:
+    emit_load_al(buf, v_src(alloc, Y));
+    emit_rm(buf, 0x20, REG_AL, v_mod(alloc, X)); // and Vx, al
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      emit_clear_vf(buf, alloc);
+    }
+    break;
+  case CHIP8_OP_8XY3:
+    emit_load_al(buf, v_src(alloc, Y));
+    emit_rm(buf, 0x30, REG_AL, v_mod(alloc, X)); // xor Vx, al
+    if (quirks & CHIP8_QUIRK_VF_RESET) {
+      emit_clear_vf(buf, alloc);
+    }
+    break;
+  case CHIP8_OP_8XY4:
+    emit_load_al(buf, v_src(alloc, X));
+    emit_rm(buf, 0x02, REG_AL, v_src(alloc, Y)); // add al, Vy
+    emit_setcc_cl(buf, SETC);
+    emit_store_cl(buf, v_dst(alloc, 0xF));
+    emit_store_al(buf, v_dst(alloc, X));
+    break;
+  case CHIP8_OP_8XY5:
+    emit_load_al(buf, v_src(alloc, X));
+    emit_rm(buf, 0x3A, REG_AL, v_src(alloc, Y)); // cmp al, Vy
+    emit_setcc_cl(buf, SETAE);
+    emit_store_cl(buf, v_dst(alloc, 0xF));
+    emit_load_al(buf, v_src(alloc, X));
+    emit_rm(buf, 0x2A, REG_AL, v_src(alloc, Y)); // sub al, Vy
+    emit_store_al(buf, v_dst(alloc, X));
+    break;
+  case CHIP8_OP_8XY6:
+    if (quirks & CHIP8_QUIRK_SHIFT_VY) {
+      emit_load_al(buf, v_src(alloc, Y));
+      emit(buf, 0x88); // mov cl, al
+      emit(buf, 0xC1);
+      emit(buf, 0xD0); // shr al, 1
+      emit(buf, 0xE8);
+      emit_store_al(buf, v_dst(alloc, X));
+      emit(buf, 0x80); // and cl, 1
+      emit(buf, 0xE1);
+      emit(buf, 0x01);
+      emit_store_cl(buf, v_dst(alloc, 0xF));
+      break;
+    }
+    emit_load_al(buf, v_src(alloc, X));
+    emit(buf, 0x24); // and al, 1
+    emit(buf, 0x01);
+    emit_store_al(buf, v_dst(alloc, 0xF));
+    emit_ext(buf, 0xD0, 5, v_mod(alloc, X)); // shr byte Vx, 1
+    break;
+  case CHIP8_OP_8XY7:
+    emit_load_al(buf, v_src(alloc, Y));
+    emit_rm(buf, 0x3A, REG_AL, v_src(alloc, X)); // cmp al, Vx
+    emit_setcc_cl(buf, SETAE);
+    emit_store_cl(buf, v_dst(alloc, 0xF));
+    emit_load_al(buf, v_src(alloc, Y));
+    emit_rm(buf, 0x2A, REG_AL, v_src(alloc, X)); // sub al, Vx
+    emit_store_al(buf, v_dst(alloc, X));
+    break;
+  case CHIP8_OP_8XYE:
+    if (quirks & CHIP8_QUIRK_SHIFT_VY) {
+      emit_load_al(buf, v_src(alloc, Y));
+      emit(buf, 0x88); // mov cl, al
+      emit(buf, 0xC1);
+      emit(buf, 0xD0); // shl al, 1
+      emit(buf, 0xE0);
+      emit_store_al(buf, v_dst(alloc, X));
+      emit(buf, 0xC0); // shr cl, 7
+      emit(buf, 0xE9);
+      emit(buf, 0x07);
+      emit_store_cl(buf, v_dst(alloc, 0xF));
+      break;
+    }
+    emit_load_al(buf, v_src(alloc, X));
+    emit(buf, 0xC0); // shr al, 7
+    emit(buf, 0xE8);
+    emit(buf, 0x07);
+    emit_store_al(buf, v_dst(alloc, 0xF));
+    emit_ext(buf, 0xD0, 4, v_mod(alloc, X)); // shl byte Vx, 1
+    break;
+  case CHIP8_OP_ANNN:
+    emit_store_imm16(buf, i_dst(alloc), instr->NNN);
+    break;
+  case CHIP8_OP_FX07:
+    emit_load_al(buf, mem(OFF_DT));
+    emit_store_al(buf, v_dst(alloc, X));
+    break;
+  case CHIP8_OP_FX15:
+    emit_load_al(buf, v_src(alloc, X));
+    emit_store_al(buf, mem(OFF_DT));
+    break;
+  case CHIP8_OP_FX18:
+    emit_load_al(buf, v_src(alloc, X));
+    emit_store_al(buf, mem(OFF_ST));
+    break;
+  case CHIP8_OP_FX1E:
+    emit_rm(buf, OP_0F | 0xB6, REG_AL, v_src(alloc, X)); // movzx eax, byte Vx
+    emit_rm(buf, OP_16 | 0x01, REG_AL, i_mod(alloc));    // add I, ax
+    break;
+  case CHIP8_OP_FX29:
+    emit_rm(buf, OP_0F | 0xB6, REG_AL, v_src(alloc, X)); // movzx eax, byte Vx
+    emit(buf, 0x8D); // lea eax, [rax + rax * 4]
+    emit(buf, 0x04);
+    emit(buf, 0x80);
+    emit_rm(buf, OP_16 | 0x89, REG_AL, i_dst(alloc)); // mov I, ax
+    break;
+  case CHIP8_OP_FX65:
+    emit_rm(buf, OP_0F | 0xB7, REG_AL, i_src(alloc)); // movzx eax, word I
+    for (int i = 0; i <= X; i++) {
+      emit(buf, 0x8D); // lea ecx, [rax + i]
+      emit(buf, 0x48);
+      emit(buf, i);
+      emit(buf, 0x0F); // movzx ecx, cx, I + i wraps around at 64K
+      emit(buf, 0xB7);
+      emit(buf, 0xC9);
+      emit(buf, 0x8A); // mov cl, [rdi + rcx + ram]
+      emit(buf, 0x8C);
+      emit(buf, 0x0F);
+      emit32(buf, OFF_RAM);
+      emit_store_cl(buf, v_dst(alloc, i));
+    }
+    if (quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+      emit_ext(buf, OP_16 | 0x83, 0, i_mod(alloc)); // add word I, X + 1
+      emit(buf, X + 1);
+    }
+    break;
+  default:
+    return EMIT_FAIL;
+  }
+
+  return EMIT_NEXT;
+}
+
+// Emits the straight-line run starting at pc, at most max_len instructions,
+// and sets len to how many it took
+static emit_result_t emit_run(code_buf_t *buf, alloc_t *alloc,
+                              const chip8_t *chip8, uint16_t pc,
+                              uint8_t max_len, uint8_t quirks, uint8_t *len) {
+  uint32_t addr = pc;
+  emit_result_t result = EMIT_NEXT;
+  *len = 0;
+
+  while (result == EMIT_NEXT && *len < max_len &&
+         addr + 1 < CHIP8_MEMORY_SIZE) {
+    chip8_instr_t instr;
+    chip8_decode(&instr, (chip8->ram[addr] << 8) | chip8->ram[addr + 1]);
+
+    // A skip steps over both words of F000 NNNN in profiles that have it
+    uint16_t next = addr + 2;
+    bool long_instr = (quirks & CHIP8_QUIRK_LONG_F000) &&
+                      chip8->ram[next] == 0xF0 &&
+                      chip8->ram[(uint16_t)(next + 1)] == 0x00;
+    uint16_t skip_to = next + (long_instr ? 4 : 2);
+
+    size_t rollback = buf->len;
+    result = emit_instr(buf, alloc, &instr, addr, skip_to, quirks);
+    if (result == EMIT_FAIL) {
+      buf->len = rollback;
+      break;
+    }
+    (*len)++;
+    addr += 2;
+  }
+
+  // Fall through to the first instruction after the block
+  if (*len > 0 && result != EMIT_END) {
+    emit_store_imm16(buf, mem(OFF_PC), addr);
+  }
+  return result;
+}
+
+// Gives host registers to the registers a block uses more than once, most
+// used first. A register used once gains nothing from a load and a spill.
+static void allocate(alloc_t *alloc, const alloc_t *usage) {
+  memset(alloc, 0, sizeof(alloc_t));
+  memset(alloc->host, -1, sizeof(alloc->host));
+
+  while (alloc->num_host < sizeof(host_regs)) {
+    int best = -1;
+    for (int reg = 0; reg < NUM_REGS; reg++) {
+      if (alloc->host[reg] < 0 && usage->uses[reg] > 1 &&
+          (best < 0 || usage->uses[reg] > usage->uses[best])) {
+        best = reg;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    alloc->host[best] = host_regs[alloc->num_host++];
+  }
+}
+
+// push or pop of a callee saved host register
+static void emit_push_pop(code_buf_t *buf, uint8_t opcode, uint8_t host) {
+  if (host >= 8) {
+    emit(buf, 0x41);
+  }
+  emit(buf, opcode | (host & 7));
+}
+
+// Saves the callee saved host registers in use and loads the allocated
+// registers the block reads before writing from chip8_t
+static void emit_prologue(code_buf_t *buf, const alloc_t *alloc,
+                          uint32_t live_in) {
+  for (int i = NUM_CALLER_SAVED; i < alloc->num_host; i++) {
+    emit_push_pop(buf, 0x50, host_regs[i]);
+  }
+
+  for (int reg = 0; reg < NUM_REGS; reg++) {
+    if (alloc->host[reg] >= 0 && (live_in & (1u << reg))) {
+      // movzx host, byte Vx or word I
+      emit_rm(buf, OP_0F | (reg == REG_I ? 0xB7 : 0xB6), alloc->host[reg],
+              mem(reg == REG_I ? OFF_I : OFF_V(reg)));
+    }
+  }
+}
+
+// Spills the allocated registers the block wrote and restores the callee
+// saved ones. Every path through a block ends here.
+static void emit_epilogue(code_buf_t *buf, const alloc_t *alloc,
+                          uint32_t written) {
+  for (int reg = 0; reg < NUM_REGS; reg++) {
+    if (alloc->host[reg] >= 0 && (written & (1u << reg))) {
+      // mov byte Vx or word I, host
+      emit_rm(buf, reg == REG_I ? OP_16 | 0x89 : 0x88, alloc->host[reg],
+              mem(reg == REG_I ? OFF_I : OFF_V(reg)));
+    }
+  }
+
+  for (int i = alloc->num_host - 1; i >= NUM_CALLER_SAVED; i--) {
+    emit_push_pop(buf, 0x58, host_regs[i]);
+  }
+  emit(buf, 0xC3); // ret
+}
+
+static bool arena_write(chip8_jit_t *jit, const code_buf_t *buf) {
+  if (mprotect(jit->code, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+  memcpy(jit->code + jit->code_used, buf->bytes, buf->len);
+  return mprotect(jit->code, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_EXEC) == 0;
+}
+
+// Compiles the straight-line run starting at pc, returns its length. A first
+// pass with every register in memory finds the block and counts the uses of
+// each register, the second keeps the busiest ones in host registers.
+static uint8_t compile(chip8_jit_t *jit, const chip8_t *chip8, uint16_t pc) {
+  if (!jit->code) {
+    return jit->block_len[pc] = CHIP8_JIT_INTERPRET;
+  }
+
+  uint8_t quirks = chip8_quirk_flags(chip8->quirks);
+  code_buf_t buf = {.len = 0};
+  alloc_t usage;
+  memset(&usage, 0, sizeof(usage));
+  memset(usage.host, -1, sizeof(usage.host));
+  uint8_t len;
+  emit_run(&buf, &usage, chip8, pc, CHIP8_JIT_MAX_BLOCK, quirks, &len);
+  if (len == 0) {
+    return jit->block_len[pc] = CHIP8_JIT_INTERPRET;
+  }
+
+  alloc_t alloc;
+  allocate(&alloc, &usage);
+  buf.len = 0;
+  emit_prologue(&buf, &alloc, usage.live_in);
+  emit_run(&buf, &alloc, chip8, pc, len, quirks, &len);
+  emit_epilogue(&buf, &alloc, usage.written);
+  uint32_t addr = pc + len * 2;
+
+  if (jit->code_used + buf.len > CHIP8_JIT_CODE_SIZE) {
+    chip8_jit_reset(jit);
+  }
+  if (!arena_write(jit, &buf)) {
+    return jit->block_len[pc] = CHIP8_JIT_INTERPRET;
+  }
+
+  // The word after the block decides how far a skip at its end goes
+  memset(&jit->is_code[pc], true, addr - pc);
+  jit->is_code[addr & (CHIP8_MEMORY_SIZE - 1)] = true;
+  jit->is_code[(addr + 1) & (CHIP8_MEMORY_SIZE - 1)] = true;
+  jit->blocks[pc] = (chip8_jit_block_t)(jit->code + jit->code_used);
+  jit->code_used += buf.len;
+  return jit->block_len[pc] = len;
+}
+
+bool chip8_jit_init(chip8_jit_t *jit) {
+  memset(jit, 0, sizeof(chip8_jit_t));
+
+  void *code = mmap(NULL, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  jit->code = code;
+  return true;
+}
+
+#else
+
+static uint8_t compile(chip8_jit_t *jit, const chip8_t *chip8, uint16_t pc) {
+  return jit->block_len[pc] = CHIP8_JIT_INTERPRET;
+}
+
+bool chip8_jit_init(chip8_jit_t *jit) {
+  memset(jit, 0, sizeof(chip8_jit_t));
+  return false;
+}
+
+#endif
+
+void chip8_jit_free(chip8_jit_t *jit) {
+  if (jit->code) {
+    munmap(jit->code, CHIP8_JIT_CODE_SIZE);
+    jit->code = NULL;
+  }
+}
+
+void chip8_jit_reset(chip8_jit_t *jit) {
+  memset(jit->blocks, 0, sizeof(jit->blocks));
+  memset(jit->block_len, 0, sizeof(jit->block_len));
+  memset(jit->is_code, 0, sizeof(jit->is_code));
+  jit->code_used = 0;
+}
+
+// Drops every block that overlaps ram written by FX33, FX55 or 5XY2,
+// including the word after it
+static void invalidate(chip8_jit_t *jit, uint32_t addr, uint32_t len) {
+  uint32_t start = addr >= CHIP8_JIT_MAX_BLOCK * 2 + 2
+                       ? addr - CHIP8_JIT_MAX_BLOCK * 2 - 2
+                       : 0;
+  uint32_t end = addr + len;
+  if (end > CHIP8_MEMORY_SIZE) {
+    end = CHIP8_MEMORY_SIZE;
+  }
+
+  bool hits_code = false;
+  for (uint32_t i = addr; i < end; i++) {
+    hits_code |= jit->is_code[i];
+  }
+  if (!hits_code) {
+    return;
+  }
+
+  for (uint32_t i = start; i < end; i++) {
+    uint8_t block_len = jit->block_len[i];
+    if (block_len == CHIP8_JIT_INTERPRET) {
+      block_len = 1;
+    }
+
+    if (block_len && i + block_len * 2 + 2 > addr) {
+      jit->blocks[i] = NULL;
+      jit->block_len[i] = 0;
+    }
+  }
+}
+
+static void interpret(chip8_jit_t *jit, chip8_t *chip8, uint16_t pc) {
+  uint16_t opcode = (chip8->ram[pc] << 8) |
+                    chip8->ram[(pc + 1) & (CHIP8_MEMORY_SIZE - 1)];
+  uint16_t I = chip8->I;
+
+  chip8_cycle(chip8);
+
+  // Self-modifying stores
+  if ((opcode & 0xF0FF) == 0xF033) {
+    invalidate(jit, I, 3);
+  } else if ((opcode & 0xF0FF) == 0xF055) {
+    invalidate(jit, I, ((opcode & 0x0F00) >> 8) + 1);
+  } else if ((opcode & 0xF00F) == 0x5002) {
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    invalidate(jit, I, abs(x - y) + 1);
+  }
+}
+
+void chip8_jit_run(chip8_jit_t *jit, chip8_t *chip8, uint64_t cycles) {
+  // Compiled blocks bypass chip8_cycle, so a profiler or tracer would miss
+  // them
+  if (chip8->profile || chip8->trace) {
+    for (; cycles > 0; cycles--) {
+      interpret(jit, chip8, chip8->PC & (CHIP8_MEMORY_SIZE - 1));
+    }
+    return;
+  }
+
+  // Blocks are compiled for one quirks profile
+  if (chip8->quirks != jit->quirks) {
+    chip8_jit_reset(jit);
+    jit->quirks = chip8->quirks;
+  }
+
+  while (cycles > 0) {
+    uint16_t pc = chip8->PC & (CHIP8_MEMORY_SIZE - 1);
+    uint8_t len = jit->block_len[pc];
+    if (len == 0) {
+      len = compile(jit, chip8, pc);
+    }
+
+    // A block only runs when it fits the remaining budget so the cycle count
+    // stays exact, the tail is interpreted one instruction at a time
+    if (len != CHIP8_JIT_INTERPRET && len <= cycles) {
+      jit->blocks[pc](chip8);
+      cycles -= len;
+    } else {
+      interpret(jit, chip8, pc);
+      cycles--;
+    }
+  }
+}
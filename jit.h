@@ -0,0 +1,44 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define CHIP8_JIT_MAX_BLOCK 32            // Instructions per compiled block
+#define CHIP8_JIT_CODE_SIZE (1024 * 1024) // Bytes of host code before a flush
+
+typedef void (*chip8_jit_block_t)(chip8_t *chip8);
+
+typedef struct {
+  // Executable arena, compiled blocks are appended until it is full
+  uint8_t *code;
+  size_t code_used;
+
+  // Compiled block per start address and its length in instructions.
+  // A length of 0 means the address was not compiled yet and
+  // CHIP8_JIT_INTERPRET means the first instruction is left to chip8_cycle
+  chip8_jit_block_t blocks[CHIP8_MEMORY_SIZE];
+  uint8_t block_len[CHIP8_MEMORY_SIZE];
+
+  // Bytes read by any compiled block, so stores to data skip invalidation
+  bool is_code[CHIP8_MEMORY_SIZE];
+
+  // CHIP8_QUIRKS_* profile the blocks were compiled for
+  uint8_t quirks;
+} chip8_jit_t;
+
+#define CHIP8_JIT_INTERPRET 0xFF
+
+// Returns false when the host is not x86-64 or executable memory is
+// unavailable, chip8_jit_run then only interprets
+bool chip8_jit_init(chip8_jit_t *jit);
+void chip8_jit_free(chip8_jit_t *jit);
+// Drops every block, needed after loading a rom or writing ram from outside
+void chip8_jit_reset(chip8_jit_t *jit);
+// Runs exactly cycles instructions, same as calling chip8_cycle that often
+void chip8_jit_run(chip8_jit_t *jit, chip8_t *chip8, uint64_t cycles);
+
+#endif
@@ -3,21 +3,350 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "audio.h"
+#include "capture.h"
 #include "chip8.h"
+#include "movie.h"
+#include "profile.h"
+#include "render.h"
+#include "rompack.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "shm.h"
+#include "trace.h"
 
+#define WINDOW_TITLE "CHIP8 Emulator"
 #define SCALE 20
 #define WINDOW_WIDTH (CHIP8_SCREEN_WIDTH * SCALE)
 #define WINDOW_HEIGHT (CHIP8_SCREEN_HEIGHT * SCALE)
-#define CPU_HZ 600
-#define FPS 60
-#define CYCLES_PER_FRAME (CPU_HZ / FPS)
+#define CPU_HZ 600 // Default, --hz changes it
+#define FPS 60     // Default display refresh, --refresh changes it
+
+#define IDLE_WAIT_MS 100 // Longest sleep on events while waiting for a key
+#define NS_PER_MS 1000000ull
+#define NS_PER_SEC 1000000000ull
+
+// Input is sampled before each CPU slice, --slices changes how many run per
+// timer tick
+#define SLICES_PER_TICK 4
+
+// Host key for each CHIP-8 key 0-F, as in a rom pack
+#define DEFAULT_KEYS "x123qweasdzc4rfv"
+#define MAX_KEY_BINDINGS 64
+
+#define LATENCY_TIMEOUT_NS 1000000000ull // Press that changed nothing
+
+#define TURBO_MEASURE_NS 500000000ull // Title and audio speed updates
+
+#define AUDIO_DEVICE_FRAMES "256" // Device buffer, about 5 ms
+#define AUDIO_CHUNK 512           // Samples synthesized per put
+
+#define REWIND_SECONDS 60
+#define REWIND_ARENA_SIZE (8 * 1024 * 1024) // About 60 64K keyframes
+#define REWIND_KEYFRAME_INTERVAL 60
+
+typedef struct {
+  const char *rom;  // File, or name or hash in the pack
+  const char *pack; // Rom pack to load rom from, NULL for a plain file
+  uint32_t cpu_hz;
+  bool cpu_hz_set; // Given on the command line, wins over pack metadata
+  int quirks;      // CHIP8_QUIRKS_* profile, -1 until chosen
+  uint32_t refresh_hz;
+  const char *record_path; // Movie to record, NULL when not recording
+  const char *replay_path; // Movie to replay, NULL when not replaying
+  bool seeded;
+  uint32_t seed;
+  bool profile; // Count executed instructions, dumped on F2 and exit
+  bool trace;   // Trace from the start instead of waiting for F3
+  bool capture; // Capture from the start instead of waiting for F6
+  const char *keymap_path; // Key bindings file, NULL for the pack or default
+  char pack_keys[CHIP8_NUM_KEYS]; // Host keys from the pack, 0 for default
+  uint32_t slices;                // CPU slices per timer tick
+  bool latency; // Print the time from each key press to a changed frame
+  const char *attach; // Host to view instead of running a rom, or NULL
+  bool turbo;         // Start unthrottled instead of waiting for Tab
+} options_t;
+
+// Host keys bound to CHIP-8 keys, several host keys can share one
+typedef struct {
+  SDL_Keycode host[MAX_KEY_BINDINGS];
+  uint8_t key[MAX_KEY_BINDINGS];
+  int count;
+} keymap_t;
+
+// Unthrottled running. Whole frames run until the next refresh is due and
+// only the last of them is presented, the speed is measured over
+// TURBO_MEASURE_NS at a time.
+typedef struct {
+  bool on;
+  uint64_t ticks;       // Timer ticks run in turbo, spreads cycles evenly
+  uint64_t since_ns;    // Start of the current measurement
+  uint64_t since_ticks; // ticks at since_ns
+} turbo_t;
+
+// Input to display latency, measured from the key down event to the present
+// of the first frame whose display differs from the one at the press
+typedef struct {
+  uint64_t pressed_ns; // Press being measured, 0 when none
+  uint64_t display_hash;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t min_ns;
+  uint64_t max_ns;
+} latency_t;
 
 typedef struct {
   SDL_Window *window;
   SDL_Renderer *renderer;
+  SDL_Texture *screen;  // Streaming texture at the high resolution
+  SDL_Texture *grid[2]; // Debug grid per resolution, drawn once at window size
+  SDL_AudioStream *audio; // NULL when no device could be opened
 } sdl_t;
 
+void draw_debug_grid(const sdl_t *sdl, SDL_Texture *grid, int columns,
+                     int rows);
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--hz cpu hz] [--refresh hz] [--seed n] "
+          "[--record movie | --replay movie] [--profile] [--trace] [--capture] "
+          "[--quirks default|cosmac|schip|xochip] [--pack rom pack] "
+          "[--keymap file] [--slices n] [--latency] [--turbo] "
+          "<rom file, or name or hash in the pack>\n"
+          "       %s [--refresh hz] [--keymap file] --attach name\n",
+          prog, prog);
+}
+
+bool parse_args(int argc, char *argv[], options_t *options) {
+  options->rom = NULL;
+  options->pack = NULL;
+  options->cpu_hz = CPU_HZ;
+  options->cpu_hz_set = false;
+  options->quirks = -1;
+  options->refresh_hz = FPS;
+  options->record_path = NULL;
+  options->replay_path = NULL;
+  options->seeded = false;
+  options->seed = 0;
+  options->profile = false;
+  options->trace = false;
+  options->capture = false;
+  options->keymap_path = NULL;
+  memset(options->pack_keys, 0, CHIP8_NUM_KEYS);
+  options->slices = SLICES_PER_TICK;
+  options->latency = false;
+  options->attach = NULL;
+  options->turbo = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+      options->cpu_hz = strtoul(argv[++i], NULL, 10);
+      options->cpu_hz_set = true;
+    } else if (strcmp(argv[i], "--refresh") == 0 && i + 1 < argc) {
+      options->refresh_hz = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      options->seed = strtoul(argv[++i], NULL, 10);
+      options->seeded = true;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      options->record_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      options->replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      options->profile = true;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      options->trace = true;
+    } else if (strcmp(argv[i], "--capture") == 0) {
+      options->capture = true;
+    } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+      options->quirks = chip8_quirks_from_name(argv[++i]);
+      if (options->quirks < 0) {
+        return false;
+      }
+    } else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+      options->pack = argv[++i];
+    } else if (strcmp(argv[i], "--keymap") == 0 && i + 1 < argc) {
+      options->keymap_path = argv[++i];
+    } else if (strcmp(argv[i], "--slices") == 0 && i + 1 < argc) {
+      options->slices = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--latency") == 0) {
+      options->latency = true;
+    } else if (strcmp(argv[i], "--turbo") == 0) {
+      options->turbo = true;
+    } else if (strcmp(argv[i], "--attach") == 0 && i + 1 < argc) {
+      options->attach = argv[++i];
+    } else if (argv[i][0] != '-' && !options->rom) {
+      options->rom = argv[i];
+    } else {
+      return false;
+    }
+  }
+
+  // A viewer only draws the host's frames, the host runs the rom
+  bool viewer_ok = !options->attach ||
+                   (!options->record_path && !options->replay_path &&
+                    !options->pack && !options->profile && !options->trace &&
+                    !options->capture && !options->turbo);
+  return (options->rom != NULL) != (options->attach != NULL) && viewer_ok &&
+         options->cpu_hz > 0 && options->refresh_hz > 0 &&
+         options->slices > 0 &&
+         !(options->record_path && options->replay_path);
+}
+
+// Loads the rom from a file or the pack, pack metadata can set the cpu speed,
+// quirks and keys
+bool load_rom(chip8_t *chip8, options_t *options) {
+  if (!options->pack) {
+    return chip8_load_rom(chip8, options->rom);
+  }
+
+  rom_pack_t pack;
+  if (!rom_pack_open(&pack, options->pack)) {
+    return false;
+  }
+
+  // By name first, then by the 16 hex digit hash
+  rom_info_t info;
+  char *end;
+  uint64_t hash = strtoull(options->rom, &end, 16);
+  bool found = rom_pack_find_name(&pack, options->rom, &info) ||
+               (strlen(options->rom) == 16 && *end == '\0' &&
+                rom_pack_find_hash(&pack, hash, &info));
+
+  bool ok = found && chip8_load_rom_mem(chip8, info.data, info.size);
+  if (!found) {
+    fprintf(stderr, "%s is not in %s\n", options->rom, options->pack);
+  } else {
+    if (info.cpu_hz && !options->cpu_hz_set) {
+      options->cpu_hz = info.cpu_hz;
+    }
+    if (options->quirks < 0) {
+      options->quirks = info.quirks;
+    }
+    memcpy(options->pack_keys, info.keys, CHIP8_NUM_KEYS);
+  }
+
+  rom_pack_close(&pack);
+  return ok;
+}
+
+void keymap_bind(keymap_t *keymap, SDL_Keycode host, uint8_t key) {
+  keymap->host[keymap->count] = host;
+  keymap->key[keymap->count] = key;
+  keymap->count++;
+}
+
+// One host key per CHIP-8 key, given as characters like DEFAULT_KEYS. A 0
+// keeps the default for that key.
+void keymap_from_keys(keymap_t *keymap, const char *keys) {
+  keymap->count = 0;
+  for (int key = 0; key < CHIP8_NUM_KEYS; key++) {
+    const char name[2] = {keys[key] ? keys[key] : DEFAULT_KEYS[key], '\0'};
+    SDL_Keycode host = SDL_GetKeyFromName(name);
+    if (host != SDLK_UNKNOWN) {
+      keymap_bind(keymap, host, key);
+    }
+  }
+}
+
+// Reads lines of a CHIP-8 key 0-F and an SDL key name such as "Up",
+// "Keypad 5" or "Left Shift", # starts a comment
+bool keymap_load(keymap_t *keymap, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror("fopen");
+    return false;
+  }
+
+  keymap->count = 0;
+  char line[256];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file)) {
+    number++;
+    line[strcspn(line, "#\r\n")] = '\0';
+    char *p = line + strspn(line, " \t");
+    if (*p == '\0') {
+      continue;
+    }
+
+    char *end;
+    unsigned long key = strtoul(p, &end, 16);
+    char *name = end + strspn(end, " \t");
+    size_t len = strlen(name);
+    while (len > 0 && (name[len - 1] == ' ' || name[len - 1] == '\t')) {
+      name[--len] = '\0';
+    }
+
+    SDL_Keycode host = len ? SDL_GetKeyFromName(name) : SDLK_UNKNOWN;
+    if (end == p || key >= CHIP8_NUM_KEYS || host == SDLK_UNKNOWN) {
+      fprintf(stderr, "%s:%d: expected a key 0-F and a key name\n", path,
+              number);
+      ok = false;
+    } else if (keymap->count == MAX_KEY_BINDINGS) {
+      fprintf(stderr, "%s:%d: more than %d bindings\n", path, number,
+              MAX_KEY_BINDINGS);
+      ok = false;
+    } else {
+      keymap_bind(keymap, host, key);
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+// CHIP-8 key bound to host, or -1
+int keymap_find(const keymap_t *keymap, SDL_Keycode host) {
+  for (int i = 0; i < keymap->count; i++) {
+    if (keymap->host[i] == host) {
+      return keymap->key[i];
+    }
+  }
+  return -1;
+}
+
+// Starts timing a press, unless an earlier one is still waiting for its
+// frame. Presses that never change the display are given up on.
+void latency_press(latency_t *latency, const chip8_t *chip8,
+                   uint64_t timestamp_ns) {
+  if (latency->pressed_ns &&
+      timestamp_ns - latency->pressed_ns < LATENCY_TIMEOUT_NS) {
+    return;
+  }
+  latency->pressed_ns = timestamp_ns;
+  latency->display_hash = chip8_display_hash(chip8);
+}
+
+// Called after each present, ends the measurement once the display changed
+void latency_presented(latency_t *latency, const chip8_t *chip8) {
+  if (!latency->pressed_ns ||
+      chip8_display_hash(chip8) == latency->display_hash) {
+    return;
+  }
+
+  uint64_t ns = SDL_GetTicksNS() - latency->pressed_ns;
+  latency->pressed_ns = 0;
+  latency->min_ns = latency->count && latency->min_ns < ns ? latency->min_ns
+                                                           : ns;
+  latency->max_ns = latency->max_ns > ns ? latency->max_ns : ns;
+  latency->total_ns += ns;
+  latency->count++;
+  printf("input latency: %.1f ms\n", ns / 1e6);
+}
+
+void latency_dump(const latency_t *latency) {
+  if (!latency->count) {
+    return;
+  }
+  printf("input latency over %llu presses: min %.1f ms, mean %.1f ms, "
+         "max %.1f ms\n",
+         (unsigned long long)latency->count, latency->min_ns / 1e6,
+         latency->total_ns / 1e6 / latency->count, latency->max_ns / 1e6);
+}
+
 bool init(sdl_t *sdl) {
   if (!SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO)) {
     SDL_Log("Error: SDL_Init %s\n", SDL_GetError());
@@ -25,7 +354,7 @@ bool init(sdl_t *sdl) {
   }
 
   sdl->window =
-      SDL_CreateWindow("CHIP8 Emulator", WINDOW_WIDTH, WINDOW_HEIGHT, 0);
+      SDL_CreateWindow(WINDOW_TITLE, WINDOW_WIDTH, WINDOW_HEIGHT, 0);
   if (!sdl->window) {
     SDL_Log("Error: SDL_CreateWindow %s\n", SDL_GetError());
     return false;
@@ -37,183 +366,463 @@ bool init(sdl_t *sdl) {
     return false;
   }
 
+  // Low resolution only uses the top left corner
+  sdl->screen = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                  SDL_TEXTUREACCESS_STREAMING,
+                                  CHIP8_HIRES_WIDTH, CHIP8_HIRES_HEIGHT);
+  if (!sdl->screen) {
+    SDL_Log("Error: SDL_CreateTexture %s\n", SDL_GetError());
+    return false;
+  }
+  // Keep pixels sharp when scaling up to the window
+  SDL_SetTextureScaleMode(sdl->screen, SDL_SCALEMODE_NEAREST);
+
+  for (int hires = 0; hires < 2; hires++) {
+    sdl->grid[hires] = SDL_CreateTexture(
+        sdl->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+        WINDOW_WIDTH, WINDOW_HEIGHT);
+    if (!sdl->grid[hires]) {
+      SDL_Log("Error: SDL_CreateTexture %s\n", SDL_GetError());
+      return false;
+    }
+  }
+  draw_debug_grid(sdl, sdl->grid[0], CHIP8_SCREEN_WIDTH, CHIP8_SCREEN_HEIGHT);
+  draw_debug_grid(sdl, sdl->grid[1], CHIP8_HIRES_WIDTH, CHIP8_HIRES_HEIGHT);
+
   return true;
 }
 
-void handle_input(chip8_t *chip8, bool *should_run, bool *debug) {
+// Runs on SDL's audio thread and synthesizes as much as the device asks for,
+// it only reads the sound change queue so it never holds up the emulator
+void SDLCALL audio_callback(void *userdata, SDL_AudioStream *stream,
+                            int additional_amount, int total_amount) {
+  chip8_audio_t *audio = userdata;
+  float samples[AUDIO_CHUNK];
+
+  int frames = additional_amount / (int)sizeof(float);
+  while (frames > 0) {
+    int count = frames < AUDIO_CHUNK ? frames : AUDIO_CHUNK;
+    chip8_audio_render(audio, samples, count);
+    SDL_PutAudioStreamData(stream, samples, count * sizeof(float));
+    frames -= count;
+  }
+}
+
+// Plays the queue through the default device. Without one the emulator
+// still runs, silently.
+void open_audio(sdl_t *sdl, chip8_audio_t *audio) {
+  // A small device buffer keeps the beep close to the frame that started it
+  SDL_SetHint(SDL_HINT_AUDIO_DEVICE_SAMPLE_FRAMES, AUDIO_DEVICE_FRAMES);
+
+  const SDL_AudioSpec spec = {SDL_AUDIO_F32, 1, CHIP8_AUDIO_RATE};
+  sdl->audio = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK,
+                                         &spec, audio_callback, audio);
+  if (!sdl->audio) {
+    SDL_Log("Error: SDL_OpenAudioDeviceStream %s\n", SDL_GetError());
+    return;
+  }
+  SDL_ResumeAudioStreamDevice(sdl->audio);
+}
+
+// Save states live next to the rom as <rom file>.state
+void save_state(const chip8_t *chip8, const options_t *options) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.state", options->rom);
+
+  uint8_t buf[CHIP8_SAVE_STATE_SIZE];
+  size_t size = chip8_save_state(chip8, buf, sizeof(buf));
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror("fopen");
+    return;
+  }
+  if (fwrite(buf, 1, size, file) != size) {
+    perror("fwrite");
+  }
+  fclose(file);
+}
+
+void load_state(chip8_t *chip8, const options_t *options) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.state", options->rom);
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("fopen");
+    return;
+  }
+
+  uint8_t buf[CHIP8_SAVE_STATE_SIZE];
+  size_t size = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
+
+  chip8_load_state(chip8, buf, size);
+}
+
+// Starts or stops tracing to <rom file>.trace, read it with tracedump
+void toggle_trace(chip8_t *chip8, const options_t *options) {
+  static chip8_trace_t trace;
+
+  if (chip8->trace) {
+    chip8->trace = NULL;
+    chip8_trace_close(&trace);
+    return;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.trace", options->rom);
+  if (chip8_trace_open(&trace, path)) {
+    chip8->trace = &trace;
+  }
+}
+
+// Starts or stops capturing every frame to <rom file>.c8cv, convert it with
+// capdump
+void toggle_capture(chip8_t *chip8, const options_t *options) {
+  static chip8_capture_t capture;
+
+  if (chip8->capture) {
+    chip8->capture = NULL;
+    chip8_capture_close(&capture);
+    return;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.c8cv", options->rom);
+  if (chip8_capture_open(&capture, path, SCHEDULER_TIMER_HZ)) {
+    chip8->capture = &capture;
+  }
+}
+
+// Keypad keys go through the keymap, the function keys are fixed. latency
+// is NULL unless measuring.
+void handle_input(chip8_t *chip8, const options_t *options,
+                  const keymap_t *keymap, latency_t *latency,
+                  bool *should_run, bool *debug, bool *rewinding,
+                  bool *turbo) {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     if (event.type == SDL_EVENT_QUIT) {
       *should_run = false;
     } else if (event.type == SDL_EVENT_KEY_DOWN) {
+      int key = keymap_find(keymap, event.key.key);
+      if (key >= 0) {
+        chip8_set_key(chip8, key, true);
+        if (latency && !event.key.repeat) {
+          latency_press(latency, chip8, event.key.timestamp);
+        }
+        continue;
+      }
+
       switch (event.key.key) {
       case SDLK_F1:
         *debug = !*debug;
         break;
-
-      case SDLK_1:
-        chip8_set_key(chip8, 0x1, true);
-        break;
-      case SDLK_2:
-        chip8_set_key(chip8, 0x2, true);
+      case SDLK_F2:
+        if (chip8->profile) {
+          chip8_profile_dump(chip8->profile, chip8, stdout);
+        }
         break;
-      case SDLK_3:
-        chip8_set_key(chip8, 0x3, true);
+      case SDLK_F3:
+        toggle_trace(chip8, options);
         break;
-      case SDLK_4:
-        chip8_set_key(chip8, 0xC, true);
+      case SDLK_F5:
+        save_state(chip8, options);
         break;
-
-      case SDLK_Q:
-        chip8_set_key(chip8, 0x4, true);
+      case SDLK_F6:
+        toggle_capture(chip8, options);
         break;
-      case SDLK_W:
-        chip8_set_key(chip8, 0x5, true);
+      case SDLK_F9:
+        load_state(chip8, options);
         break;
-      case SDLK_E:
-        chip8_set_key(chip8, 0x6, true);
+      case SDLK_BACKSPACE:
+        *rewinding = true;
         break;
-      case SDLK_R:
-        chip8_set_key(chip8, 0xD, true);
+      case SDLK_TAB:
+        *turbo = !*turbo;
         break;
-
-      case SDLK_A:
-        chip8_set_key(chip8, 0x7, true);
-        break;
-      case SDLK_S:
-        chip8_set_key(chip8, 0x8, true);
-        break;
-      case SDLK_D:
-        chip8_set_key(chip8, 0x9, true);
-        break;
-      case SDLK_F:
-        chip8_set_key(chip8, 0xE, true);
-        break;
-
-      case SDLK_Z:
-        chip8_set_key(chip8, 0xA, true);
-        break;
-      case SDLK_X:
-        chip8_set_key(chip8, 0x0, true);
-        break;
-      case SDLK_C:
-        chip8_set_key(chip8, 0xB, true);
-        break;
-      case SDLK_V:
-        chip8_set_key(chip8, 0xF, true);
-        break;
-
       default:
         break;
       }
     } else if (event.type == SDL_EVENT_KEY_UP) {
-      switch (event.key.key) {
-      case SDLK_1:
-        chip8_set_key(chip8, 0x1, false);
-        break;
-      case SDLK_2:
-        chip8_set_key(chip8, 0x2, false);
-        break;
-      case SDLK_3:
-        chip8_set_key(chip8, 0x3, false);
-        break;
-      case SDLK_4:
-        chip8_set_key(chip8, 0xC, false);
-        break;
+      int key = keymap_find(keymap, event.key.key);
+      if (key >= 0) {
+        chip8_set_key(chip8, key, false);
+      } else if (event.key.key == SDLK_BACKSPACE) {
+        *rewinding = false;
+      }
+    }
+  }
+}
 
-      case SDLK_Q:
-        chip8_set_key(chip8, 0x4, false);
-        break;
-      case SDLK_W:
-        chip8_set_key(chip8, 0x5, false);
-        break;
-      case SDLK_E:
-        chip8_set_key(chip8, 0x6, false);
-        break;
-      case SDLK_R:
-        chip8_set_key(chip8, 0xD, false);
-        break;
+// Starts or ends turbo. Normal speed goes on from the current time, the
+// scheduler kept advancing meanwhile.
+void turbo_set(turbo_t *turbo, bool on, sdl_t *sdl, chip8_audio_t *audio,
+               uint32_t audio_hz) {
+  turbo->on = on;
+  turbo->since_ns = SDL_GetTicksNS();
+  turbo->since_ticks = turbo->ticks;
+  if (!on) {
+    SDL_SetWindowTitle(sdl->window, WINDOW_TITLE);
+    chip8_audio_set_cpu_hz(audio, audio_hz);
+  }
+}
 
-      case SDLK_A:
-        chip8_set_key(chip8, 0x7, false);
-        break;
-      case SDLK_S:
-        chip8_set_key(chip8, 0x8, false);
-        break;
-      case SDLK_D:
-        chip8_set_key(chip8, 0x9, false);
-        break;
-      case SDLK_F:
-        chip8_set_key(chip8, 0xE, false);
-        break;
+// Cycles of the next timer tick in turbo, cpu_hz spread over the ticks of
+// each second
+uint64_t turbo_cycles(const turbo_t *turbo, uint32_t cpu_hz) {
+  return (turbo->ticks + 1) * cpu_hz / SCHEDULER_TIMER_HZ -
+         turbo->ticks * cpu_hz / SCHEDULER_TIMER_HZ;
+}
 
-      case SDLK_Z:
-        chip8_set_key(chip8, 0xA, false);
-        break;
-      case SDLK_X:
-        chip8_set_key(chip8, 0x0, false);
-        break;
-      case SDLK_C:
-        chip8_set_key(chip8, 0xB, false);
-        break;
-      case SDLK_V:
-        chip8_set_key(chip8, 0xF, false);
-        break;
+// Shows the speed over real time in the window title. The audio clock is
+// sped up by as much so sound stays in step with the wall clock.
+void turbo_measure(turbo_t *turbo, sdl_t *sdl, chip8_audio_t *audio,
+                   uint32_t audio_hz) {
+  uint64_t now = SDL_GetTicksNS();
+  uint64_t elapsed = now - turbo->since_ns;
+  if (elapsed < TURBO_MEASURE_NS) {
+    return;
+  }
 
-      default:
-        break;
-      }
-    }
+  double speed = (double)(turbo->ticks - turbo->since_ticks) * NS_PER_SEC /
+                 SCHEDULER_TIMER_HZ / elapsed;
+  turbo->since_ns = now;
+  turbo->since_ticks = turbo->ticks;
+
+  char title[64];
+  snprintf(title, sizeof(title), "%s - turbo %.1fx", WINDOW_TITLE, speed);
+  SDL_SetWindowTitle(sdl->window, title);
+  double hz = audio_hz * speed;
+  chip8_audio_set_cpu_hz(audio, hz < audio_hz     ? audio_hz
+                                : hz > UINT32_MAX ? UINT32_MAX
+                                                  : (uint32_t)hz);
+}
+
+// Sleeps until the next slice, timer tick or refresh is due. An event ends
+// the sleep early so a key press reaches the CPU in the slice it happened
+// in, not at the next frame.
+void sleep_until_due(const scheduler_t *sched) {
+  uint64_t ns = scheduler_ns_until_next(sched, SDL_GetTicksNS());
+  // Events can only be waited on in whole milliseconds
+  if (ns >= NS_PER_MS && SDL_WaitEventTimeout(NULL, ns / NS_PER_MS)) {
+    return;
   }
+  SDL_DelayNS(scheduler_ns_until_next(sched, SDL_GetTicksNS()));
 }
 
 void cleanup(const sdl_t sdl) {
+  if (sdl.audio) {
+    SDL_DestroyAudioStream(sdl.audio);
+  }
+  SDL_DestroyTexture(sdl.grid[0]);
+  SDL_DestroyTexture(sdl.grid[1]);
+  SDL_DestroyTexture(sdl.screen);
   SDL_DestroyRenderer(sdl.renderer);
   SDL_DestroyWindow(sdl.window);
   SDL_Quit();
 }
 
-void draw_debug_grid(const sdl_t sdl) {
-  SDL_SetRenderDrawBlendMode(sdl.renderer, SDL_BLENDMODE_BLEND);
-  SDL_SetRenderDrawColor(sdl.renderer, 255, 255, 255, 128);
-  for (int x = 0; x < CHIP8_SCREEN_WIDTH; x++) {
-    const int px = x * SCALE;
-    SDL_RenderLine(sdl.renderer, px, 0, px, WINDOW_HEIGHT);
+// Renders the grid lines into grid so showing it costs one copy
+void draw_debug_grid(const sdl_t *sdl, SDL_Texture *grid, int columns,
+                     int rows) {
+  SDL_SetRenderTarget(sdl->renderer, grid);
+  SDL_SetRenderDrawBlendMode(sdl->renderer, SDL_BLENDMODE_NONE);
+  SDL_SetRenderDrawColor(sdl->renderer, 0, 0, 0, 0); // TRANSPARENT
+  SDL_RenderClear(sdl->renderer);
+
+  SDL_SetRenderDrawColor(sdl->renderer, 255, 255, 255, 128);
+  for (int x = 0; x < columns; x++) {
+    const int px = x * WINDOW_WIDTH / columns;
+    SDL_RenderLine(sdl->renderer, px, 0, px, WINDOW_HEIGHT);
   }
-  for (int y = 0; y < CHIP8_SCREEN_HEIGHT; y++) {
-    const int py = y * SCALE;
-    SDL_RenderLine(sdl.renderer, 0, py, WINDOW_WIDTH, py);
+  for (int y = 0; y < rows; y++) {
+    const int py = y * WINDOW_HEIGHT / rows;
+    SDL_RenderLine(sdl->renderer, 0, py, WINDOW_WIDTH, py);
   }
+
+  SDL_SetRenderTarget(sdl->renderer, NULL);
+  SDL_SetTextureBlendMode(grid, SDL_BLENDMODE_BLEND);
 }
 
-void draw_screen(chip8_t *chip8, const sdl_t sdl, bool *debug) {
-  SDL_SetRenderDrawColor(sdl.renderer, 0, 0, 0, 255); // BLACK
-  SDL_RenderClear(sdl.renderer);
+void draw_screen(chip8_t *chip8, sdl_t *sdl, bool *debug) {
+  // Only upload the rows that changed since the last frame, one lock per
+  // run of consecutive dirty rows
+  const int width = chip8_screen_width(chip8);
+  const int height = chip8_screen_height(chip8);
+  uint64_t dirty = chip8_consume_dirty(chip8);
+  int y = 0;
+  while (y < height) {
+    if (!((dirty >> y) & 1)) {
+      y++;
+      continue;
+    }
 
-  SDL_SetRenderDrawColor(sdl.renderer, 255, 255, 255, 255); // WHITE
+    int first_row = y;
+    while (y < height && ((dirty >> y) & 1)) {
+      y++;
+    }
 
-  // For each row
-  for (int y = 0; y < CHIP8_SCREEN_HEIGHT; y++) {
-    // Draw column
-    for (int x = 0; x < CHIP8_SCREEN_WIDTH; x++) {
-      // If pixel is on then draw a colored rectangle
-      if (chip8->display[y * CHIP8_SCREEN_WIDTH + x]) {
-        const SDL_FRect r = {x * SCALE, y * SCALE, SCALE, SCALE};
-        SDL_RenderFillRect(sdl.renderer, &r);
-      }
+    const SDL_Rect rect = {0, first_row, width, y - first_row};
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(sdl->screen, &rect, &pixels, &pitch)) {
+      render_rows(chip8, pixels, pitch, first_row, rect.h);
+      SDL_UnlockTexture(sdl->screen);
     }
   }
 
+  // The used part of the texture covers the whole window so there is
+  // nothing to clear
+  const SDL_FRect used = {0, 0, width, height};
+  SDL_RenderTexture(sdl->renderer, sdl->screen, &used, NULL);
+
   if (*debug) {
-    draw_debug_grid(sdl);
+    SDL_RenderTexture(sdl->renderer, sdl->grid[chip8->hires], NULL, NULL);
+  }
+
+  SDL_RenderPresent(sdl->renderer);
+}
+
+// Spreads the due cycles over the due timer ticks so the timers see the same
+// number of instructions between ticks at any host frame rate. Returns what
+// the machine was left waiting on.
+chip8_idle_t run_cycles(chip8_t *chip8, uint64_t cycles, uint32_t timer_ticks) {
+  chip8_idle_t idle = CHIP8_BUSY;
+
+  for (uint32_t tick = 0; tick < timer_ticks; tick++) {
+    uint64_t slice = cycles / (timer_ticks - tick);
+    chip8_audio_begin(chip8->audio, slice);
+    idle = chip8_run(chip8, slice);
+    cycles -= slice;
+
+    chip8_decrement_timers(chip8);
+    chip8_audio_end(chip8->audio, chip8);
+  }
+
+  if (cycles) {
+    chip8_audio_begin(chip8->audio, cycles);
+    idle = chip8_run(chip8, cycles);
+    chip8_audio_end(chip8->audio, chip8);
+  }
+  return idle;
+}
+
+// Copies a frame from the host into view, marking the rows that changed so
+// only those are uploaded
+void show_frame(chip8_t *view, const chip8_shm_frame_t *frame) {
+  if (view->hires != frame->hires) {
+    chip8_set_hires(view, frame->hires);
+  }
+  for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+    bool changed = false;
+    for (int plane = 0; plane < CHIP8_NUM_PLANES; plane++) {
+      changed |= memcmp(view->display[plane][y], frame->display[plane][y],
+                        sizeof(view->display[plane][y])) != 0;
+      memcpy(view->display[plane][y], frame->display[plane][y],
+             sizeof(view->display[plane][y]));
+    }
+    if (changed) {
+      view->dirty_rows |= 1ull << y;
+    }
   }
+}
 
-  SDL_RenderPresent(sdl.renderer);
+void handle_viewer_input(chip8_t *view, const keymap_t *keymap,
+                         bool *should_run, bool *debug) {
+  SDL_Event event;
+  while (SDL_PollEvent(&event)) {
+    if (event.type == SDL_EVENT_QUIT) {
+      *should_run = false;
+    } else if (event.type == SDL_EVENT_KEY_DOWN) {
+      int key = keymap_find(keymap, event.key.key);
+      if (key >= 0) {
+        chip8_set_key(view, key, true);
+      } else if (event.key.key == SDLK_F1) {
+        *debug = !*debug;
+      }
+    } else if (event.type == SDL_EVENT_KEY_UP) {
+      int key = keymap_find(keymap, event.key.key);
+      if (key >= 0) {
+        chip8_set_key(view, key, false);
+      }
+    }
+  }
+}
+
+// Shows the frames of a headless -S host and sends it the keypad, the
+// emulation runs in the host's process. Ends when the window is closed or
+// the host exits.
+bool run_viewer(sdl_t *sdl, const options_t *options) {
+  keymap_t keymap;
+  if (options->keymap_path) {
+    if (!keymap_load(&keymap, options->keymap_path)) {
+      return false;
+    }
+  } else {
+    keymap_from_keys(&keymap, options->pack_keys);
+  }
+
+  chip8_shm_t shm;
+  if (!chip8_shm_attach(&shm, options->attach)) {
+    return false;
+  }
+  printf("viewing %s from %s at %u Hz\n", shm.block->rom, options->attach,
+         shm.block->cpu_hz);
+
+  // Never runs, it only holds the display and keys
+  chip8_t view = {0};
+  chip8_init(&view);
+
+  chip8_shm_frame_t frame;
+  bool should_run = true;
+  bool debug = false;
+  while (should_run && chip8_shm_host_alive(&shm)) {
+    handle_viewer_input(&view, &keymap, &should_run, &debug);
+    chip8_shm_set_keys(&shm, chip8_get_keys(&view));
+
+    if (chip8_shm_read(&shm, &frame)) {
+      show_frame(&view, &frame);
+      draw_screen(&view, sdl, &debug);
+    }
+    // At least 1 ms, above 1000 Hz the timeout would be 0 and spin
+    Sint32 wait_ms = 1000 / options->refresh_hz;
+    SDL_WaitEventTimeout(NULL, wait_ms > 0 ? wait_ms : 1);
+  }
+
+  if (should_run) {
+    printf("%s exited\n", options->attach);
+  }
+  chip8_shm_detach(&shm);
+  return true;
+}
+
+// Runs one movie frame with a fixed cycle count so it replays exactly,
+// returns false when a replay has run out of frames
+bool run_movie_frame(chip8_t *chip8, movie_t *movie, bool replaying) {
+  if (replaying) {
+    uint16_t keys;
+    if (!movie_replay_frame(movie, &keys)) {
+      return false;
+    }
+    chip8_set_keys(chip8, keys);
+  } else {
+    movie_record_frame(movie, chip8_get_keys(chip8));
+  }
+
+  chip8_audio_begin(chip8->audio, movie->cycles_per_frame);
+  chip8_run(chip8, movie->cycles_per_frame);
+  chip8_decrement_timers(chip8);
+  chip8_audio_end(chip8->audio, chip8);
+
+  return true;
 }
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <rom file>\n", argv[0]);
+  options_t options;
+  if (!parse_args(argc, argv, &options)) {
+    usage(argv[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -222,39 +831,204 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
+  if (options.attach) {
+    bool ok = run_viewer(&sdl, &options);
+    cleanup(sdl);
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
   chip8_t chip8 = {0};
   chip8_init(&chip8);
-  if (!chip8_load_rom(&chip8, argv[1])) {
+  if (!load_rom(&chip8, &options) ||
+      !chip8_set_quirks(&chip8, options.quirks >= 0 ? options.quirks
+                                                     : CHIP8_QUIRKS_DEFAULT)) {
     exit(EXIT_FAILURE);
   }
+  if (options.seeded) {
+    chip8_seed(&chip8, options.seed);
+  }
+
+  // A keymap file wins over the pack's keys
+  keymap_t keymap;
+  if (options.keymap_path) {
+    if (!keymap_load(&keymap, options.keymap_path)) {
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    keymap_from_keys(&keymap, options.pack_keys);
+  }
+  latency_t latency = {0};
+
+  chip8_profile_t profile;
+  if (options.profile) {
+    chip8_profile_reset(&profile);
+    chip8.profile = &profile;
+  }
+  if (options.trace) {
+    toggle_trace(&chip8, &options);
+  }
+  if (options.capture) {
+    toggle_capture(&chip8, &options);
+  }
+
+  // Movies store whole cycles per timer tick
+  if (options.record_path && options.cpu_hz % SCHEDULER_TIMER_HZ != 0) {
+    fprintf(stderr, "--record needs a CPU speed that is a multiple of %d Hz\n",
+            SCHEDULER_TIMER_HZ);
+    exit(EXIT_FAILURE);
+  }
+
+  movie_t movie;
+  bool replaying = options.replay_path != NULL;
+  bool in_movie = replaying || options.record_path;
+  if (replaying && !movie_replay_open(&movie, options.replay_path, &chip8)) {
+    exit(EXIT_FAILURE);
+  }
+  if (options.record_path &&
+      !movie_record_open(&movie, options.record_path, &chip8,
+                         options.seeded ? options.seed : time(NULL),
+                         options.cpu_hz / SCHEDULER_TIMER_HZ)) {
+    exit(EXIT_FAILURE);
+  }
+  bool replay_ok = true;
+
+  // Movies set the cycles per timer tick, which the audio clock counts in
+  uint32_t audio_hz = replaying
+                          ? movie.cycles_per_frame * SCHEDULER_TIMER_HZ
+                          : options.cpu_hz;
+  chip8_audio_t audio;
+  chip8_audio_init(&audio, audio_hz);
+  chip8.audio = &audio;
+  open_audio(&sdl, &audio);
 
   bool should_run = true;
   bool debug = false;
+  bool rewinding = false;
 
-  const Uint64 TARGET_FPS = FPS;
-  const Uint64 FRAME_DELAY_NS = 1e9 / TARGET_FPS; // 1ns / FPS
+  // One state per timer tick, allocated up front
+  rewind_t rewind;
+  if (!rewind_init(&rewind, REWIND_ARENA_SIZE, REWIND_SECONDS * 60,
+                   REWIND_KEYFRAME_INTERVAL)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // CPU, timers and display each run on their own clock so a slow present
+  // does not slow down emulated time
+  scheduler_t sched;
+  scheduler_init(&sched, options.cpu_hz, options.refresh_hz,
+                 SCHEDULER_TIMER_HZ * options.slices, SDL_GetTicksNS());
+
+  chip8_idle_t idle = CHIP8_BUSY;
+
+  turbo_t turbo = {0};
+  if (options.turbo) {
+    turbo_set(&turbo, true, &sdl, &audio, audio_hz);
+  }
 
   // Main emulator loop
   while (should_run) {
-    Uint64 frame_start = SDL_GetTicksNS();
+    // Sampled right before the cycles due now, once per slice
+    bool turbo_on = turbo.on;
+    handle_input(&chip8, &options, &keymap,
+                 options.latency ? &latency : NULL, &should_run, &debug,
+                 &rewinding, &turbo_on);
+    if (turbo_on != turbo.on) {
+      turbo_set(&turbo, turbo_on, &sdl, &audio, audio_hz);
+    }
 
-    handle_input(&chip8, &should_run, &debug);
+    // Keeps running in turbo, only its work is ignored
+    scheduler_step_t step;
+    scheduler_advance(&sched, SDL_GetTicksNS(), &step);
 
-    for (int i = 0; i < CYCLES_PER_FRAME; i++) {
-      chip8_cycle(&chip8);
+    if (turbo.on && !rewinding) {
+      // As many whole frames as fit before the next refresh. A wait for a
+      // key ends the burst early so the idle sleep below can take over.
+      uint64_t deadline = SDL_GetTicksNS() + NS_PER_SEC / options.refresh_hz;
+      do {
+        if (in_movie) {
+          if (!run_movie_frame(&chip8, &movie, replaying)) {
+            replay_ok = movie_replay_verify(&movie, &chip8);
+            should_run = false;
+            break;
+          }
+        } else {
+          idle = run_cycles(&chip8, turbo_cycles(&turbo, options.cpu_hz), 1);
+        }
+        turbo.ticks++;
+      } while (SDL_GetTicksNS() < deadline && idle != CHIP8_IDLE_KEY &&
+               idle != CHIP8_IDLE_HALT);
+      // Rewind steps back through what was shown, a state per tick would
+      // cost more than the frames themselves
+      if (!in_movie) {
+        rewind_push(&rewind, &chip8);
+      }
+      step.render = true;
+    } else if (in_movie) {
+      // Movies run whole frames per timer tick and can't be rewound
+      for (uint32_t i = 0; i < step.timer_ticks; i++) {
+        if (!run_movie_frame(&chip8, &movie, replaying)) {
+          replay_ok = movie_replay_verify(&movie, &chip8);
+          should_run = false;
+          break;
+        }
+      }
+    } else if (rewinding) {
+      // Step back one recorded state per timer tick instead of running
+      for (uint32_t i = 0; i < step.timer_ticks; i++) {
+        chip8_audio_begin(&audio, options.cpu_hz / SCHEDULER_TIMER_HZ);
+        rewind_pop(&rewind, &chip8);
+        chip8_audio_end(&audio, &chip8);
+      }
+    } else {
+      idle = run_cycles(&chip8, step.cycles, step.timer_ticks);
+      if (step.timer_ticks > 0) {
+        rewind_push(&rewind, &chip8);
+      }
     }
 
-    chip8_decrement_timers(&chip8);
-
-    draw_screen(&chip8, sdl, &debug);
+    if (step.render) {
+      draw_screen(&chip8, &sdl, &debug);
+      if (options.latency) {
+        latency_presented(&latency, &chip8);
+      }
+    }
+    if (turbo.on) {
+      turbo_measure(&turbo, &sdl, &audio, audio_hz);
+    }
 
-    // Need to target 16ms delay for 60 fps
-    Uint64 frame_time = SDL_GetTicksNS() - frame_start;
-    if (frame_time < FRAME_DELAY_NS) {
-      SDL_DelayNS(FRAME_DELAY_NS - frame_time);
+    // Waiting on a key with the timers stopped and the screen drawn, nothing
+    // can change until an event arrives
+    bool asleep = (idle == CHIP8_IDLE_KEY || idle == CHIP8_IDLE_HALT) &&
+                  !rewinding && !chip8.delay_timer && !chip8.sound_timer &&
+                  !chip8.dirty_rows;
+    if (asleep) {
+      SDL_WaitEventTimeout(NULL, IDLE_WAIT_MS);
+    } else if (!turbo.on || rewinding) {
+      sleep_until_due(&sched);
     }
   }
 
+  if (options.record_path) {
+    movie_record_close(&movie, &chip8);
+  }
+  if (replaying) {
+    movie_replay_close(&movie);
+  }
+
+  if (options.profile) {
+    chip8_profile_dump(&profile, &chip8, stdout);
+  }
+  if (options.latency) {
+    latency_dump(&latency);
+  }
+  if (chip8.trace) {
+    toggle_trace(&chip8, &options);
+  }
+  if (chip8.capture) {
+    toggle_capture(&chip8, &options);
+  }
+
+  rewind_free(&rewind);
   cleanup(sdl);
-  exit(EXIT_SUCCESS);
+  exit(replay_ok ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "rompack.h"
+
+#define MAX_LINE 4096
+
+typedef struct {
+  char *name;
+  uint8_t *data; // size bytes
+  uint32_t size;
+  uint64_t hash;
+  uint32_t cpu_hz;
+  uint8_t quirks;
+  char keys[CHIP8_NUM_KEYS];
+  uint32_t data_offset;
+  uint32_t name_offset;
+} item_t;
+
+static item_t *items;
+static uint32_t count;
+static uint32_t capacity;
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s -o <pack> [-m manifest] [rom files...]\n", prog);
+  fprintf(stderr, "Manifest lines: <rom file> [hz=N] [quirks=profile] "
+                  "[keys=<16 host keys for 0-F>]\n");
+}
+
+// Reads a rom and names it after its file
+static item_t *add_rom(const char *path) {
+  if (count == capacity) {
+    capacity = capacity ? capacity * 2 : 64;
+    items = realloc(items, capacity * sizeof(item_t));
+    if (!items) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return NULL;
+  }
+
+  long size = -1;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    size = ftell(file);
+    rewind(file);
+  }
+  if (size < 0) {
+    perror(path);
+    fclose(file);
+    return NULL;
+  }
+  if (size > CHIP8_MAX_ROM_SIZE) {
+    fprintf(stderr, "%s is larger than %d bytes\n", path, CHIP8_MAX_ROM_SIZE);
+    fclose(file);
+    return NULL;
+  }
+
+  item_t *item = &items[count];
+  memset(item, 0, sizeof(item_t));
+  item->data = malloc(size ? size : 1);
+  if (!item->data) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  item->size = fread(item->data, 1, size, file);
+  bool failed = ferror(file) || item->size != size;
+  fclose(file);
+  if (failed) {
+    fprintf(stderr, "Could not read %s\n", path);
+    free(item->data);
+    return NULL;
+  }
+
+  const char *slash = strrchr(path, '/');
+  item->name = strdup(slash ? slash + 1 : path);
+  item->hash = rom_pack_hash(item->data, item->size);
+  count++;
+  return item;
+}
+
+static bool parse_manifest(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+
+  char line[MAX_LINE];
+  int number = 0;
+  while (fgets(line, sizeof(line), file)) {
+    number++;
+    char *token = strtok(line, " \t\r\n");
+    if (!token || token[0] == '#') {
+      continue;
+    }
+
+    item_t *item = add_rom(token);
+    if (!item) {
+      fclose(file);
+      return false;
+    }
+
+    while ((token = strtok(NULL, " \t\r\n"))) {
+      if (strncmp(token, "hz=", 3) == 0) {
+        item->cpu_hz = strtoul(token + 3, NULL, 10);
+      } else if (strncmp(token, "quirks=", 7) == 0) {
+        int quirks = chip8_quirks_from_name(token + 7);
+        if (quirks < 0) {
+          fprintf(stderr, "%s:%d: unknown quirks %s, use default, cosmac, "
+                          "schip or xochip\n",
+                  path, number, token + 7);
+          fclose(file);
+          return false;
+        }
+        item->quirks = quirks;
+      } else if (strncmp(token, "keys=", 5) == 0 &&
+                 strlen(token + 5) == CHIP8_NUM_KEYS) {
+        memcpy(item->keys, token + 5, CHIP8_NUM_KEYS);
+      } else {
+        fprintf(stderr, "%s:%d: unknown option %s\n", path, number, token);
+        fclose(file);
+        return false;
+      }
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+static int compare_hash(const void *a, const void *b) {
+  const item_t *x = a;
+  const item_t *y = b;
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+static int compare_name(const void *a, const void *b) {
+  return strcmp(items[*(const uint32_t *)a].name,
+                items[*(const uint32_t *)b].name);
+}
+
+static uint8_t *put_le(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    *p++ = value >> (i * 8);
+  }
+  return p;
+}
+
+static bool write_pack(const char *path) {
+  qsort(items, count, sizeof(item_t), compare_hash);
+
+  uint32_t *by_name = malloc((count + 1) * sizeof(uint32_t));
+  if (!by_name) {
+    perror("malloc");
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    by_name[i] = i;
+  }
+  qsort(by_name, count, sizeof(uint32_t), compare_name);
+  for (uint32_t i = 1; i < count; i++) {
+    if (strcmp(items[by_name[i - 1]].name, items[by_name[i]].name) == 0) {
+      fprintf(stderr, "Two roms are named %s\n", items[by_name[i]].name);
+      free(by_name);
+      return false;
+    }
+  }
+
+  uint32_t entries_offset = ROM_PACK_HEADER_SIZE;
+  uint32_t index_offset = entries_offset + count * ROM_PACK_ENTRY_SIZE;
+  uint32_t names_offset = index_offset + count * 4;
+
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    items[i].name_offset = offset;
+    offset += strlen(items[i].name) + 1;
+  }
+
+  // Identical roms sit next to each other in hash order and share their data
+  offset += names_offset;
+  for (uint32_t i = 0; i < count; i++) {
+    item_t *prev = i > 0 ? &items[i - 1] : NULL;
+    if (prev && prev->hash == items[i].hash && prev->size == items[i].size &&
+        memcmp(prev->data, items[i].data, items[i].size) == 0) {
+      items[i].data_offset = prev->data_offset;
+      continue;
+    }
+    items[i].data_offset = offset;
+    offset += items[i].size;
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    free(by_name);
+    return false;
+  }
+
+  uint8_t header[ROM_PACK_HEADER_SIZE];
+  uint8_t *p = header;
+  memcpy(p, "C8PK", 4);
+  p = put_le(p + 4, ROM_PACK_VERSION, 2);
+  p = put_le(p, ROM_PACK_ENTRY_SIZE, 2);
+  p = put_le(p, count, 4);
+  p = put_le(p, entries_offset, 4);
+  p = put_le(p, index_offset, 4);
+  put_le(p, names_offset, 4);
+  fwrite(header, 1, sizeof(header), file);
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t entry[ROM_PACK_ENTRY_SIZE] = {0};
+    p = put_le(entry, items[i].hash, 8);
+    p = put_le(p, items[i].data_offset, 4);
+    p = put_le(p, items[i].size, 4);
+    p = put_le(p, items[i].name_offset, 4);
+    p = put_le(p, items[i].cpu_hz, 4);
+    *p = items[i].quirks;
+    memcpy(entry + 32, items[i].keys, CHIP8_NUM_KEYS);
+    fwrite(entry, 1, sizeof(entry), file);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t index[4];
+    put_le(index, by_name[i], 4);
+    fwrite(index, 1, sizeof(index), file);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    fwrite(items[i].name, 1, strlen(items[i].name) + 1, file);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (i == 0 || items[i].data_offset != items[i - 1].data_offset) {
+      fwrite(items[i].data, 1, items[i].size, file);
+    }
+  }
+
+  free(by_name);
+  bool ok = !ferror(file);
+  if (fclose(file) != 0 || !ok) {
+    perror(path);
+    return false;
+  }
+
+  printf("%u roms, %u bytes\n", count, offset);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const char *out = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:m:")) != -1) {
+    switch (opt) {
+    case 'o':
+      out = optarg;
+      break;
+    case 'm':
+      if (!parse_manifest(optarg)) {
+        exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!out) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (!add_rom(argv[i])) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  exit(write_pack(out) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "movie.h"
+
+#define HEADER_SIZE (4 + 2 + 4 + 4 + 8 + 1)
+#define RUN_SIZE (2 + 4)
+#define FOOTER_SIZE (8 + 8 + 8)
+
+static void put_le(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = value >> (i * 8);
+  }
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)p[i] << (i * 8);
+  }
+  return value;
+}
+
+bool movie_record_open(movie_t *movie, const char *path, chip8_t *chip8,
+                       uint32_t seed, uint32_t cycles_per_frame) {
+  memset(movie, 0, sizeof(movie_t));
+  if (cycles_per_frame == 0) {
+    fprintf(stderr, "A movie needs at least one cycle per frame\n");
+    return false;
+  }
+
+  movie->file = fopen(path, "wb");
+  if (!movie->file) {
+    perror("fopen");
+    return false;
+  }
+
+  chip8_seed(chip8, seed);
+  movie->seed = seed;
+  movie->cycles_per_frame = cycles_per_frame;
+  movie->rom_hash = chip8_ram_hash(chip8);
+
+  uint8_t header[HEADER_SIZE];
+  memcpy(header, "C8MV", 4);
+  put_le(header + 4, MOVIE_VERSION, 2);
+  put_le(header + 6, seed, 4);
+  put_le(header + 10, cycles_per_frame, 4);
+  put_le(header + 14, movie->rom_hash, 8);
+  header[22] = chip8->quirks;
+  fwrite(header, 1, sizeof(header), movie->file);
+
+  return true;
+}
+
+static void write_run(movie_t *movie) {
+  uint8_t run[RUN_SIZE];
+  put_le(run, movie->keys, 2);
+  put_le(run + 2, movie->run, 4);
+  fwrite(run, 1, sizeof(run), movie->file);
+}
+
+void movie_record_frame(movie_t *movie, uint16_t keys) {
+  // Consecutive frames with the same keys share one run
+  if (movie->run > 0 && (keys != movie->keys || movie->run == UINT32_MAX)) {
+    write_run(movie);
+    movie->run = 0;
+  }
+
+  movie->keys = keys;
+  movie->run++;
+  movie->frames++;
+}
+
+bool movie_record_close(movie_t *movie, const chip8_t *chip8) {
+  if (movie->run > 0) {
+    write_run(movie);
+  }
+  movie->keys = 0;
+  movie->run = 0;
+  write_run(movie);
+
+  uint8_t footer[FOOTER_SIZE];
+  put_le(footer, movie->frames, 8);
+  put_le(footer + 8, chip8_display_hash(chip8), 8);
+  put_le(footer + 16, chip8_ram_hash(chip8), 8);
+  fwrite(footer, 1, sizeof(footer), movie->file);
+
+  bool ok = !ferror(movie->file);
+  if (fclose(movie->file) != 0) {
+    ok = false;
+  }
+  movie->file = NULL;
+
+  if (!ok) {
+    fprintf(stderr, "Failed to write movie\n");
+  }
+  return ok;
+}
+
+bool movie_replay_open(movie_t *movie, const char *path, chip8_t *chip8) {
+  memset(movie, 0, sizeof(movie_t));
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("fopen");
+    return false;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  movie->data = size > 0 ? malloc(size) : NULL;
+  if (!movie->data || fread(movie->data, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Failed to read movie %s\n", path);
+    fclose(file);
+    movie_replay_close(movie);
+    return false;
+  }
+  fclose(file);
+  movie->size = size;
+
+  if (movie->size < HEADER_SIZE + RUN_SIZE + FOOTER_SIZE ||
+      memcmp(movie->data, "C8MV", 4) != 0 ||
+      get_le(movie->data + 4, 2) != MOVIE_VERSION ||
+      get_le(movie->data + 10, 4) == 0) {
+    fprintf(stderr, "Not a supported movie file: %s\n", path);
+    movie_replay_close(movie);
+    return false;
+  }
+
+  movie->seed = get_le(movie->data + 6, 4);
+  movie->cycles_per_frame = get_le(movie->data + 10, 4);
+  movie->rom_hash = get_le(movie->data + 14, 8);
+  uint8_t quirks = movie->data[22];
+  movie->pos = HEADER_SIZE;
+
+  const uint8_t *footer = movie->data + movie->size - FOOTER_SIZE;
+  movie->total_frames = get_le(footer, 8);
+  movie->display_hash = get_le(footer + 8, 8);
+  movie->ram_hash = get_le(footer + 16, 8);
+
+  if (movie->rom_hash != chip8_ram_hash(chip8)) {
+    fprintf(stderr, "Movie was recorded with a different rom\n");
+    movie_replay_close(movie);
+    return false;
+  }
+
+  if (!chip8_set_quirks(chip8, quirks)) {
+    movie_replay_close(movie);
+    return false;
+  }
+
+  chip8_seed(chip8, movie->seed);
+  return true;
+}
+
+bool movie_replay_frame(movie_t *movie, uint16_t *keys) {
+  while (movie->run == 0) {
+    if (movie->pos + RUN_SIZE > movie->size - FOOTER_SIZE) {
+      return false;
+    }
+
+    movie->keys = get_le(movie->data + movie->pos, 2);
+    movie->run = get_le(movie->data + movie->pos + 2, 4);
+    movie->pos += RUN_SIZE;
+
+    // End marker
+    if (movie->run == 0) {
+      movie->pos = movie->size;
+      return false;
+    }
+  }
+
+  *keys = movie->keys;
+  movie->run--;
+  movie->frames++;
+  return true;
+}
+
+bool movie_replay_verify(const movie_t *movie, const chip8_t *chip8) {
+  bool ok = movie->frames == movie->total_frames &&
+            chip8_display_hash(chip8) == movie->display_hash &&
+            chip8_ram_hash(chip8) == movie->ram_hash;
+
+  fprintf(stderr, "Replay %s after %llu of %llu frames\n",
+          ok ? "matches" : "DIVERGED", (unsigned long long)movie->frames,
+          (unsigned long long)movie->total_frames);
+  return ok;
+}
+
+void movie_replay_close(movie_t *movie) {
+  free(movie->data);
+  movie->data = NULL;
+}
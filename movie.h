@@ -0,0 +1,57 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Movie file, all values little-endian:
+//   "C8MV", u16 version, u32 seed, u32 cycles per frame, u64 rom hash,
+//   u8 quirks profile
+//   runs of (u16 keypad mask, u32 frames), ended by a run of 0 frames
+//   u64 frames, u64 display hash, u64 ram hash of the final state
+// A frame is: set the keypad, run cycles per frame cycles, tick the timers.
+#define MOVIE_VERSION 3
+
+typedef struct {
+  FILE *file;
+
+  uint32_t seed;
+  uint32_t cycles_per_frame;
+  uint64_t rom_hash;
+  uint64_t frames;
+
+  // Keypad mask of the current run and how many frames are left in it
+  uint16_t keys;
+  uint32_t run;
+
+  // Final state written by the recorder, checked after a replay
+  uint64_t total_frames;
+  uint64_t display_hash;
+  uint64_t ram_hash;
+
+  // Replay reads the whole file up front
+  uint8_t *data;
+  size_t size;
+  size_t pos;
+} movie_t;
+
+// chip8 must have the rom loaded and not have run yet, it is seeded with seed.
+// False when cycles_per_frame is 0 or the file can not be created
+bool movie_record_open(movie_t *movie, const char *path, chip8_t *chip8,
+                       uint32_t seed, uint32_t cycles_per_frame);
+void movie_record_frame(movie_t *movie, uint16_t keys);
+bool movie_record_close(movie_t *movie, const chip8_t *chip8);
+
+// Seeds chip8 and sets its quirks from the movie, checks that the same rom
+// is loaded
+bool movie_replay_open(movie_t *movie, const char *path, chip8_t *chip8);
+// Returns false once every recorded frame was replayed
+bool movie_replay_frame(movie_t *movie, uint16_t *keys);
+// Compares the final state with the recording
+bool movie_replay_verify(const movie_t *movie, const chip8_t *chip8);
+void movie_replay_close(movie_t *movie);
+
+#endif
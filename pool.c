@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// Machines a worker claims at once, small enough to balance the tail
+#define CHUNK 8
+
+typedef struct {
+  // Next unclaimed machine of this worker's range, also used by thieves
+  _Atomic size_t next;
+  size_t end;
+  // Keep counters of different workers on separate cache lines
+  char pad[64 - sizeof(size_t) * 2];
+} range_t;
+
+typedef struct {
+  chip8_pool_t *pool;
+  range_t *ranges;
+  int index;
+  uint64_t frames;
+  uint32_t cycles_per_frame;
+  uint64_t steals;
+} worker_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run_machine(chip8_t *chip8, uint64_t frames,
+                        uint32_t cycles_per_frame) {
+  for (uint64_t frame = 0; frame < frames; frame++) {
+    chip8_run(chip8, cycles_per_frame);
+    chip8_decrement_timers(chip8);
+  }
+}
+
+// Claims up to CHUNK machines from range, returns how many
+static size_t claim(range_t *range, size_t *first) {
+  size_t start = atomic_fetch_add(&range->next, CHUNK);
+  if (start >= range->end) {
+    return 0;
+  }
+
+  *first = start;
+  return start + CHUNK > range->end ? range->end - start : CHUNK;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *worker = arg;
+  chip8_pool_t *pool = worker->pool;
+
+  // Own range first, then walk the others
+  for (int i = 0; i < pool->threads; i++) {
+    int victim = (worker->index + i) % pool->threads;
+    size_t first;
+    size_t count;
+
+    while ((count = claim(&worker->ranges[victim], &first)) > 0) {
+      for (size_t m = first; m < first + count; m++) {
+        run_machine(&pool->machines[m], worker->frames,
+                    worker->cycles_per_frame);
+      }
+      if (victim != worker->index) {
+        worker->steals += count;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+bool chip8_pool_init(chip8_pool_t *pool, size_t count, int threads,
+                     const chip8_t *prototype, uint32_t seed) {
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads <= 0) {
+    threads = 1;
+  }
+
+  pool->machines = malloc(count * sizeof(chip8_t));
+  if (!pool->machines) {
+    perror("malloc");
+    return false;
+  }
+  pool->count = count;
+  pool->threads = threads;
+
+  for (size_t i = 0; i < count; i++) {
+    memcpy(&pool->machines[i], prototype, sizeof(chip8_t));
+    chip8_seed(&pool->machines[i], seed + i);
+    // Profilers, tracers, the audio queue and the capture are not thread
+    // safe, they stay with the prototype
+    pool->machines[i].profile = NULL;
+    pool->machines[i].trace = NULL;
+    pool->machines[i].audio = NULL;
+    pool->machines[i].capture = NULL;
+  }
+
+  return true;
+}
+
+void chip8_pool_free(chip8_pool_t *pool) {
+  free(pool->machines);
+  pool->machines = NULL;
+  pool->count = 0;
+}
+
+bool chip8_pool_run(chip8_pool_t *pool, uint64_t frames,
+                    uint32_t cycles_per_frame, chip8_pool_stats_t *stats) {
+  int threads = pool->threads;
+  range_t *ranges = calloc(threads, sizeof(range_t));
+  worker_t *workers = calloc(threads, sizeof(worker_t));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  if (!ranges || !workers || !tids) {
+    perror("calloc");
+    free(ranges);
+    free(workers);
+    free(tids);
+    return false;
+  }
+
+  // Split machines evenly, the first ranges take the remainder
+  size_t per_thread = pool->count / threads;
+  size_t remainder = pool->count % threads;
+  size_t start = 0;
+  for (int i = 0; i < threads; i++) {
+    size_t len = per_thread + ((size_t)i < remainder);
+    atomic_init(&ranges[i].next, start);
+    ranges[i].end = start + len;
+    start += len;
+
+    workers[i] = (worker_t){
+        .pool = pool,
+        .ranges = ranges,
+        .index = i,
+        .frames = frames,
+        .cycles_per_frame = cycles_per_frame,
+    };
+  }
+
+  uint64_t begin = now_ns();
+
+  // The calling thread works as worker 0
+  int started = 1;
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&tids[i], NULL, worker_main, &workers[i]) != 0) {
+      break;
+    }
+    started++;
+  }
+  worker_main(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  uint64_t elapsed = now_ns() - begin;
+
+  if (stats) {
+    stats->instructions = pool->count * frames * cycles_per_frame;
+    stats->elapsed_ns = elapsed;
+    stats->instructions_per_sec =
+        elapsed ? stats->instructions / (elapsed / 1e9) : 0.0;
+    stats->steals = 0;
+    for (int i = 0; i < threads; i++) {
+      stats->steals += workers[i].steals;
+    }
+  }
+
+  free(ranges);
+  free(workers);
+  free(tids);
+  return true;
+}
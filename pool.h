@@ -0,0 +1,37 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Many independent machines run across worker threads. Each worker owns a
+// contiguous range of machines and steals from the other ranges once its own
+// is finished.
+typedef struct {
+  chip8_t *machines;
+  size_t count;
+  int threads;
+} chip8_pool_t;
+
+typedef struct {
+  uint64_t instructions; // Emulated cycles, with those skipped when idle
+  uint64_t elapsed_ns;
+  double instructions_per_sec;
+  uint64_t steals; // Machines run by a worker other than their owner
+} chip8_pool_stats_t;
+
+// Every machine starts as a copy of prototype, seeded with seed + its index.
+// threads <= 0 uses one thread per online core.
+bool chip8_pool_init(chip8_pool_t *pool, size_t count, int threads,
+                     const chip8_t *prototype, uint32_t seed);
+void chip8_pool_free(chip8_pool_t *pool);
+// Runs every machine for frames frames of cycles_per_frame instructions
+// followed by a timer tick, stats may be NULL. False, having run nothing,
+// when the workers can not be allocated
+bool chip8_pool_run(chip8_pool_t *pool, uint64_t frames,
+                    uint32_t cycles_per_frame, chip8_pool_stats_t *stats);
+
+#endif
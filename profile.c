@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+static const char *op_names[CHIP8_PROFILE_OPS] = {
+    [CHIP8_OP_NONE] = "NONE",       [CHIP8_OP_0NNN] = "0NNN",
+    [CHIP8_OP_00E0] = "00E0",       [CHIP8_OP_00EE] = "00EE",
+    [CHIP8_OP_1NNN] = "1NNN",       [CHIP8_OP_2NNN] = "2NNN",
+    [CHIP8_OP_3XNN] = "3XNN",       [CHIP8_OP_4XNN] = "4XNN",
+    [CHIP8_OP_5XY0] = "5XY0",       [CHIP8_OP_6XNN] = "6XNN",
+    [CHIP8_OP_7XNN] = "7XNN",       [CHIP8_OP_8XY0] = "8XY0",
+    [CHIP8_OP_8XY1] = "8XY1",       [CHIP8_OP_8XY2] = "8XY2",
+    [CHIP8_OP_8XY3] = "8XY3",       [CHIP8_OP_8XY4] = "8XY4",
+    [CHIP8_OP_8XY5] = "8XY5",       [CHIP8_OP_8XY6] = "8XY6",
+    [CHIP8_OP_8XY7] = "8XY7",       [CHIP8_OP_8XYE] = "8XYE",
+    [CHIP8_OP_9XY0] = "9XY0",       [CHIP8_OP_ANNN] = "ANNN",
+    [CHIP8_OP_BNNN] = "BNNN",       [CHIP8_OP_CXNN] = "CXNN",
+    [CHIP8_OP_DXYN] = "DXYN",       [CHIP8_OP_EX9E] = "EX9E",
+    [CHIP8_OP_EXA1] = "EXA1",       [CHIP8_OP_FX07] = "FX07",
+    [CHIP8_OP_FX0A] = "FX0A",       [CHIP8_OP_FX15] = "FX15",
+    [CHIP8_OP_FX18] = "FX18",       [CHIP8_OP_FX1E] = "FX1E",
+    [CHIP8_OP_FX29] = "FX29",       [CHIP8_OP_FX33] = "FX33",
+    [CHIP8_OP_FX55] = "FX55",       [CHIP8_OP_FX65] = "FX65",
+    [CHIP8_OP_00CN] = "00CN",       [CHIP8_OP_00FB] = "00FB",
+    [CHIP8_OP_00FC] = "00FC",       [CHIP8_OP_00FD] = "00FD",
+    [CHIP8_OP_00FE] = "00FE",       [CHIP8_OP_00FF] = "00FF",
+    [CHIP8_OP_FX30] = "FX30",       [CHIP8_OP_FX75] = "FX75",
+    [CHIP8_OP_FX85] = "FX85",       [CHIP8_OP_00DN] = "00DN",
+    [CHIP8_OP_5XY2] = "5XY2",       [CHIP8_OP_5XY3] = "5XY3",
+    [CHIP8_OP_F000] = "F000",       [CHIP8_OP_FN01] = "FN01",
+    [CHIP8_OP_F002] = "F002",       [CHIP8_OP_FX3A] = "FX3A",
+    [CHIP8_OP_UNKNOWN] = "unknown",
+};
+
+void chip8_profile_reset(chip8_profile_t *profile) {
+  memset(profile, 0, sizeof(chip8_profile_t));
+  profile->poll_pc = -1;
+}
+
+void chip8_profile_step(chip8_profile_t *profile, const chip8_t *chip8,
+                        uint16_t pc, const chip8_instr_t *instr) {
+  profile->cycles++;
+  profile->op_counts[instr->op]++;
+  profile->pc_counts[pc]++;
+
+  if (instr->op == CHIP8_OP_FX0A && chip8_get_keys(chip8) == 0) {
+    profile->key_wait_cycles++;
+  }
+
+  // A read of a running delay timer starts a polling loop, typically
+  // FX07, a skip on VX and a jump back. It ends once execution leaves the
+  // few instructions after the read.
+  if (instr->op == CHIP8_OP_FX07 && chip8->delay_timer) {
+    profile->poll_pc = pc;
+  } else if (profile->poll_pc >= 0 &&
+             (pc < profile->poll_pc ||
+              pc >= profile->poll_pc + CHIP8_PROFILE_POLL_WINDOW)) {
+    profile->poll_pc = -1;
+  }
+
+  if (profile->poll_pc >= 0) {
+    profile->timer_poll_cycles++;
+  }
+}
+
+// An opcode slot or address with its count, sorted without shared state
+typedef struct {
+  uint64_t count;
+  int index;
+} ranked_t;
+
+static int compare_ranked(const void *a, const void *b) {
+  uint64_t x = ((const ranked_t *)a)->count;
+  uint64_t y = ((const ranked_t *)b)->count;
+  return (x < y) - (x > y);
+}
+
+// The n highest counts, most executed first, n at most CHIP8_PROFILE_HOT_PCS
+static int hottest(const uint64_t *counts, int size, ranked_t *top, int n) {
+  int found = 0;
+  for (int i = 0; i < size; i++) {
+    if (!counts[i] || (found == n && counts[i] <= top[n - 1].count)) {
+      continue;
+    }
+
+    // Insertion into the short sorted list, the lowest falls off the end
+    int at = found < n ? found++ : n - 1;
+    for (; at > 0 && top[at - 1].count < counts[i]; at--) {
+      top[at] = top[at - 1];
+    }
+    top[at] = (ranked_t){counts[i], i};
+  }
+  return found;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? part * 100.0 / total : 0.0;
+}
+
+void chip8_profile_dump(const chip8_profile_t *profile, const chip8_t *chip8,
+                        FILE *out) {
+  uint64_t total = profile->cycles;
+  uint64_t waiting = profile->key_wait_cycles + profile->timer_poll_cycles;
+
+  fprintf(out, "cycles: %llu\n", (unsigned long long)total);
+  fprintf(out, "  key wait:   %12llu %6.2f%%\n",
+          (unsigned long long)profile->key_wait_cycles,
+          percent(profile->key_wait_cycles, total));
+  fprintf(out, "  timer poll: %12llu %6.2f%%\n",
+          (unsigned long long)profile->timer_poll_cycles,
+          percent(profile->timer_poll_cycles, total));
+  fprintf(out, "  busy:       %12llu %6.2f%%\n",
+          (unsigned long long)(total - waiting),
+          percent(total - waiting, total));
+
+  ranked_t ops[CHIP8_PROFILE_OPS];
+  for (int i = 0; i < CHIP8_PROFILE_OPS; i++) {
+    ops[i] = (ranked_t){profile->op_counts[i], i};
+  }
+  qsort(ops, CHIP8_PROFILE_OPS, sizeof(ranked_t), compare_ranked);
+
+  fprintf(out, "opcodes:\n");
+  for (int i = 0; i < CHIP8_PROFILE_OPS && ops[i].count; i++) {
+    fprintf(out, "  %-7s %12llu %6.2f%%\n", op_names[ops[i].index],
+            (unsigned long long)ops[i].count, percent(ops[i].count, total));
+  }
+
+  // Only the top few are listed, no need to sort all of memory
+  ranked_t pcs[CHIP8_PROFILE_HOT_PCS];
+  int hot = hottest(profile->pc_counts, CHIP8_MEMORY_SIZE, pcs,
+                    CHIP8_PROFILE_HOT_PCS);
+
+  fprintf(out, "hot addresses:\n");
+  for (int i = 0; i < hot; i++) {
+    int pc = pcs[i].index;
+    uint16_t opcode = (chip8->ram[pc] << 8) |
+                      chip8->ram[(pc + 1) & (CHIP8_MEMORY_SIZE - 1)];
+    fprintf(out, "  %03x %04x %12llu %6.2f%%\n", pc, opcode,
+            (unsigned long long)pcs[i].count, percent(pcs[i].count, total));
+  }
+}
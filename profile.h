@@ -0,0 +1,38 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+#define CHIP8_PROFILE_OPS (CHIP8_OP_UNKNOWN + 1)
+// Bytes past a polling FX07 that still count as its loop
+#define CHIP8_PROFILE_POLL_WINDOW 8
+#define CHIP8_PROFILE_HOT_PCS 16 // Addresses listed by chip8_profile_dump
+
+// Counting profiler, attach with chip8->profile = &profile. While attached
+// chip8_cycle counts every instruction it executes, the JIT then interprets
+// so nothing is missed.
+typedef struct chip8_profile {
+  uint64_t cycles;
+  uint64_t op_counts[CHIP8_PROFILE_OPS]; // Indexed by CHIP8_OP_*
+  uint64_t pc_counts[CHIP8_MEMORY_SIZE];
+
+  // Cycles spent waiting instead of computing
+  uint64_t key_wait_cycles;   // FX0A with no key down
+  uint64_t timer_poll_cycles; // Loops reading a running delay timer
+
+  // Start of the delay timer polling loop being executed, or -1
+  int32_t poll_pc;
+} chip8_profile_t;
+
+void chip8_profile_reset(chip8_profile_t *profile);
+// Called by chip8_cycle before instr at pc executes
+void chip8_profile_step(chip8_profile_t *profile, const chip8_t *chip8,
+                        uint16_t pc, const chip8_instr_t *instr);
+// Prints the totals, per opcode counts and the hottest addresses
+void chip8_profile_dump(const chip8_profile_t *profile, const chip8_t *chip8,
+                        FILE *out);
+
+#endif
@@ -0,0 +1,50 @@
+#include <string.h>
+
+#include "render.h"
+
+// Indexed by plane 1 bit | plane 2 bit << 1
+#define COLOR(index)                                                           \
+  ((index) == 3   ? RENDER_COLOR_BOTH                                          \
+   : (index) == 2 ? RENDER_COLOR_PLANE2                                        \
+   : (index) == 1 ? RENDER_COLOR_ON                                            \
+                  : RENDER_COLOR_OFF)
+// Pixel x of a quad, plane 1 bits in the high nibble of key
+#define PIXEL(key, x)                                                          \
+  COLOR((((key) >> (7 - (x))) & 1) | (((key) >> (3 - (x))) & 1) << 1)
+#define QUAD(key) {PIXEL(key, 0), PIXEL(key, 1), PIXEL(key, 2), PIXEL(key, 3)}
+#define QUADS4(key) QUAD(key), QUAD(key + 1), QUAD(key + 2), QUAD(key + 3)
+#define QUADS16(key)                                                           \
+  QUADS4(key), QUADS4(key + 4), QUADS4(key + 8), QUADS4(key + 12)
+#define QUADS64(key)                                                           \
+  QUADS16(key), QUADS16(key + 16), QUADS16(key + 32), QUADS16(key + 48)
+
+// Four pixels at a time, indexed by a plane 1 nibble << 4 | plane 2 nibble.
+// Built at compile time so rendering touches no shared mutable state.
+static const uint32_t quads[256][4] = {
+    QUADS64(0),
+    QUADS64(64),
+    QUADS64(128),
+    QUADS64(192),
+};
+
+void render_rows(const chip8_t *chip8, uint32_t *pixels, int pitch,
+                 int first_row, int rows) {
+  const int words = chip8_screen_width(chip8) / 64;
+
+  for (int row = 0; row < rows; row++) {
+    uint32_t *line = (uint32_t *)((uint8_t *)pixels + row * pitch);
+
+    for (int word = 0; word < words; word++) {
+      uint64_t plane1 = chip8->display[0][first_row + row][word];
+      uint64_t plane2 = chip8->display[1][first_row + row][word];
+      uint32_t *out = &line[word * 64];
+
+      // Most significant bit is the leftmost pixel
+      for (int x = 0; x < 64; x += 4) {
+        int key =
+            ((plane1 >> (60 - x)) & 0xF) << 4 | ((plane2 >> (60 - x)) & 0xF);
+        memcpy(&out[x], quads[key], sizeof(quads[key]));
+      }
+    }
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define RENDER_COLOR_ON 0xFFFFFFFF     // ARGB white, plane 1
+#define RENDER_COLOR_OFF 0xFF000000    // ARGB black
+#define RENDER_COLOR_PLANE2 0xFF55AAFF // ARGB light blue, XO-CHIP plane 2
+#define RENDER_COLOR_BOTH 0xFF2255AA   // ARGB dark blue, both planes
+
+// Expands display rows [first_row, first_row + rows) into 32-bit ARGB
+// pixels starting at first_row, pitch is the length of a pixel row in bytes.
+// Rows are chip8_screen_width pixels wide.
+void render_rows(const chip8_t *chip8, uint32_t *pixels, int pitch,
+                 int first_row, int rows);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+// Delta encoding is a sequence of (zero run, literal length, literals) with
+// both lengths stored as LEB128 varints. Literal runs only end before at
+// least 4 equal bytes, which bounds the number of runs.
+#define VARINT_MAX 5
+#define DELTA_MAX_SIZE                                                         \
+  (CHIP8_STATE_SIZE + 2 * VARINT_MAX * (CHIP8_STATE_SIZE / 4 + 1))
+
+static rewind_frame_t *frame_at(const rewind_t *rw, uint64_t seq) {
+  return &rw->frames[seq % rw->max_frames];
+}
+
+bool rewind_init(rewind_t *rw, size_t arena_size, size_t max_frames,
+                 uint32_t keyframe_interval) {
+  memset(rw, 0, sizeof(rewind_t));
+
+  rw->arena = malloc(arena_size);
+  rw->frames = calloc(max_frames, sizeof(rewind_frame_t));
+  rw->delta = malloc(DELTA_MAX_SIZE);
+  if (!rw->arena || !rw->frames || !rw->delta) {
+    perror("malloc");
+    rewind_free(rw);
+    return false;
+  }
+
+  rw->arena_size = arena_size;
+  rw->max_frames = max_frames;
+  rw->keyframe_interval = keyframe_interval;
+  return true;
+}
+
+void rewind_free(rewind_t *rw) {
+  free(rw->arena);
+  free(rw->frames);
+  free(rw->delta);
+  rw->arena = NULL;
+  rw->frames = NULL;
+  rw->delta = NULL;
+}
+
+size_t rewind_count(const rewind_t *rw) { return rw->next_seq - rw->first_seq; }
+
+static size_t put_varint(uint8_t *p, uint32_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    p[len++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  p[len++] = value;
+  return len;
+}
+
+static uint32_t get_varint(const uint8_t **p) {
+  uint32_t value = 0;
+  int shift = 0;
+  while (**p & 0x80) {
+    value |= (uint32_t)(*(*p)++ & 0x7F) << shift;
+    shift += 7;
+  }
+  return value | (uint32_t)(*(*p)++) << shift;
+}
+
+static size_t encode_delta(uint8_t *out, const uint8_t *key,
+                           const uint8_t *state) {
+  size_t len = 0;
+  size_t i = 0;
+
+  while (i < CHIP8_STATE_SIZE) {
+    size_t zeros = i;
+    while (i < CHIP8_STATE_SIZE && key[i] == state[i]) {
+      i++;
+    }
+    zeros = i - zeros;
+
+    // Short zero runs stay in the literal, a new run header costs more
+    size_t literals = i;
+    while (i < CHIP8_STATE_SIZE &&
+           (key[i] != state[i] ||
+            (i + 4 < CHIP8_STATE_SIZE && memcmp(&key[i], &state[i], 4) != 0))) {
+      i++;
+    }
+    literals = i - literals;
+
+    len += put_varint(&out[len], zeros);
+    len += put_varint(&out[len], literals);
+    for (size_t j = 0; j < literals; j++) {
+      size_t at = i - literals + j;
+      out[len++] = key[at] ^ state[at];
+    }
+  }
+
+  return len;
+}
+
+static void decode_delta(uint8_t *state, const uint8_t *key,
+                         const uint8_t *delta, size_t size) {
+  memcpy(state, key, CHIP8_STATE_SIZE);
+
+  size_t i = 0;
+  const uint8_t *p = delta;
+  while (p < delta + size) {
+    i += get_varint(&p);
+    uint32_t literals = get_varint(&p);
+    for (uint32_t j = 0; j < literals; j++) {
+      state[i++] ^= *p++;
+    }
+  }
+}
+
+// Finds a contiguous free region of need bytes in the arena
+static bool find_space(const rewind_t *rw, size_t need, size_t *offset) {
+  if (rewind_count(rw) == 0) {
+    *offset = 0;
+    return need <= rw->arena_size;
+  }
+
+  size_t tail = frame_at(rw, rw->first_seq)->offset;
+  if (rw->head > tail) {
+    // Used region is [tail, head), try the end then wrap to the start
+    if (rw->arena_size - rw->head >= need) {
+      *offset = rw->head;
+      return true;
+    }
+    if (tail >= need) {
+      *offset = 0;
+      return true;
+    }
+    return false;
+  }
+
+  // Used region wraps around, free space is [head, tail)
+  if (tail - rw->head >= need) {
+    *offset = rw->head;
+    return true;
+  }
+  return false;
+}
+
+// Drops the oldest keyframe together with the deltas that depend on it
+static void evict_oldest(rewind_t *rw) {
+  do {
+    rw->first_seq++;
+  } while (rw->first_seq < rw->next_seq &&
+           frame_at(rw, rw->first_seq)->key_seq != rw->first_seq);
+}
+
+bool rewind_push(rewind_t *rw, const chip8_t *chip8) {
+  chip8_snapshot(chip8, &rw->current);
+
+  bool is_key = true;
+  uint64_t key_seq = rw->next_seq;
+  if (rewind_count(rw) > 0) {
+    uint64_t newest_key = frame_at(rw, rw->next_seq - 1)->key_seq;
+    is_key = rw->next_seq - newest_key >= rw->keyframe_interval;
+    if (!is_key) {
+      key_seq = newest_key;
+    }
+  }
+
+  const uint8_t *data = rw->current.data;
+  size_t size = CHIP8_STATE_SIZE;
+  if (!is_key) {
+    const rewind_frame_t *key = frame_at(rw, key_seq);
+    size = encode_delta(rw->delta, &rw->arena[key->offset], data);
+    data = rw->delta;
+
+    // Not worth it when the state changed almost completely
+    if (size >= CHIP8_STATE_SIZE) {
+      is_key = true;
+      key_seq = rw->next_seq;
+      data = rw->current.data;
+      size = CHIP8_STATE_SIZE;
+    }
+  }
+
+  // The frame ring is full, or the oldest frames have to make room
+  size_t offset;
+  while (rewind_count(rw) == rw->max_frames ||
+         !find_space(rw, size, &offset)) {
+    if (rewind_count(rw) == 0) {
+      return false;
+    }
+    evict_oldest(rw);
+
+    // The keyframe this delta refers to is gone, store a keyframe instead
+    if (!is_key && rw->first_seq > key_seq) {
+      is_key = true;
+      key_seq = rw->next_seq;
+      data = rw->current.data;
+      size = CHIP8_STATE_SIZE;
+    }
+  }
+
+  memcpy(&rw->arena[offset], data, size);
+  rewind_frame_t *frame = frame_at(rw, rw->next_seq);
+  frame->offset = offset;
+  frame->size = size;
+  frame->key_seq = key_seq;
+
+  rw->head = offset + size;
+  rw->next_seq++;
+  return true;
+}
+
+bool rewind_pop(rewind_t *rw, chip8_t *chip8) {
+  if (rewind_count(rw) == 0) {
+    return false;
+  }
+
+  uint64_t seq = rw->next_seq - 1;
+  const rewind_frame_t *frame = frame_at(rw, seq);
+
+  // Deltas only depend on their keyframe so one decode is enough
+  if (frame->key_seq == seq) {
+    memcpy(rw->current.data, &rw->arena[frame->offset], CHIP8_STATE_SIZE);
+  } else {
+    const rewind_frame_t *key = frame_at(rw, frame->key_seq);
+    decode_delta(rw->current.data, &rw->arena[key->offset],
+                 &rw->arena[frame->offset], frame->size);
+  }
+
+  chip8_restore(chip8, &rw->current);
+
+  rw->head = frame->offset;
+  rw->next_seq--;
+  if (rewind_count(rw) == 0) {
+    rw->first_seq = rw->next_seq = 0;
+    rw->head = 0;
+  }
+  return true;
+}
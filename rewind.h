@@ -0,0 +1,46 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// One stored frame, either a full snapshot or a delta against key_seq
+typedef struct {
+  size_t offset; // Into the arena
+  uint32_t size;
+  uint64_t key_seq; // Sequence number of the keyframe, own seq for keyframes
+} rewind_frame_t;
+
+// History of machine states in a fixed-size ring arena. Every
+// keyframe_interval frames a full snapshot is stored, the frames in between
+// are stored XOR'd against it with runs of zeros compressed away.
+// Nothing is allocated after rewind_init.
+typedef struct {
+  uint8_t *arena;
+  size_t arena_size;
+  size_t head; // Where the next frame is written
+
+  rewind_frame_t *frames; // Ring indexed by seq % max_frames
+  size_t max_frames;
+  uint64_t first_seq; // Oldest stored frame
+  uint64_t next_seq;  // One past the newest stored frame
+  uint32_t keyframe_interval;
+
+  // Scratch space for encoding and decoding
+  chip8_snapshot_t current;
+  uint8_t *delta;
+} rewind_t;
+
+bool rewind_init(rewind_t *rw, size_t arena_size, size_t max_frames,
+                 uint32_t keyframe_interval);
+void rewind_free(rewind_t *rw);
+// Records the current state, evicting the oldest frames when full
+bool rewind_push(rewind_t *rw, const chip8_t *chip8);
+// Restores the newest recorded state and drops it, false when empty
+bool rewind_pop(rewind_t *rw, chip8_t *chip8);
+size_t rewind_count(const rewind_t *rw);
+
+#endif
@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rompack.h"
+
+static uint64_t get_le(const uint8_t *p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)p[i] << (i * 8);
+  }
+  return value;
+}
+
+static const uint8_t *entry_at(const rom_pack_t *pack, uint32_t index) {
+  return pack->entries + (size_t)index * ROM_PACK_ENTRY_SIZE;
+}
+
+static const char *entry_name(const rom_pack_t *pack, const uint8_t *entry) {
+  return pack->names + get_le(entry + 16, 4);
+}
+
+// Every offset in the pack must stay inside the mapping
+static bool check_pack(const rom_pack_t *pack, uint64_t entries_offset,
+                       uint64_t index_offset, uint64_t names_offset) {
+  size_t size = pack->map_size;
+  if (entries_offset + (uint64_t)pack->count * ROM_PACK_ENTRY_SIZE > size ||
+      index_offset + (uint64_t)pack->count * 4 > size ||
+      names_offset > size) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < pack->count; i++) {
+    const uint8_t *entry = entry_at(pack, i);
+    uint64_t data = get_le(entry + 8, 4);
+    uint64_t len = get_le(entry + 12, 4);
+    uint64_t name = names_offset + get_le(entry + 16, 4);
+
+    if (data + len > size || len > CHIP8_MAX_ROM_SIZE || name >= size ||
+        !memchr(pack->map + name, '\0', size - name) ||
+        get_le(pack->name_index + i * 4, 4) >= pack->count) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool rom_pack_open(rom_pack_t *pack, const char *path) {
+  memset(pack, 0, sizeof(rom_pack_t));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    close(fd);
+    return false;
+  }
+  if (st.st_size < ROM_PACK_HEADER_SIZE) {
+    fprintf(stderr, "Not a rom pack: %s\n", path);
+    close(fd);
+    return false;
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  pack->map = map;
+  pack->map_size = st.st_size;
+
+  const uint8_t *header = pack->map;
+  if (memcmp(header, "C8PK", 4) != 0 ||
+      get_le(header + 4, 2) != ROM_PACK_VERSION ||
+      get_le(header + 6, 2) != ROM_PACK_ENTRY_SIZE) {
+    fprintf(stderr, "Not a rom pack or unsupported version: %s\n", path);
+    rom_pack_close(pack);
+    return false;
+  }
+
+  pack->count = get_le(header + 8, 4);
+  uint32_t entries_offset = get_le(header + 12, 4);
+  uint32_t index_offset = get_le(header + 16, 4);
+  uint32_t names_offset = get_le(header + 20, 4);
+  pack->entries = pack->map + entries_offset;
+  pack->name_index = pack->map + index_offset;
+  pack->names = (const char *)pack->map + names_offset;
+
+  if (!check_pack(pack, entries_offset, index_offset, names_offset)) {
+    fprintf(stderr, "Corrupt rom pack: %s\n", path);
+    rom_pack_close(pack);
+    return false;
+  }
+
+  return true;
+}
+
+void rom_pack_close(rom_pack_t *pack) {
+  if (pack->map) {
+    munmap((void *)pack->map, pack->map_size);
+  }
+  memset(pack, 0, sizeof(rom_pack_t));
+}
+
+void rom_pack_get(const rom_pack_t *pack, uint32_t index, rom_info_t *info) {
+  const uint8_t *entry = entry_at(pack, index);
+
+  info->hash = get_le(entry, 8);
+  info->data = pack->map + get_le(entry + 8, 4);
+  info->size = get_le(entry + 12, 4);
+  info->name = entry_name(pack, entry);
+  info->cpu_hz = get_le(entry + 20, 4);
+  info->quirks = entry[24];
+  memcpy(info->keys, entry + 32, CHIP8_NUM_KEYS);
+}
+
+bool rom_pack_find_hash(const rom_pack_t *pack, uint64_t hash,
+                        rom_info_t *info) {
+  uint32_t low = 0;
+  uint32_t high = pack->count;
+
+  // First entry with an equal or greater hash
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (get_le(entry_at(pack, mid), 8) < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low == pack->count || get_le(entry_at(pack, low), 8) != hash) {
+    return false;
+  }
+
+  rom_pack_get(pack, low, info);
+  return true;
+}
+
+bool rom_pack_find_name(const rom_pack_t *pack, const char *name,
+                        rom_info_t *info) {
+  uint32_t low = 0;
+  uint32_t high = pack->count;
+
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    uint32_t index = get_le(pack->name_index + mid * 4, 4);
+    int order = strcmp(entry_name(pack, entry_at(pack, index)), name);
+
+    if (order == 0) {
+      rom_pack_get(pack, index, info);
+      return true;
+    }
+    if (order < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return false;
+}
+
+uint64_t rom_pack_hash(const uint8_t *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ull;
+  }
+
+  return hash;
+}
@@ -0,0 +1,55 @@
+#ifndef ROMPACK_H
+#define ROMPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Rom pack file, all values little-endian:
+//   header: "C8PK", u16 version, u16 entry size, u32 count,
+//           u32 entries offset, u32 name index offset, u32 names offset
+//   entries sorted by hash, ROM_PACK_ENTRY_SIZE bytes each:
+//     u64 hash, u32 data offset, u32 size, u32 name offset, u32 cpu hz,
+//     u8 quirks, 7 reserved bytes, 16 host keys for chip8 keys 0-F
+//   name index: u32 entry number per entry, sorted by name
+//   names: NUL terminated, then the rom data
+// A cpu hz, quirks or key of 0 means the frontend default.
+#define ROM_PACK_VERSION 1
+#define ROM_PACK_HEADER_SIZE 24
+#define ROM_PACK_ENTRY_SIZE 48
+
+typedef struct {
+  uint64_t hash; // rom_pack_hash of the data
+  const char *name;
+  const uint8_t *data; // Points into the mapped pack
+  uint32_t size;
+  uint32_t cpu_hz;
+  uint8_t quirks;
+  char keys[CHIP8_NUM_KEYS];
+} rom_info_t;
+
+typedef struct {
+  const uint8_t *map;
+  size_t map_size;
+  uint32_t count;
+  const uint8_t *entries;
+  const uint8_t *name_index;
+  const char *names;
+} rom_pack_t;
+
+// Maps the pack read-only and checks every entry, so lookups can trust it
+bool rom_pack_open(rom_pack_t *pack, const char *path);
+void rom_pack_close(rom_pack_t *pack);
+// Binary searches, the info points into the pack until it is closed
+bool rom_pack_find_hash(const rom_pack_t *pack, uint64_t hash,
+                        rom_info_t *info);
+bool rom_pack_find_name(const rom_pack_t *pack, const char *name,
+                        rom_info_t *info);
+// Entry number index in hash order, for walking the whole pack
+void rom_pack_get(const rom_pack_t *pack, uint32_t index, rom_info_t *info);
+// FNV-1a of the rom bytes
+uint64_t rom_pack_hash(const uint8_t *data, size_t size);
+
+#endif
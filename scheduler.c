@@ -0,0 +1,68 @@
+#include "scheduler.h"
+
+#define NS_PER_SEC 1000000000ull
+
+void scheduler_init(scheduler_t *sched, uint32_t cpu_hz, uint32_t refresh_hz,
+                    uint32_t slice_hz, uint64_t now_ns) {
+  sched->cpu_hz = cpu_hz;
+  sched->refresh_hz = refresh_hz;
+  sched->slice_hz = slice_hz;
+  sched->cpu_acc = 0;
+  sched->timer_acc = 0;
+  sched->render_acc = 0;
+  sched->slice_acc = 0;
+  sched->last_ns = now_ns;
+}
+
+bool scheduler_set_cpu_hz(scheduler_t *sched, uint32_t cpu_hz) {
+  if (cpu_hz == 0) {
+    return false;
+  }
+  sched->cpu_hz = cpu_hz;
+  return true;
+}
+
+void scheduler_advance(scheduler_t *sched, uint64_t now_ns,
+                       scheduler_step_t *step) {
+  uint64_t elapsed = now_ns - sched->last_ns;
+  sched->last_ns = now_ns;
+
+  // After a stall (debugger, window drag) don't try to emulate all of it
+  if (elapsed > SCHEDULER_MAX_CATCH_UP_NS) {
+    elapsed = SCHEDULER_MAX_CATCH_UP_NS;
+  }
+
+  sched->cpu_acc += elapsed * sched->cpu_hz;
+  step->cycles = sched->cpu_acc / NS_PER_SEC;
+  sched->cpu_acc %= NS_PER_SEC;
+
+  sched->timer_acc += elapsed * SCHEDULER_TIMER_HZ;
+  step->timer_ticks = sched->timer_acc / NS_PER_SEC;
+  sched->timer_acc %= NS_PER_SEC;
+
+  // Only the latest of several due refreshes is drawn
+  sched->render_acc += elapsed * sched->refresh_hz;
+  uint64_t frames = sched->render_acc / NS_PER_SEC;
+  sched->render_acc %= NS_PER_SEC;
+  step->render = frames > 0;
+  step->skipped_frames = frames > 1 ? frames - 1 : 0;
+
+  sched->slice_acc += elapsed * sched->slice_hz;
+  sched->slice_acc %= NS_PER_SEC;
+}
+
+static uint64_t ns_until(uint64_t acc, uint32_t hz) {
+  return (NS_PER_SEC - acc + hz - 1) / hz;
+}
+
+uint64_t scheduler_ns_until_next(const scheduler_t *sched, uint64_t now_ns) {
+  uint64_t timer = ns_until(sched->timer_acc, SCHEDULER_TIMER_HZ);
+  uint64_t render = ns_until(sched->render_acc, sched->refresh_hz);
+  uint64_t slice = ns_until(sched->slice_acc, sched->slice_hz);
+  uint64_t next = timer < render ? timer : render;
+  next = slice < next ? slice : next;
+
+  // Time already spent since the last advance, e.g. presenting
+  uint64_t spent = now_ns - sched->last_ns;
+  return spent < next ? next - spent : 0;
+}
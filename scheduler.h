@@ -0,0 +1,43 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCHEDULER_TIMER_HZ 60 // CHIP-8 delay and sound timers
+#define SCHEDULER_MAX_CATCH_UP_NS 250000000ull // Wall time dropped past this
+
+// Fixed-timestep clocks for the CPU, the timers and display refresh.
+// Each accumulator holds elapsed time scaled by its rate so no rounding
+// error builds up between frames. The slice clock only sets how often the
+// caller wakes up to sample input and run the cycles due so far.
+typedef struct {
+  uint32_t cpu_hz;
+  uint32_t refresh_hz;
+  uint32_t slice_hz;
+
+  uint64_t cpu_acc;
+  uint64_t timer_acc;
+  uint64_t render_acc;
+  uint64_t slice_acc;
+  uint64_t last_ns;
+} scheduler_t;
+
+// Work that is due after a call to scheduler_advance
+typedef struct {
+  uint64_t cycles;
+  uint32_t timer_ticks;
+  bool render;
+  uint32_t skipped_frames; // Refreshes that were due but dropped
+} scheduler_step_t;
+
+void scheduler_init(scheduler_t *sched, uint32_t cpu_hz, uint32_t refresh_hz,
+                    uint32_t slice_hz, uint64_t now_ns);
+// False, leaving the rate as it was, for 0
+bool scheduler_set_cpu_hz(scheduler_t *sched, uint32_t cpu_hz);
+void scheduler_advance(scheduler_t *sched, uint64_t now_ns,
+                       scheduler_step_t *step);
+// Nanoseconds from now_ns until the next slice, timer tick or refresh is due
+uint64_t scheduler_ns_until_next(const scheduler_t *sched, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,256 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+#define REAP_INTERVAL 60 // Frames between checks for clients that died
+
+// POSIX shared memory names start with a slash
+static void shm_path(char *path, size_t size, const char *name) {
+  snprintf(path, size, "/%s", name);
+}
+
+static chip8_shm_block_t *map_block(int fd) {
+  void *block = mmap(NULL, sizeof(chip8_shm_block_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+  if (block == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  return block;
+}
+
+static bool process_alive(pid_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+bool chip8_shm_host_open(chip8_shm_t *shm, const char *name, const char *rom,
+                         uint32_t cpu_hz) {
+  memset(shm, 0, sizeof(chip8_shm_t));
+  snprintf(shm->name, sizeof(shm->name), "%s", name);
+  shm->host = true;
+  shm->client = -1;
+
+  char path[CHIP8_SHM_NAME_SIZE + 1];
+  shm_path(path, sizeof(path), name);
+
+  // A block left behind by a host that crashed is replaced, a running host
+  // keeps its own
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    chip8_shm_t old;
+    if (chip8_shm_attach(&old, name)) {
+      bool running = chip8_shm_host_alive(&old);
+      chip8_shm_detach(&old);
+      if (running) {
+        fprintf(stderr, "%s is served by a running host\n", name);
+        return false;
+      }
+    }
+    shm_unlink(path);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  }
+  if (fd < 0) {
+    perror("shm_open");
+    return false;
+  }
+
+  if (ftruncate(fd, sizeof(chip8_shm_block_t)) != 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(path);
+    return false;
+  }
+  shm->block = map_block(fd);
+  close(fd);
+  if (!shm->block) {
+    shm_unlink(path);
+    return false;
+  }
+
+  // ftruncate zeroed the block, every seq starts even and every slot free
+  chip8_shm_block_t *block = shm->block;
+  block->version = CHIP8_SHM_VERSION;
+  block->size = sizeof(chip8_shm_block_t);
+  block->cpu_hz = cpu_hz;
+  snprintf(block->rom, sizeof(block->rom), "%s", rom);
+  atomic_store_explicit(&block->host_pid, getpid(), memory_order_relaxed);
+  atomic_store_explicit(&block->magic, CHIP8_SHM_MAGIC, memory_order_release);
+  return true;
+}
+
+void chip8_shm_host_close(chip8_shm_t *shm) {
+  // Attached clients keep their mapping and see the host gone
+  atomic_store_explicit(&shm->block->host_pid, 0, memory_order_release);
+  munmap(shm->block, sizeof(chip8_shm_block_t));
+  shm->block = NULL;
+
+  char path[CHIP8_SHM_NAME_SIZE + 1];
+  shm_path(path, sizeof(path), shm->name);
+  shm_unlink(path);
+}
+
+// Frees the slots of clients that exited without detaching, their keys
+// would otherwise stay held down
+static void reap_clients(chip8_shm_block_t *block) {
+  for (int i = 0; i < CHIP8_SHM_CLIENTS; i++) {
+    chip8_shm_client_t *client = &block->clients[i];
+    pid_t pid = atomic_load_explicit(&client->pid, memory_order_relaxed);
+    if (pid && !process_alive(pid)) {
+      atomic_store_explicit(&client->keys, 0, memory_order_relaxed);
+      atomic_compare_exchange_strong(&client->pid, &pid, 0);
+    }
+  }
+}
+
+void chip8_shm_publish(chip8_shm_t *shm, const chip8_t *chip8) {
+  chip8_shm_block_t *block = shm->block;
+  uint64_t frame =
+      atomic_load_explicit(&block->latest, memory_order_relaxed) + 1;
+  chip8_shm_frame_t *slot = &block->frames[frame & (CHIP8_SHM_FRAMES - 1)];
+
+  // Readers of this slot are CHIP8_SHM_FRAMES frames behind, they see the
+  // odd seq or a changed one and retry with the newest frame
+  uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  slot->frame = frame;
+  slot->hires = chip8->hires;
+  slot->sound = chip8->sound_timer > 0;
+  memcpy(slot->display, chip8->display, sizeof(slot->display));
+
+  atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+  atomic_store_explicit(&block->latest, frame, memory_order_release);
+
+  if (frame % REAP_INTERVAL == 0) {
+    reap_clients(block);
+  }
+}
+
+uint16_t chip8_shm_keys(chip8_shm_t *shm) {
+  uint16_t keys = 0;
+  for (int i = 0; i < CHIP8_SHM_CLIENTS; i++) {
+    keys |= atomic_load_explicit(&shm->block->clients[i].keys,
+                                 memory_order_relaxed);
+  }
+  return keys;
+}
+
+bool chip8_shm_stop_requested(const chip8_shm_t *shm) {
+  return atomic_load_explicit(&shm->block->stop, memory_order_relaxed);
+}
+
+bool chip8_shm_attach(chip8_shm_t *shm, const char *name) {
+  memset(shm, 0, sizeof(chip8_shm_t));
+  snprintf(shm->name, sizeof(shm->name), "%s", name);
+  shm->client = -1;
+
+  char path[CHIP8_SHM_NAME_SIZE + 1];
+  shm_path(path, sizeof(path), name);
+  int fd = shm_open(path, O_RDWR, 0);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(chip8_shm_block_t)) {
+    fprintf(stderr, "%s is not a CHIP-8 host\n", name);
+    close(fd);
+    return false;
+  }
+  shm->block = map_block(fd);
+  close(fd);
+  if (!shm->block) {
+    return false;
+  }
+
+  chip8_shm_block_t *block = shm->block;
+  if (atomic_load_explicit(&block->magic, memory_order_acquire) !=
+          CHIP8_SHM_MAGIC ||
+      block->version != CHIP8_SHM_VERSION ||
+      block->size != sizeof(chip8_shm_block_t)) {
+    fprintf(stderr, "%s is not a CHIP-8 host of this version\n", name);
+    munmap(block, sizeof(chip8_shm_block_t));
+    shm->block = NULL;
+    return false;
+  }
+
+  // Without a free slot the client can still watch, it just can't press keys
+  pid_t self = getpid();
+  for (int i = 0; i < CHIP8_SHM_CLIENTS && shm->client < 0; i++) {
+    pid_t free_slot = 0;
+    if (atomic_compare_exchange_strong(&block->clients[i].pid, &free_slot,
+                                       self)) {
+      shm->client = i;
+    }
+  }
+  if (shm->client < 0) {
+    fprintf(stderr, "%s has no free keypad, watching only\n", name);
+  }
+  return true;
+}
+
+void chip8_shm_detach(chip8_shm_t *shm) {
+  if (shm->client >= 0) {
+    chip8_shm_client_t *client = &shm->block->clients[shm->client];
+    atomic_store_explicit(&client->keys, 0, memory_order_relaxed);
+    atomic_store_explicit(&client->pid, 0, memory_order_release);
+  }
+  munmap(shm->block, sizeof(chip8_shm_block_t));
+  shm->block = NULL;
+}
+
+void chip8_shm_set_keys(chip8_shm_t *shm, uint16_t keys) {
+  if (shm->client >= 0) {
+    atomic_store_explicit(&shm->block->clients[shm->client].keys, keys,
+                          memory_order_relaxed);
+  }
+}
+
+bool chip8_shm_read(chip8_shm_t *shm, chip8_shm_frame_t *frame) {
+  chip8_shm_block_t *block = shm->block;
+
+  while (true) {
+    uint64_t latest =
+        atomic_load_explicit(&block->latest, memory_order_acquire);
+    if (latest == shm->seen) {
+      return false;
+    }
+
+    const chip8_shm_frame_t *slot =
+        &block->frames[latest & (CHIP8_SHM_FRAMES - 1)];
+    uint32_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (before & 1) {
+      continue; // Lapped by the host mid write, a newer frame is coming
+    }
+
+    frame->frame = slot->frame;
+    frame->hires = slot->hires;
+    frame->sound = slot->sound;
+    memcpy(frame->display, slot->display, sizeof(frame->display));
+
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (before == after) {
+      shm->seen = frame->frame;
+      return true;
+    }
+  }
+}
+
+bool chip8_shm_host_alive(const chip8_shm_t *shm) {
+  return process_alive(
+      atomic_load_explicit(&shm->block->host_pid, memory_order_acquire));
+}
+
+void chip8_shm_request_stop(chip8_shm_t *shm) {
+  atomic_store_explicit(&shm->block->stop, true, memory_order_relaxed);
+}
@@ -0,0 +1,83 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chip8.h"
+
+#define CHIP8_SHM_MAGIC 0x4D485338 // "8SHM"
+#define CHIP8_SHM_VERSION 1
+#define CHIP8_SHM_FRAMES 8   // Frames in the ring, a power of two
+#define CHIP8_SHM_CLIENTS 16 // Viewers and agents attached at once
+#define CHIP8_SHM_NAME_SIZE 64
+
+// One published frame. The host makes seq odd while it writes the slot and
+// even again once done, a reader that saw the same even seq before and after
+// its copy got the whole frame.
+typedef struct {
+  _Alignas(64) _Atomic uint32_t seq;
+  uint64_t frame; // Frames the host had run when it published this one
+  bool hires;
+  bool sound; // Sound timer running
+  uint64_t display[CHIP8_NUM_PLANES][CHIP8_HIRES_HEIGHT][CHIP8_ROW_WORDS];
+} chip8_shm_frame_t;
+
+// A viewer or agent's keypad. The host presses a key when any client holds
+// it down, and frees slots of clients that exited without detaching.
+typedef struct {
+  _Alignas(64) _Atomic pid_t pid; // 0 when free
+  _Atomic uint16_t keys;          // Bit n is key n
+} chip8_shm_client_t;
+
+// The shared mapping, the same layout in every process
+typedef struct {
+  // Control block, magic is stored last so clients never see a half made
+  // block
+  _Atomic uint32_t magic;
+  uint32_t version;
+  uint32_t size; // sizeof(chip8_shm_block_t)
+  uint32_t cpu_hz;
+  char rom[CHIP8_SHM_NAME_SIZE];
+  _Atomic pid_t host_pid;  // 0 once the host has exited
+  _Atomic bool stop;       // Any client can ask the host to exit
+  _Atomic uint64_t latest; // Newest complete frame, 0 before the first
+
+  chip8_shm_client_t clients[CHIP8_SHM_CLIENTS];
+  chip8_shm_frame_t frames[CHIP8_SHM_FRAMES];
+} chip8_shm_block_t;
+
+// A process's view of the mapping
+typedef struct {
+  chip8_shm_block_t *block;
+  char name[CHIP8_SHM_NAME_SIZE];
+  bool host;
+  int client; // Slot of an attached client, -1 for the host
+  uint64_t seen; // Newest frame a client has read
+} chip8_shm_t;
+
+// Host side, one per name. Creates /name (replacing a stale one left by a
+// host that crashed) and removes it again on close.
+bool chip8_shm_host_open(chip8_shm_t *shm, const char *name, const char *rom,
+                         uint32_t cpu_hz);
+void chip8_shm_host_close(chip8_shm_t *shm);
+// Copies the display into the next slot of the ring, never waits on readers
+void chip8_shm_publish(chip8_shm_t *shm, const chip8_t *chip8);
+// Keys held down by any client
+uint16_t chip8_shm_keys(chip8_shm_t *shm);
+bool chip8_shm_stop_requested(const chip8_shm_t *shm);
+
+// Client side, any number of processes
+bool chip8_shm_attach(chip8_shm_t *shm, const char *name);
+void chip8_shm_detach(chip8_shm_t *shm);
+void chip8_shm_set_keys(chip8_shm_t *shm, uint16_t keys);
+// Copies the newest frame into frame when it is newer than the last one
+// read, false when there is nothing new
+bool chip8_shm_read(chip8_shm_t *shm, chip8_shm_frame_t *frame);
+// False once the host has exited
+bool chip8_shm_host_alive(const chip8_shm_t *shm);
+void chip8_shm_request_stop(chip8_shm_t *shm);
+
+#endif
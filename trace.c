@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define WRITER_IDLE_NS 100000 // Writer sleep when the ring is empty
+#define WRITER_BATCH 1024     // Records encoded per fwrite
+
+static uint8_t *put_le(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    *p++ = value >> (i * 8);
+  }
+  return p;
+}
+
+static uint64_t get_le(const uint8_t **p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)(*p)[i] << (i * 8);
+  }
+  *p += bytes;
+  return value;
+}
+
+// Writes every published record, returns how many
+static uint64_t drain(chip8_trace_t *trace) {
+  uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+  // Encoded in batches so the file sees few large writes, on the writer
+  // thread's stack so traces don't share it
+  uint8_t buf[WRITER_BATCH * CHIP8_TRACE_RECORD_SIZE];
+  uint8_t *p = buf;
+
+  for (uint64_t i = tail; i < head; i++) {
+    const chip8_trace_record_t *record =
+        &trace->records[i & (trace->capacity - 1)];
+
+    p = put_le(p, record->cycle, 8);
+    p = put_le(p, record->pc, 2);
+    p = put_le(p, record->opcode, 2);
+    p = put_le(p, record->I, 2);
+    p = put_le(p, record->changed, 2);
+    memcpy(p, record->V, 16);
+    p += 16;
+
+    if (p == buf + sizeof(buf) || i + 1 == head) {
+      fwrite(buf, 1, p - buf, trace->file);
+      p = buf;
+      // Hand the written slots back to the producer
+      atomic_store_explicit(&trace->tail, i + 1, memory_order_release);
+    }
+  }
+
+  return head - tail;
+}
+
+static void *writer_main(void *arg) {
+  chip8_trace_t *trace = arg;
+
+  while (!atomic_load_explicit(&trace->stop, memory_order_acquire)) {
+    if (drain(trace) == 0) {
+      struct timespec idle = {0, WRITER_IDLE_NS};
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  drain(trace);
+  return NULL;
+}
+
+bool chip8_trace_open(chip8_trace_t *trace, const char *path) {
+  memset(trace, 0, sizeof(chip8_trace_t));
+  trace->capacity = CHIP8_TRACE_CAPACITY;
+
+  trace->records = malloc(trace->capacity * sizeof(chip8_trace_record_t));
+  if (!trace->records) {
+    perror("malloc");
+    return false;
+  }
+
+  trace->file = fopen(path, "wb");
+  if (!trace->file) {
+    perror("fopen");
+    free(trace->records);
+    return false;
+  }
+
+  uint8_t header[8];
+  memcpy(header, "C8TR", 4);
+  put_le(put_le(header + 4, CHIP8_TRACE_VERSION, 2), CHIP8_TRACE_RECORD_SIZE,
+         2);
+  fwrite(header, 1, sizeof(header), trace->file);
+
+  atomic_init(&trace->head, 0);
+  atomic_init(&trace->tail, 0);
+  atomic_init(&trace->stop, false);
+
+  if (pthread_create(&trace->writer, NULL, writer_main, trace) != 0) {
+    fprintf(stderr, "Could not start trace writer\n");
+    fclose(trace->file);
+    free(trace->records);
+    return false;
+  }
+
+  return true;
+}
+
+void chip8_trace_step(chip8_trace_t *trace, const chip8_t *chip8, uint16_t pc,
+                      uint16_t opcode) {
+  uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  uint64_t cycle = trace->cycle++;
+
+  // Only reload the consumer position when the cached one says full
+  if (head - trace->cached_tail == trace->capacity) {
+    trace->cached_tail =
+        atomic_load_explicit(&trace->tail, memory_order_acquire);
+    if (head - trace->cached_tail == trace->capacity) {
+      trace->dropped++;
+      return;
+    }
+  }
+
+  chip8_trace_record_t *record = &trace->records[head & (trace->capacity - 1)];
+  record->cycle = cycle;
+  record->pc = pc;
+  record->opcode = opcode;
+  record->I = chip8->I;
+  record->changed = 0;
+  for (int i = 0; i < 16; i++) {
+    record->changed |= (chip8->V[i] != trace->last_V[i]) << i;
+  }
+  memcpy(record->V, chip8->V, 16);
+  memcpy(trace->last_V, chip8->V, 16);
+
+  // Publish the record
+  atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+bool chip8_trace_close(chip8_trace_t *trace) {
+  atomic_store_explicit(&trace->stop, true, memory_order_release);
+  pthread_join(trace->writer, NULL);
+
+  if (trace->dropped) {
+    fprintf(stderr, "Trace dropped %llu records, the writer fell behind\n",
+            (unsigned long long)trace->dropped);
+  }
+
+  bool ok = fclose(trace->file) == 0;
+  if (!ok) {
+    perror("fclose");
+  }
+  free(trace->records);
+  trace->records = NULL;
+  return ok;
+}
+
+bool chip8_trace_read_header(FILE *file) {
+  uint8_t header[8];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, "C8TR", 4) != 0) {
+    fprintf(stderr, "Not a CHIP-8 trace\n");
+    return false;
+  }
+
+  const uint8_t *p = header + 4;
+  uint16_t version = get_le(&p, 2);
+  uint16_t record_size = get_le(&p, 2);
+  if (version != CHIP8_TRACE_VERSION ||
+      record_size != CHIP8_TRACE_RECORD_SIZE) {
+    fprintf(stderr, "Unsupported trace version %u\n", version);
+    return false;
+  }
+
+  return true;
+}
+
+bool chip8_trace_read(FILE *file, chip8_trace_record_t *record) {
+  uint8_t buf[CHIP8_TRACE_RECORD_SIZE];
+  if (fread(buf, 1, sizeof(buf), file) != sizeof(buf)) {
+    return false;
+  }
+
+  const uint8_t *p = buf;
+  record->cycle = get_le(&p, 8);
+  record->pc = get_le(&p, 2);
+  record->opcode = get_le(&p, 2);
+  record->I = get_le(&p, 2);
+  record->changed = get_le(&p, 2);
+  memcpy(record->V, p, 16);
+  return true;
+}
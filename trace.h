@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Trace file, all values little-endian:
+//   "C8TR", u16 version, u16 record size
+//   records of u64 cycle, u16 pc, u16 opcode, u16 I, u16 changed, u8 V[16]
+// pc, opcode and cycle describe the executed instruction, I and V the state
+// right after it. Bit n of changed is set when Vn differs from the previous
+// record.
+#define CHIP8_TRACE_VERSION 1
+#define CHIP8_TRACE_RECORD_SIZE 32
+#define CHIP8_TRACE_CAPACITY 65536 // Records in flight, a power of two
+
+typedef struct {
+  uint64_t cycle;
+  uint16_t pc;
+  uint16_t opcode;
+  uint16_t I;
+  uint16_t changed;
+  uint8_t V[16];
+} chip8_trace_record_t;
+
+// Single producer, single consumer ring. chip8_cycle appends records and a
+// writer thread drains them to the file. A full ring drops records rather
+// than stalling the emulator.
+typedef struct chip8_trace {
+  chip8_trace_record_t *records;
+  size_t capacity;
+
+  // Producer side, only touched by the emulating thread
+  uint64_t cycle;
+  uint64_t cached_tail;
+  uint64_t dropped;
+  uint8_t last_V[16];
+
+  // Next record to write and next record to drain, kept apart on their own
+  // cache lines
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+
+  _Atomic bool stop;
+  FILE *file;
+  pthread_t writer;
+} chip8_trace_t;
+
+// Opens path and starts the writer thread, attach with chip8->trace = trace
+bool chip8_trace_open(chip8_trace_t *trace, const char *path);
+// Called by chip8_cycle after the instruction at pc executed
+void chip8_trace_step(chip8_trace_t *trace, const chip8_t *chip8, uint16_t pc,
+                      uint16_t opcode);
+// Detach first, then drains what is left and closes the file
+bool chip8_trace_close(chip8_trace_t *trace);
+
+// Checks the header of a trace file opened for reading
+bool chip8_trace_read_header(FILE *file);
+// Reads one record from a trace file, false at the end
+bool chip8_trace_read(FILE *file, chip8_trace_record_t *record);
+
+#endif
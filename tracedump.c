@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "trace.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s <trace file>\n", prog);
+}
+
+// Writes the mnemonic of opcode to buf
+static void disassemble(uint16_t opcode, char *buf, size_t size) {
+  chip8_instr_t in;
+  chip8_decode(&in, opcode);
+  const int N = in.NN & 0x0F;
+
+  switch (in.op) {
+  case CHIP8_OP_0NNN:
+    snprintf(buf, size, "SYS %03x", in.NNN);
+    break;
+  case CHIP8_OP_00E0:
+    snprintf(buf, size, "CLS");
+    break;
+  case CHIP8_OP_00EE:
+    snprintf(buf, size, "RET");
+    break;
+  case CHIP8_OP_1NNN:
+    snprintf(buf, size, "JP %03x", in.NNN);
+    break;
+  case CHIP8_OP_2NNN:
+    snprintf(buf, size, "CALL %03x", in.NNN);
+    break;
+  case CHIP8_OP_3XNN:
+    snprintf(buf, size, "SE V%X, %02x", in.X, in.NN);
+    break;
+  case CHIP8_OP_4XNN:
+    snprintf(buf, size, "SNE V%X, %02x", in.X, in.NN);
+    break;
+  case CHIP8_OP_5XY0:
+    snprintf(buf, size, "SE V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_6XNN:
+    snprintf(buf, size, "LD V%X, %02x", in.X, in.NN);
+    break;
+  case CHIP8_OP_7XNN:
+    snprintf(buf, size, "ADD V%X, %02x", in.X, in.NN);
+    break;
+  case CHIP8_OP_8XY0:
+    snprintf(buf, size, "LD V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XY1:
+    snprintf(buf, size, "OR V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XY2:
+    snprintf(buf, size, "AND V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XY3:
+    snprintf(buf, size, "XOR V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XY4:
+    snprintf(buf, size, "ADD V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XY5:
+    snprintf(buf, size, "SUB V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XY6:
+    snprintf(buf, size, "SHR V%X", in.X);
+    break;
+  case CHIP8_OP_8XY7:
+    snprintf(buf, size, "SUBN V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_8XYE:
+    snprintf(buf, size, "SHL V%X", in.X);
+    break;
+  case CHIP8_OP_9XY0:
+    snprintf(buf, size, "SNE V%X, V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_ANNN:
+    snprintf(buf, size, "LD I, %03x", in.NNN);
+    break;
+  case CHIP8_OP_BNNN:
+    snprintf(buf, size, "JP V0, %03x", in.NNN);
+    break;
+  case CHIP8_OP_CXNN:
+    snprintf(buf, size, "RND V%X, %02x", in.X, in.NN);
+    break;
+  case CHIP8_OP_DXYN:
+    snprintf(buf, size, "DRW V%X, V%X, %X", in.X, in.Y, N);
+    break;
+  case CHIP8_OP_EX9E:
+    snprintf(buf, size, "SKP V%X", in.X);
+    break;
+  case CHIP8_OP_EXA1:
+    snprintf(buf, size, "SKNP V%X", in.X);
+    break;
+  case CHIP8_OP_FX07:
+    snprintf(buf, size, "LD V%X, DT", in.X);
+    break;
+  case CHIP8_OP_FX0A:
+    snprintf(buf, size, "LD V%X, K", in.X);
+    break;
+  case CHIP8_OP_FX15:
+    snprintf(buf, size, "LD DT, V%X", in.X);
+    break;
+  case CHIP8_OP_FX18:
+    snprintf(buf, size, "LD ST, V%X", in.X);
+    break;
+  case CHIP8_OP_FX1E:
+    snprintf(buf, size, "ADD I, V%X", in.X);
+    break;
+  case CHIP8_OP_FX29:
+    snprintf(buf, size, "LD F, V%X", in.X);
+    break;
+  case CHIP8_OP_FX33:
+    snprintf(buf, size, "LD B, V%X", in.X);
+    break;
+  case CHIP8_OP_FX55:
+    snprintf(buf, size, "LD [I], V%X", in.X);
+    break;
+  case CHIP8_OP_FX65:
+    snprintf(buf, size, "LD V%X, [I]", in.X);
+    break;
+  case CHIP8_OP_00CN:
+    snprintf(buf, size, "SCD %X", N);
+    break;
+  case CHIP8_OP_00DN:
+    snprintf(buf, size, "SCU %X", N);
+    break;
+  case CHIP8_OP_00FB:
+    snprintf(buf, size, "SCR");
+    break;
+  case CHIP8_OP_00FC:
+    snprintf(buf, size, "SCL");
+    break;
+  case CHIP8_OP_00FD:
+    snprintf(buf, size, "EXIT");
+    break;
+  case CHIP8_OP_00FE:
+    snprintf(buf, size, "LOW");
+    break;
+  case CHIP8_OP_00FF:
+    snprintf(buf, size, "HIGH");
+    break;
+  case CHIP8_OP_5XY2:
+    snprintf(buf, size, "LD [I], V%X-V%X", in.X, in.Y);
+    break;
+  case CHIP8_OP_5XY3:
+    snprintf(buf, size, "LD V%X-V%X, [I]", in.X, in.Y);
+    break;
+  case CHIP8_OP_F000:
+    snprintf(buf, size, "LD I, long");
+    break;
+  case CHIP8_OP_FN01:
+    snprintf(buf, size, "PLANE %X", in.X);
+    break;
+  case CHIP8_OP_F002:
+    snprintf(buf, size, "AUDIO");
+    break;
+  case CHIP8_OP_FX30:
+    snprintf(buf, size, "LD HF, V%X", in.X);
+    break;
+  case CHIP8_OP_FX3A:
+    snprintf(buf, size, "PITCH V%X", in.X);
+    break;
+  case CHIP8_OP_FX75:
+    snprintf(buf, size, "LD R, V%X", in.X);
+    break;
+  case CHIP8_OP_FX85:
+    snprintf(buf, size, "LD V%X, R", in.X);
+    break;
+  default:
+    snprintf(buf, size, "???");
+    break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *file = fopen(argv[1], "rb");
+  if (!file) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  if (!chip8_trace_read_header(file)) {
+    fclose(file);
+    exit(EXIT_FAILURE);
+  }
+
+  chip8_trace_record_t record;
+  uint64_t expected = 0;
+  while (chip8_trace_read(file, &record)) {
+    // Cycles missing from the sequence were dropped by a full ring
+    if (record.cycle != expected) {
+      printf("... %llu records dropped\n",
+             (unsigned long long)(record.cycle - expected));
+    }
+    expected = record.cycle + 1;
+
+    char text[24];
+    disassemble(record.opcode, text, sizeof(text));
+    printf("%10llu  %03x  %04x  %-16s I=%03x",
+           (unsigned long long)record.cycle, record.pc, record.opcode, text,
+           record.I);
+    for (int i = 0; i < 16; i++) {
+      if (record.changed & (1 << i)) {
+        printf(" V%X=%02x", i, record.V[i]);
+      }
+    }
+    printf("\n");
+  }
+
+  fclose(file);
+  exit(EXIT_SUCCESS);
+}